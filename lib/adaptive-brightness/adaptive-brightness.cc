@@ -0,0 +1,44 @@
+#include "adaptive-brightness.h"
+
+#include <algorithm>
+
+void AdaptiveBrightness::UpdateDark(const uint16_t ambient) {
+  daylight_ = ambient;
+  dark_reading_pending_ = true;
+}
+
+void AdaptiveBrightness::Update(const uint16_t ambient,
+                                const uint16_t duty_cycle) {
+  if (duty_cycle == 0) {
+    UpdateDark(ambient);
+    return;
+  }
+
+  if (dark_reading_pending_ && duty_cycle >= kMinLearningDutyCycle) {
+    // Assume that the daylight hasn't changed since the dark reading.
+    dark_reading_pending_ = false;
+    const uint32_t rise = ambient > daylight_ ? ambient - daylight_ : 0;
+    const uint32_t gain = rise * led_dimming::kMaxDutyCycle / duty_cycle;
+    // Smooth out noise from one turn-on to the next.
+    led_gain_ = led_gain_ == 0 ? gain : (3 * led_gain_ + gain) / 4;
+  }
+
+  const uint32_t led_contribution =
+      (static_cast<uint64_t>(led_gain_) * duty_cycle +
+       led_dimming::kMaxDutyCycle / 2) /
+      led_dimming::kMaxDutyCycle;
+  daylight_ = ambient > led_contribution ? ambient - led_contribution : 0;
+}
+
+uint16_t AdaptiveBrightness::GetDutyCycle(const uint16_t target) const {
+  if (daylight_ >= target) {
+    return 0;
+  }
+  if (led_gain_ == 0) {
+    return led_dimming::kMaxDutyCycle;
+  }
+  const uint32_t missing = target - daylight_;
+  return std::min<uint32_t>(
+      missing * led_dimming::kMaxDutyCycle / led_gain_,
+      led_dimming::kMaxDutyCycle);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <types.h>
+
+#include "led-dimming.h"
+
+// Works out how much light the LED needs to add to the daylight to reach a
+// target illuminance.
+//
+// The ambient light sensor sees the LED's own light as well as the daylight.
+// The LED's contribution is learned from the step in the reading when it turns
+// on, and then subtracted from readings taken while it's on.
+class AdaptiveBrightness {
+ public:
+  // Duty cycles are linear, out of led_dimming::kMaxDutyCycle. Steps smaller
+  // than this are too small to learn the LED's contribution from.
+  static constexpr uint32_t kMinLearningDutyCycle =
+      led_dimming::kMaxDutyCycle / 16;
+
+  // Accounts for a reading taken with the LED off, so all of it is daylight.
+  void UpdateDark(uint16_t ambient);
+
+  // Accounts for a reading taken with the LED settled at `duty_cycle`.
+  void Update(uint16_t ambient, uint16_t duty_cycle);
+
+  // Returns the duty cycle needed to bring the illuminance up to `target`. This
+  // is full power until the LED's contribution has been learned.
+  uint16_t GetDutyCycle(uint16_t target) const;
+
+  // The estimated daylight, in the same units as the readings.
+  uint16_t GetDaylight() const { return daylight_; }
+
+  // How much the reading rises with the LED at full power, or 0 if this hasn't
+  // been learned yet.
+  uint32_t GetLedGain() const { return led_gain_; }
+
+ private:
+  uint32_t led_gain_ = 0;
+  uint16_t daylight_ = 0;
+  // Set by a reading with the LED off, until the LED's contribution has been
+  // learned from the next reading with it on.
+  bool dark_reading_pending_ = false;
+};
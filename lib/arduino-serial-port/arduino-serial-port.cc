@@ -3,6 +3,26 @@
 #include <Arduino.h>
 #include <pb_arduino.h>
 
+void ArduinoSerialPort::Begin(uint32_t baud_rate) {
+  baud_rate_ = baud_rate;
+  Serial1.begin(baud_rate);
+}
+
+void ArduinoSerialPort::End() {
+  Serial1.flush();
+  Serial1.end();
+}
+
+bool ArduinoSerialPort::CheckRxBufferFull() {
+  // The core clears the USART overrun flag in its interrupt handler, and
+  // silently drops bytes when its ring buffer is full, so a full ring buffer
+  // is the closest thing to an overrun that we can observe.
+  const bool full = Serial1.available() >= SERIAL_RX_BUFFER_SIZE - 1;
+  const bool newly_full = full && !rx_buffer_was_full_;
+  rx_buffer_was_full_ = full;
+  return newly_full;
+}
+
 int ArduinoSerialPort::available() { return Serial1.available(); }
 
 int ArduinoSerialPort::read() { return Serial1.read(); }
@@ -11,10 +31,6 @@ int ArduinoSerialPort::peek() { return Serial1.peek(); }
 
 size_t ArduinoSerialPort::write(uint8_t c) { return Serial1.write(c); }
 
-pb_istream_s ArduinoSerialPort::BuildPbIstream() {
-  return as_pb_istream(Serial1);
-}
-
 pb_ostream_s ArduinoSerialPort::BuildPbOstream() {
   return as_pb_ostream(Serial1);
 }
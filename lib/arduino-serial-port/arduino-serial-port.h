@@ -8,12 +8,22 @@
 
 class ArduinoSerialPort : public SerialPort {
  public:
+  void Begin(uint32_t baud_rate) override;
+  void End() override;
+  uint32_t GetBaudRate() override { return baud_rate_; }
+  bool CheckRxBufferFull() override;
+
   int available() override;
   int read() override;
   int peek() override;
 
   size_t write(uint8_t c) override;
 
-  pb_istream_s BuildPbIstream() override;
   pb_ostream_s BuildPbOstream() override;
+
+ private:
+  uint32_t baud_rate_ = kDefaultBaudRate;
+  // Whether the receive buffer was full at the last check, so that each time
+  // it fills up is only reported once.
+  bool rx_buffer_was_full_ = false;
 };
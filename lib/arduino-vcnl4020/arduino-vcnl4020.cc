@@ -82,6 +82,20 @@ void ArduinoVCNL4020::SetPeriodicProximity(bool enable) {
   WriteByte(kRegCommand, command_);
 }
 
+void ArduinoVCNL4020::StartAmbientMeasurement() {
+  // On-demand measurements only run while self-timed measurements are off.
+  // ReadAmbient turns them back on.
+  on_demand_pending_ = true;
+  WriteByte(kRegCommand, kCommandAlsOnDemand);
+}
+
+void ArduinoVCNL4020::CancelAmbientMeasurement() {
+  if (on_demand_pending_) {
+    on_demand_pending_ = false;
+    WriteByte(kRegCommand, command_);
+  }
+}
+
 bool ArduinoVCNL4020::AmbientReady() {
   return ReadByte(kRegCommand) & kCommandAlsDataReady;
 }
@@ -89,6 +103,10 @@ bool ArduinoVCNL4020::AmbientReady() {
 uint16_t ArduinoVCNL4020::ReadAmbient() {
   uint16_t result = ReadByte(kRegAlsResultLow);
   result |= ReadByte(kRegAlsResultHigh) << 8;
+  if (on_demand_pending_) {
+    on_demand_pending_ = false;
+    WriteByte(kRegCommand, command_);
+  }
   return result;
 }
 
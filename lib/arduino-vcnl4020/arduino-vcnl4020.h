@@ -34,6 +34,9 @@ class ArduinoVCNL4020 : public VCNL4020 {
 
   void SetPeriodicProximity(bool enable) override;
 
+  void StartAmbientMeasurement() override;
+  void CancelAmbientMeasurement() override;
+
   // Returns true when the ambient measurement is ready. Reset by calls to
   // ReadAmbient.
   bool AmbientReady() override;
@@ -53,6 +56,8 @@ class ArduinoVCNL4020 : public VCNL4020 {
   uint8_t WriteByte(uint8_t register_address, uint8_t data);
 
   uint8_t command_ = 0;
+  // Whether periodic measurements are paused for an on-demand measurement.
+  bool on_demand_pending_ = false;
 
   // Continuous conversion mode disabled
   // ALS measurement rate 1 sample/second
@@ -0,0 +1,179 @@
+#include "battery-estimator.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+constexpr uint64_t kMicroampMillisecondsPerMicroampHour = 60 * 60 * 1000;
+
+uint32_t PercentToMicroampHours(const uint8_t percent) {
+  return BatteryEstimator::kCapacityMicroampHours / 100 * percent;
+}
+
+}  // namespace
+
+void BatteryEstimator::Reset(const uint32_t now_ms,
+                             const uint16_t battery_millivolts) {
+  remaining_microamp_hours_ =
+      PercentToMicroampHours(OpenCircuitPercent(battery_millivolts));
+  used_remainder_ = 0;
+  last_update_ms_ = now_ms;
+  rest_ms_ = 0;
+  duty_cycle_ = 0;
+  previous_duty_cycle_ = 0;
+  duty_cycle_changed_ms_ = now_ms;
+  settled_point_valid_ = false;
+}
+
+void BatteryEstimator::Update(const uint32_t now_ms,
+                              const uint16_t battery_millivolts,
+                              const uint32_t led_duty_cycle,
+                              const ChargeState charge_state) {
+  const uint32_t elapsed_ms = now_ms - last_update_ms_;
+  last_update_ms_ = now_ms;
+
+  if (led_duty_cycle != duty_cycle_) {
+    previous_duty_cycle_ = duty_cycle_;
+    duty_cycle_ = led_duty_cycle;
+    duty_cycle_changed_ms_ = now_ms;
+  }
+  if (charge_state != ChargeState::kDischarging) {
+    // The charger supplies the load, so voltage steps don't reflect the
+    // battery.
+    settled_point_valid_ = false;
+  } else if (now_ms - duty_cycle_changed_ms_ >= kSettleMs) {
+    MeasureInternalResistance({duty_cycle_, battery_millivolts, now_ms});
+  }
+
+  switch (charge_state) {
+    case ChargeState::kCharged:
+      remaining_microamp_hours_ = kCapacityMicroampHours;
+      used_remainder_ = 0;
+      rest_ms_ = 0;
+      return;
+
+    case ChargeState::kCharging:
+      // The charge current isn't known, so hold the estimate until charging
+      // finishes. The voltage is raised while charging, so the cell must relax
+      // again afterwards.
+      rest_ms_ = 0;
+      return;
+
+    case ChargeState::kDischarging:
+      break;
+  }
+
+  used_remainder_ +=
+      static_cast<uint64_t>(
+          EstimateCurrentMicroamps(battery_millivolts, led_duty_cycle)) *
+      elapsed_ms;
+  const uint64_t used = used_remainder_ / kMicroampMillisecondsPerMicroampHour;
+  used_remainder_ %= kMicroampMillisecondsPerMicroampHour;
+  remaining_microamp_hours_ -=
+      std::min<uint64_t>(used, remaining_microamp_hours_);
+
+  if (led_duty_cycle != 0) {
+    rest_ms_ = 0;
+    return;
+  }
+  rest_ms_ = std::min(rest_ms_ + elapsed_ms, kRelaxationMs);
+  if (rest_ms_ >= kRelaxationMs) {
+    remaining_microamp_hours_ =
+        PercentToMicroampHours(OpenCircuitPercent(battery_millivolts));
+    used_remainder_ = 0;
+  }
+}
+
+void BatteryEstimator::MeasureInternalResistance(const LoadPoint &point) {
+  const LoadPoint previous = settled_point_;
+  const bool previous_valid = settled_point_valid_;
+  settled_point_ = point;
+  settled_point_valid_ = true;
+  if (!previous_valid || previous.duty_cycle == point.duty_cycle ||
+      point.millis - previous.millis > kMaxStepIntervalMs) {
+    return;
+  }
+
+  const int32_t step_microamps =
+      static_cast<int32_t>(
+          EstimateCurrentMicroamps(point.millivolts, point.duty_cycle)) -
+      static_cast<int32_t>(
+          EstimateCurrentMicroamps(previous.millivolts, previous.duty_cycle));
+  const int32_t step_millivolts =
+      static_cast<int32_t>(previous.millivolts) - point.millivolts;
+  if (static_cast<uint32_t>(std::abs(step_microamps)) < kMinStepMicroamps) {
+    return;
+  }
+  // mV / uA = kOhm, so mV * 1000000 / uA = mOhm.
+  const int64_t measured = static_cast<int64_t>(step_millivolts) * 1000 *
+                           1000 / step_microamps;
+  const int64_t clamped =
+      std::clamp<int64_t>(measured, kMinInternalResistanceMilliohms,
+                          kMaxInternalResistanceMilliohms);
+
+  // Each step is noisy, so average them. This rounds, so that the average
+  // converges on the measurements.
+  internal_resistance_milliohms_ = static_cast<uint32_t>(
+      (static_cast<int64_t>(internal_resistance_milliohms_) * 7 + clamped + 4) /
+      8);
+}
+
+uint16_t BatteryEstimator::EstimateOpenCircuitMillivolts(
+    const uint16_t battery_millivolts) const {
+  // The filtered voltage lags behind the load, so until it settles, assume the
+  // heavier of the two loads. Otherwise, turning the LED off would briefly
+  // underestimate the voltage.
+  uint32_t load_duty_cycle = duty_cycle_;
+  if (last_update_ms_ - duty_cycle_changed_ms_ < kSettleMs) {
+    load_duty_cycle = std::max(duty_cycle_, previous_duty_cycle_);
+  }
+  const uint32_t sag_millivolts =
+      static_cast<uint64_t>(
+          EstimateCurrentMicroamps(battery_millivolts, load_duty_cycle)) *
+      internal_resistance_milliohms_ / (1000 * 1000);
+  return std::min<uint32_t>(battery_millivolts + sag_millivolts, UINT16_MAX);
+}
+
+uint8_t BatteryEstimator::GetPercent() const {
+  return (static_cast<uint64_t>(remaining_microamp_hours_) * 100 +
+          kCapacityMicroampHours / 2) /
+         kCapacityMicroampHours;
+}
+
+uint32_t BatteryEstimator::GetRuntimeMinutes(
+    const uint16_t battery_millivolts, const uint32_t led_duty_cycle) const {
+  const uint32_t current_microamps =
+      EstimateCurrentMicroamps(battery_millivolts, led_duty_cycle);
+  return static_cast<uint64_t>(remaining_microamp_hours_) * 60 /
+         current_microamps;
+}
+
+uint32_t BatteryEstimator::EstimateCurrentMicroamps(
+    const uint16_t battery_millivolts, const uint32_t led_duty_cycle) {
+  if (battery_millivolts == 0) {
+    return kIdleMicroamps;
+  }
+  // mW / V = mA, so mW * 1000000 / mV = uA.
+  const uint64_t led_microamps =
+      static_cast<uint64_t>(kLedFullPowerMilliwatts) * 1000 * 1000 *
+      std::min(led_duty_cycle, kMaxDutyCycle) /
+      (static_cast<uint64_t>(kMaxDutyCycle) * battery_millivolts);
+  return kIdleMicroamps + led_microamps;
+}
+
+uint8_t BatteryEstimator::OpenCircuitPercent(const uint16_t millivolts) {
+  if (millivolts <= kOcvTable.front().millivolts) {
+    return kOcvTable.front().percent;
+  }
+  for (size_t i = 1; i < kOcvTable.size(); i++) {
+    const OcvPoint &high = kOcvTable[i];
+    if (millivolts < high.millivolts) {
+      const OcvPoint &low = kOcvTable[i - 1];
+      return low.percent + (millivolts - low.millivolts) *
+                               (high.percent - low.percent) /
+                               (high.millivolts - low.millivolts);
+    }
+  }
+  return kOcvTable.back().percent;
+}
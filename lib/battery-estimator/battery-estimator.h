@@ -0,0 +1,134 @@
+#pragma once
+
+#include <types.h>
+
+#include <array>
+
+// Estimates the battery's state of charge. LiFePO4 cells have a very flat
+// discharge curve, and the LED load pulls the voltage down by a varying amount,
+// so the voltage alone is a poor estimate.
+//
+// Instead, this counts the charge used, using a model of the current drawn at
+// each LED duty cycle. Whenever the LED has been off for long enough that the
+// cell has relaxed, the count is re-anchored using the open-circuit voltage.
+//
+// This also estimates the battery's internal resistance (including the holder
+// and wiring), from the voltage steps when the LED turns on or off. This is
+// used to estimate the open-circuit voltage while the LED is on.
+class BatteryEstimator {
+ public:
+  enum class ChargeState {
+    kDischarging,
+    kCharging,
+    kCharged,
+  };
+
+  // Starts estimating from the battery voltage, which is assumed to be the
+  // open-circuit voltage.
+  void Reset(uint32_t now_ms, uint16_t battery_millivolts);
+
+  // Accounts for the time since the last update. `led_duty_cycle` is the LED's
+  // duty cycle over that time, out of kMaxDutyCycle.
+  void Update(uint32_t now_ms, uint16_t battery_millivolts,
+              uint32_t led_duty_cycle, ChargeState charge_state);
+
+  // The state of charge, from 0 to 100.
+  uint8_t GetPercent() const;
+
+  uint32_t GetRemainingMicroampHours() const {
+    return remaining_microamp_hours_;
+  }
+
+  uint32_t GetInternalResistanceMilliohms() const {
+    return internal_resistance_milliohms_;
+  }
+
+  // Estimates the open-circuit voltage from the voltage under the current load,
+  // by adding back the sag across the internal resistance.
+  uint16_t EstimateOpenCircuitMillivolts(uint16_t battery_millivolts) const;
+
+  // Estimates how long the battery would last with the LED at this duty cycle.
+  uint32_t GetRuntimeMinutes(uint16_t battery_millivolts,
+                             uint32_t led_duty_cycle) const;
+
+  // Returns the modelled current draw, in microamps.
+  static uint32_t EstimateCurrentMicroamps(uint16_t battery_millivolts,
+                                           uint32_t led_duty_cycle);
+
+  // Returns the state of charge for an open-circuit voltage, in percent.
+  static uint8_t OpenCircuitPercent(uint16_t millivolts);
+
+  // See doc/DESIGN.md: the battery is an 1800mAh LiFePO4 18650 cell.
+  static constexpr uint32_t kCapacityMicroampHours = 1800 * 1000;
+
+  // LED duty cycles are linear, i.e. proportional to power.
+  static constexpr uint32_t kMaxDutyCycle = UINT16_MAX;
+
+  // The LED driver is a boost converter, so it draws roughly constant power:
+  // ~340mA at 3.5V, ~390mA at 3.2V, and ~440mA at 3.0V at full brightness.
+  static constexpr uint32_t kLedFullPowerMilliwatts = 1250;
+
+  // Average draw with the LED off, which is mostly spent asleep.
+  static constexpr uint32_t kIdleMicroamps = 100;
+
+  // How long the LED must be off before the voltage is treated as the
+  // open-circuit voltage.
+  static constexpr uint32_t kRelaxationMs = 10 * 60 * 1000;
+
+  // Typical for an 18650 LiFePO4 cell and holder.
+  static constexpr uint32_t kDefaultInternalResistanceMilliohms = 150;
+  static constexpr uint32_t kMinInternalResistanceMilliohms = 20;
+  static constexpr uint32_t kMaxInternalResistanceMilliohms = 1000;
+
+  // The filtered voltage settles this long after the LED changes.
+  static constexpr uint32_t kSettleMs = 500;
+  // Voltage steps are only measured across LED changes at least this large,
+  // and no further apart than this, so that noise and discharge don't swamp
+  // them.
+  static constexpr uint32_t kMinStepMicroamps = 100 * 1000;
+  static constexpr uint32_t kMaxStepIntervalMs = 5 * 1000;
+
+  struct OcvPoint {
+    uint16_t millivolts;
+    uint8_t percent;
+  };
+  // Typical resting voltages of a LiFePO4 cell, in increasing order.
+  static constexpr std::array<OcvPoint, 12> kOcvTable = {{
+      {2500, 0},
+      {3000, 9},
+      {3200, 17},
+      {3220, 30},
+      {3250, 40},
+      {3260, 50},
+      {3270, 60},
+      {3280, 70},
+      {3300, 80},
+      {3320, 90},
+      {3350, 99},
+      {3400, 100},
+  }};
+
+ private:
+  uint32_t remaining_microamp_hours_ = kCapacityMicroampHours;
+  // Charge used which hasn't been subtracted yet, in microamp-milliseconds.
+  uint64_t used_remainder_ = 0;
+  uint32_t last_update_ms_ = 0;
+  uint32_t rest_ms_ = 0;
+
+  // Tracks the LED load, and the last time the voltage was settled.
+  struct LoadPoint {
+    uint32_t duty_cycle;
+    uint16_t millivolts;
+    uint32_t millis;
+  };
+  // Measures the internal resistance, if the load changed since the last
+  // settled point.
+  void MeasureInternalResistance(const LoadPoint &point);
+
+  uint32_t internal_resistance_milliohms_ = kDefaultInternalResistanceMilliohms;
+  uint32_t duty_cycle_ = 0;
+  uint32_t previous_duty_cycle_ = 0;
+  uint32_t duty_cycle_changed_ms_ = 0;
+  bool settled_point_valid_ = false;
+  LoadPoint settled_point_ = {};
+};
@@ -1,92 +1,374 @@
 #include "config-storage.h"
 
+#include <arduino-timer.h>
 #include <pb_decode.h>
 #include <pb_encode.h>
 #include <types.h>
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+
 #include "serial.pb.h"
 
-constexpr size_t kEepromOffset = sizeof(uint32_t) * 3;
-constexpr size_t kEepromDataMaxSize = 2 * 1024 - kEepromOffset;
+namespace {
 
-bool nanopbOutputCallback(pb_ostream_t *stream, const uint8_t *buf,
-                          size_t count) {
-  if (buf == nullptr) {
-    return false;
-  }
+using RecordHeader = ConfigStorage::RecordHeader;
+
+// The CRC covers everything after the CRC field.
+constexpr size_t kCrcStart = offsetof(RecordHeader, sequence);
+
+// A region of the EEPROM which holds records of one type.
+struct Journal {
+  size_t offset;
+  size_t size;
+  // Where the first record is written.
+  size_t first_record;
+  size_t max_payload_length;
+  uint16_t version;
+
+  size_t end() const { return offset + size; }
+};
+
+constexpr Journal kConfigJournal = {
+    ConfigStorage::kJournalOffset, ConfigStorage::kJournalSize,
+    ConfigStorage::kFirstRecordOffset, ConfigPb_size,
+    ConfigStorage::kConfigVersion};
+
+constexpr Journal kUsageStatsJournal = {
+    ConfigStorage::kUsageStatsOffset, ConfigStorage::kUsageStatsSize,
+    ConfigStorage::kUsageStatsOffset, UsageStatsPb_size,
+    ConfigStorage::kUsageStatsVersion};
+
+constexpr Journal kCalibrationJournal = {
+    ConfigStorage::kCalibrationOffset, ConfigStorage::kCalibrationSize,
+    ConfigStorage::kCalibrationOffset, CalibrationPb_size,
+    ConfigStorage::kCalibrationVersion};
+
+static_assert(kCalibrationJournal.offset + kCalibrationJournal.size <=
+                  2 * 1024,
+              "Journals must fit in the data EEPROM");
 
-  if (count > stream->max_size) {
+// Holds a record while it's being written.
+using RecordBuffer = std::array<
+    uint8_t, sizeof(RecordHeader) + std::max({ConfigPb_size, UsageStatsPb_size,
+                                              CalibrationPb_size})>;
+
+// Layout of the original storage format: two magic words, then the version,
+// then the delimited config.
+constexpr size_t kLegacyEepromOffset = sizeof(uint32_t) * 3;
+constexpr size_t kLegacyEepromDataMaxSize = 2 * 1024 - kLegacyEepromOffset;
+
+// Location of a valid record.
+struct RecordLocation {
+  size_t address;
+  RecordHeader header;
+};
+
+// Returns the data EEPROM, which the STM32L0 maps into the address space. On
+// native builds, this is the fake EEPROM's backing array. Reading through this
+// avoids a call into the EEPROM library for every byte.
+const uint8_t *EepromData() {
+#ifdef ARDUINO
+  return reinterpret_cast<const uint8_t *>(DATA_EEPROM_BASE);
+#else
+  return EEPROM.data();
+#endif
+}
+
+uint32_t ReadWord(const size_t address) {
+  uint32_t word;
+  std::memcpy(&word, EepromData() + address, sizeof(word));
+  return word;
+}
+
+// Reads the header of the record at `address`. Returns whether it has a valid
+// header and CRC.
+bool ReadRecord(const Journal &journal, const size_t address,
+                RecordHeader *header) {
+  std::memcpy(header, EepromData() + address, sizeof(*header));
+  if (header->magic != ConfigStorage::kRecordMagic ||
+      header->length > journal.max_payload_length ||
+      address + sizeof(RecordHeader) + header->length > journal.end()) {
     return false;
   }
 
-  size_t *bytes_written = static_cast<size_t *>(stream->state);
+  const size_t record_length = sizeof(RecordHeader) + header->length;
+  return header->crc == ConfigStorage::Crc32(EepromData() + address + kCrcStart,
+                                             record_length - kCrcStart);
+}
+
+// Finds the valid record with the highest sequence number. Returns false if
+// there are no valid records.
+bool FindNewestRecord(const Journal &journal, RecordLocation *newest) {
+  bool found = false;
+  for (size_t address = journal.offset;
+       address + sizeof(RecordHeader) <= journal.end();
+       address += ConfigStorage::kRecordAlignment) {
+    if (ReadWord(address) != ConfigStorage::kRecordMagic) {
+      continue;
+    }
 
-  for (size_t i = 0; i < count; i++) {
-    EEPROM.write(kEepromOffset + i + *bytes_written, buf[i]);
+    // Only check the CRC of records which are newer than the best so far.
+    const uint32_t sequence =
+        ReadWord(address + offsetof(RecordHeader, sequence));
+    if (found && sequence <= newest->header.sequence) {
+      continue;
+    }
+
+    RecordHeader header;
+    if (!ReadRecord(journal, address, &header)) {
+      continue;
+    }
+    found = true;
+    newest->address = address;
+    newest->header = header;
   }
-  *bytes_written += count;
+  return found;
+}
 
+// Encodes the message after the header in `record`. Returns whether it could
+// be encoded.
+bool EncodeRecord(const pb_msgdesc_t *fields, const void *message,
+                  RecordBuffer *record, uint16_t *payload_length) {
+  pb_ostream_t stream =
+      pb_ostream_from_buffer(record->data() + sizeof(RecordHeader),
+                             record->size() - sizeof(RecordHeader));
+  if (!pb_encode(&stream, fields, message)) {
+    return false;
+  }
+  *payload_length = stream.bytes_written;
   return true;
 }
 
-bool nanopbInputCallback(pb_istream_t *stream, uint8_t *buf, size_t count) {
-  if (buf == nullptr) {
-    return false;
+// Fills in the header of the record, and returns where it should be written.
+size_t PlaceRecord(const Journal &journal, const uint16_t payload_length,
+                   RecordBuffer *record) {
+  RecordHeader header;
+  header.magic = ConfigStorage::kRecordMagic;
+  header.sequence = 0;
+  header.version = journal.version;
+  header.length = payload_length;
+
+  // Append after the newest record, wrapping around if there's no room. This
+  // never overwrites the newest record, so if the save is interrupted, the
+  // previous record is still loaded.
+  size_t address = journal.first_record;
+  RecordLocation newest;
+  if (FindNewestRecord(journal, &newest)) {
+    header.sequence = newest.header.sequence + 1;
+    address = newest.address + ConfigStorage::RecordSize(newest.header.length);
+  }
+  if (address + ConfigStorage::RecordSize(header.length) > journal.end()) {
+    address = journal.offset;
   }
 
-  if (count > stream->bytes_left) {
-    return false;
+  std::memcpy(record->data(), &header, sizeof(header));
+  const size_t record_length = sizeof(RecordHeader) + header.length;
+  header.crc = ConfigStorage::Crc32(record->data() + kCrcStart,
+                                    record_length - kCrcStart);
+  std::memcpy(record->data(), &header, sizeof(header));
+  return address;
+}
+
+// Writes the bytes of the record from `*next` up to `end` which differ from
+// what's in the EEPROM, up to `max_writes` of them. Advances `*next` past the
+// bytes it handled, and returns how many were written.
+size_t WriteRecordBytes(const size_t address, const RecordBuffer &record,
+                        size_t *next, const size_t end,
+                        const size_t max_writes) {
+  size_t writes = 0;
+  for (; *next < end && writes < max_writes; (*next)++) {
+    if (EepromData()[address + *next] != record[*next]) {
+      EEPROM.write(address + *next, record[*next]);
+      writes++;
+    }
   }
+  return writes;
+}
 
-  size_t *bytes_read = static_cast<size_t *>(stream->state);
+// Writes the whole record, leaving the magic until last.
+void WriteRecord(const size_t address, const RecordBuffer &record,
+                 const size_t record_length) {
+  size_t next = sizeof(RecordHeader::magic);
+  WriteRecordBytes(address, record, &next, record_length,
+                   std::numeric_limits<size_t>::max());
+  next = 0;
+  WriteRecordBytes(address, record, &next, sizeof(RecordHeader::magic),
+                   std::numeric_limits<size_t>::max());
+}
 
-  for (size_t i = 0; i < count; i++) {
-    buf[i] = EEPROM.read(kEepromOffset + i + *bytes_read);
+// Decodes a record found by FindNewestRecord.
+bool DecodeRecord(const Journal &journal, const RecordLocation &location,
+                  const pb_msgdesc_t *fields, void *message) {
+  if (location.header.version != journal.version) {
+    return false;
   }
 
-  *bytes_read += count;
+  // Decode straight from the EEPROM, without copying the record.
+  pb_istream_t stream = pb_istream_from_buffer(
+      EepromData() + location.address + sizeof(RecordHeader),
+      location.header.length);
+  return pb_decode(&stream, fields, message);
+}
 
+// Loads the newest record in the journal.
+bool TryLoadRecord(const Journal &journal, const pb_msgdesc_t *fields,
+                   void *message) {
+  RecordLocation newest;
+  return FindNewestRecord(journal, &newest) &&
+         DecodeRecord(journal, newest, fields, message);
+}
+
+// Appends a record to the journal, blocking until it has been written.
+bool SaveRecord(const Journal &journal, const pb_msgdesc_t *fields,
+                const void *message) {
+  RecordBuffer record;
+  uint16_t payload_length;
+  if (!EncodeRecord(fields, message, &record, &payload_length)) {
+    return false;
+  }
+  const size_t address = PlaceRecord(journal, payload_length, &record);
+  WriteRecord(address, record, sizeof(RecordHeader) + payload_length);
   return true;
 }
 
-bool ConfigStorage::TryLoadConfig(ConfigPb *const config) {
-  uint32_t magicByte0;
-  uint32_t magicByte1;
-  EEPROM.get(0, magicByte0);
-  EEPROM.get(sizeof(magicByte0), magicByte1);
+// A save which hasn't been completely written yet.
+struct PendingSave {
+  bool pending = false;
+  // Whether the header has been filled in and the address chosen. This is done
+  // when writing starts, since it depends on what's in the EEPROM.
+  bool placed = false;
+  RecordBuffer record;
+  uint16_t payload_length = 0;
+  size_t address = 0;
+  // The next byte of the record to write.
+  size_t next = 0;
+  CountDownTimer quiet_timer{ConfigStorage::kSaveQuietPeriodMs};
+};
+
+PendingSave pending_save;
+
+// Writes bytes of the pending save which differ from what's in the EEPROM, up
+// to `max_writes` of them.
+void WritePendingSave(size_t max_writes) {
+  if (!pending_save.pending) {
+    return;
+  }
+  if (!pending_save.placed) {
+    pending_save.address = PlaceRecord(
+        kConfigJournal, pending_save.payload_length, &pending_save.record);
+    pending_save.placed = true;
+    // The magic is written last, so that a partially written record is never
+    // seen. Even if stale magic is left over from an old record, the CRC won't
+    // match.
+    pending_save.next = sizeof(RecordHeader::magic);
+  }
 
-  if (!(magicByte0 == kEEPROMMagicByte0 && magicByte1 == kEEPROMMagicByte1)) {
+  const size_t record_length =
+      sizeof(RecordHeader) + pending_save.payload_length;
+  const size_t writes =
+      WriteRecordBytes(pending_save.address, pending_save.record,
+                       &pending_save.next, record_length, max_writes);
+  if (pending_save.next < record_length ||
+      max_writes - writes < sizeof(RecordHeader::magic)) {
+    return;
+  }
+  size_t next = 0;
+  WriteRecordBytes(pending_save.address, pending_save.record, &next,
+                   sizeof(RecordHeader::magic), sizeof(RecordHeader::magic));
+  pending_save.pending = false;
+}
+
+bool TryLoadLegacyConfig(ConfigPb *const config) {
+  if (!(ReadWord(0) == ConfigStorage::kEEPROMMagicByte0 &&
+        ReadWord(sizeof(uint32_t)) == ConfigStorage::kEEPROMMagicByte1)) {
     return false;
   }
 
-  uint32_t configVersion;
-  EEPROM.get(2 * sizeof(magicByte0), configVersion);
-  if (configVersion != kConfigVersion) {
+  if (ReadWord(2 * sizeof(uint32_t)) != ConfigStorage::kConfigVersion) {
     return false;
   }
 
-  size_t bytes_read = 0;
-  pb_istream_t eepromStream = {&nanopbInputCallback,
-                               static_cast<void *>(&bytes_read),
-                               kEepromDataMaxSize};
-  return pb_decode_ex(&eepromStream, &ConfigPb_msg, config,
-                      PB_DECODE_DELIMITED);
+  pb_istream_t stream = pb_istream_from_buffer(
+      EepromData() + kLegacyEepromOffset, kLegacyEepromDataMaxSize);
+  return pb_decode_ex(&stream, &ConfigPb_msg, config, PB_DECODE_DELIMITED);
+}
+
+}  // namespace
+
+uint32_t ConfigStorage::Crc32(const uint8_t *data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+bool ConfigStorage::TryLoadConfig(ConfigPb *const config) {
+  RecordLocation newest;
+  if (!FindNewestRecord(kConfigJournal, &newest)) {
+    return TryLoadLegacyConfig(config);
+  }
+  return DecodeRecord(kConfigJournal, newest, &ConfigPb_msg, config);
 }
 
 bool ConfigStorage::SaveConfig(ConfigPb const *const config) {
-  size_t bytes_written = 0;
-  pb_ostream_t eepromStream = {&nanopbOutputCallback,
-                               static_cast<void *>(&bytes_written),
-                               kEepromDataMaxSize, /*bytes_written=*/0};
-  bool result =
-      pb_encode_ex(&eepromStream, &ConfigPb_msg, config, PB_ENCODE_DELIMITED);
-
-  if (!result) {
+  if (!SaveConfigDeferred(config)) {
     return false;
   }
+  Flush();
+  return true;
+}
 
-  EEPROM.put(2 * sizeof(kEEPROMMagicByte0), kConfigVersion);
-  EEPROM.put(0, kEEPROMMagicByte0);
-  EEPROM.put(sizeof(kEEPROMMagicByte0), kEEPROMMagicByte1);
+bool ConfigStorage::SaveConfigDeferred(ConfigPb const *const config) {
+  uint16_t payload_length;
+  if (!EncodeRecord(&ConfigPb_msg, config, &pending_save.record,
+                    &payload_length)) {
+    pending_save.pending = false;
+    return false;
+  }
+
+  // If this replaces a save which was partly written, it's rewritten in the
+  // same place, since that record isn't valid yet.
+  pending_save.pending = true;
+  pending_save.placed = false;
+  pending_save.payload_length = payload_length;
+  pending_save.quiet_timer.Reset();
   return true;
-}
\ No newline at end of file
+}
+
+void ConfigStorage::Step() {
+  if (pending_save.pending && pending_save.quiet_timer.Expired()) {
+    WritePendingSave(kFlushBytesPerStep);
+  }
+}
+
+void ConfigStorage::Flush() {
+  WritePendingSave(std::numeric_limits<size_t>::max());
+}
+
+bool ConfigStorage::HasPendingSave() { return pending_save.pending; }
+
+void ConfigStorage::DiscardPendingSave() { pending_save.pending = false; }
+
+bool ConfigStorage::TryLoadUsageStats(UsageStatsPb *const stats) {
+  return TryLoadRecord(kUsageStatsJournal, &UsageStatsPb_msg, stats);
+}
+
+bool ConfigStorage::SaveUsageStats(UsageStatsPb const *const stats) {
+  return SaveRecord(kUsageStatsJournal, &UsageStatsPb_msg, stats);
+}
+
+bool ConfigStorage::TryLoadCalibration(CalibrationPb *const calibration) {
+  return TryLoadRecord(kCalibrationJournal, &CalibrationPb_msg, calibration);
+}
+
+bool ConfigStorage::SaveCalibration(CalibrationPb const *const calibration) {
+  return SaveRecord(kCalibrationJournal, &CalibrationPb_msg, calibration);
+}
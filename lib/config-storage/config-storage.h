@@ -1,19 +1,117 @@
 #pragma once
 
+#include <types.h>
+
 #include "serial.pb.h"
 
+// Stores the config in the data EEPROM, as a journal. Each save appends a
+// record holding the complete encoded config after the newest record, wrapping
+// around to the start of the journal when it reaches the end. Only the newest
+// record is live, so wrapping around is all the compaction that's needed. This
+// spreads wear evenly across the EEPROM. Loading scans for the valid record with
+// the highest sequence number.
+//
+// Saves are power-fail-safe: a save never overwrites the newest record, and a
+// record only becomes valid once its magic is written, after the rest of it.
+// Records which are torn or otherwise corrupt fail the CRC check, so the
+// previous config is loaded instead.
+//
+// The lifetime usage counters and the calibration are kept in smaller journals
+// in the same format, so that frequent checkpoints don't wear the config
+// records, and so that resetting the config doesn't affect the others.
 class ConfigStorage {
  public:
   // Tries to load the config from storage (EEPROM). Returns whether the load
   // was successful.
   static bool TryLoadConfig(ConfigPb *config);
 
-  // Save the config to storage (EEPROM).
+  // Save the config to storage (EEPROM). This blocks until the config has been
+  // written.
   static bool SaveConfig(ConfigPb const *config);
 
+  // Queues the config to be saved by Step, once no other save has been
+  // requested for kSaveQuietPeriodMs. This replaces any pending save, so a
+  // burst of saves only writes the last one. Returns whether the config could
+  // be encoded.
+  static bool SaveConfigDeferred(ConfigPb const *config);
+
+  // Writes up to kFlushBytesPerStep bytes of the pending save, if the quiet
+  // period has passed. Call this regularly from the main loop.
+  static void Step();
+
+  // Writes all of the pending save, if there is one. Call this before sleeping
+  // or stopping.
+  static void Flush();
+
+  static bool HasPendingSave();
+
+  // Drops the pending save. Visible for testing.
+  static void DiscardPendingSave();
+
+  // Deferred saves wait until the config stops changing for this long.
+  static constexpr uint32_t kSaveQuietPeriodMs = 500;
+
+  // Each EEPROM write stalls the CPU for a few milliseconds, so only write a
+  // word per Step. Bytes which already hold the right value don't count.
+  static constexpr size_t kFlushBytesPerStep = 4;
+
+  // Tries to load the usage counters. Returns whether the load was successful.
+  static bool TryLoadUsageStats(UsageStatsPb *stats);
+
+  // Saves the usage counters. This blocks until they have been written.
+  static bool SaveUsageStats(UsageStatsPb const *stats);
+
+  // Tries to load the calibration. Returns whether the load was successful.
+  static bool TryLoadCalibration(CalibrationPb *calibration);
+
+  // Saves the calibration. This blocks until it has been written.
+  static bool SaveCalibration(CalibrationPb const *calibration);
+
   // These are visible for testing:
 
-  // Magic values, to determine if the EEPROM is valid.
+  // Header of a journal record. This is followed by `length` bytes of encoded
+  // ConfigPb or UsageStatsPb.
+  struct RecordHeader {
+    uint32_t magic;
+    // CRC-32 of the rest of the header and the payload.
+    uint32_t crc;
+    uint32_t sequence;
+    uint16_t version;
+    uint16_t length;
+  };
+
+  // Marks the start of a record.
+  static constexpr uint32_t kRecordMagic = 0xFEEDC0DE;
+
+  // Layout of the 2 KB data EEPROM.
+  static constexpr size_t kJournalOffset = 0;
+  static constexpr size_t kJournalSize = 1536;
+  static constexpr size_t kUsageStatsOffset = kJournalOffset + kJournalSize;
+  static constexpr size_t kUsageStatsSize = 256;
+  static constexpr size_t kCalibrationOffset =
+      kUsageStatsOffset + kUsageStatsSize;
+  static constexpr size_t kCalibrationSize = 256;
+
+  // Where the first record is written. This is in the second half of the
+  // journal, so that a config in the legacy format (at the start of the EEPROM)
+  // survives an interrupted first save.
+  static constexpr size_t kFirstRecordOffset = kJournalOffset + kJournalSize / 2;
+
+  // Records start on word boundaries.
+  static constexpr size_t kRecordAlignment = sizeof(uint32_t);
+
+  // Returns the space taken up by a record with this payload length.
+  static constexpr size_t RecordSize(size_t payload_length) {
+    return (sizeof(RecordHeader) + payload_length + kRecordAlignment - 1) /
+           kRecordAlignment * kRecordAlignment;
+  }
+
+  // Computes the CRC-32 (as used by zlib) of the data.
+  static uint32_t Crc32(const uint8_t *data, size_t length);
+
+  // Magic values used by the original storage format, which stored a single
+  // copy of the config at a fixed location. This format is still loaded, so
+  // that the config survives a firmware update.
   static constexpr uint32_t kEEPROMMagicByte0 = 0xDEADBEEF;
   static constexpr uint32_t kEEPROMMagicByte1 = 0xBADDF00D;
 
@@ -21,4 +119,8 @@ class ConfigStorage {
   // is incompatible with the older version. This is unlikely - it's a defensive
   // measure.
   static constexpr uint32_t kConfigVersion = 1;
+
+  // Versions of the other stored records, with the same meaning.
+  static constexpr uint32_t kUsageStatsVersion = 1;
+  static constexpr uint32_t kCalibrationVersion = 1;
 };
@@ -14,6 +14,9 @@
 
 #include "controller.h"
 
+#include <algorithm>
+#include <iterator>
+
 #include "config-storage.h"
 #include "pins.h"
 #include "serial.pb.h"
@@ -51,9 +54,97 @@ void SetSensitivityPins(const ConfigPb& config) {
   }
 }
 
+// Returns whether a sensor should measure periodically.
+bool SensorEnabled(const SensorPolicy policy, const bool configured,
+                   const bool recent_motion) {
+  switch (policy) {
+    case SensorPolicy::kOff:
+      return false;
+    case SensorPolicy::kOn:
+      return true;
+    case SensorPolicy::kConfigured:
+      return configured;
+    case SensorPolicy::kAfterMotion:
+      return configured && recent_motion;
+  }
+  return false;
+}
+
+// Returns how the LED's PWM signal should be generated.
+PwmSettings GetPwmSettings(const ConfigPb& config) {
+  PwmSettings settings = {LedDriver::kMinPwmFrequencyHz, /*dither=*/true};
+  switch (config.pwm_profile) {
+    case PwmProfile::PwmProfile_PWM_PROFILE_UNSPECIFIED:
+    case PwmProfile::PwmProfile_PWM_PROFILE_HIGH_RESOLUTION:
+      break;
+
+    case PwmProfile::PwmProfile_PWM_PROFILE_LOW_LOSS:
+      settings.dither = false;
+      break;
+  }
+  if (config.pwm_frequency_hz != 0) {
+    settings.frequency_hz =
+        std::clamp<uint32_t>(config.pwm_frequency_hz,
+                             LedDriver::kMinPwmFrequencyHz,
+                             LedDriver::kMaxPwmFrequencyHz);
+  }
+  return settings;
+}
+
+bool operator==(const HardwareVersion& a, const HardwareVersion& b) {
+  return a.major == b.major && a.minor == b.minor &&
+         a.subrevision == b.subrevision;
+}
+
+// Copies the field if it's in the field mask, and records whether it changed.
+template <typename T>
+void UpdateConfigField(const uint32_t field_mask, const uint32_t field_number,
+                       const T& from, T* to, uint32_t* changed_fields) {
+  if ((field_mask & Controller::ConfigFieldBit(field_number)) == 0 ||
+      from == *to) {
+    return;
+  }
+  *to = from;
+  *changed_fields |= Controller::ConfigFieldBit(field_number);
+}
+
+// Applies hysteresis to a temperature limit. Returns whether the limit is
+// active.
+bool ThermalLimitActive(const int16_t temperature_celsius,
+                        const int16_t limit_celsius, const bool active) {
+  if (active) {
+    return temperature_celsius >
+           limit_celsius - Controller::kThermalHysteresisCelsius;
+  }
+  return temperature_celsius >= limit_celsius;
+}
+
+// Adds time to a counter of whole seconds, carrying the remainder. Returns
+// whether the counter changed.
+bool AddSeconds(const uint32_t elapsed_ms, uint32_t* remainder_ms,
+                uint32_t* seconds) {
+  *remainder_ms += elapsed_ms;
+  if (*remainder_ms < 1000) {
+    return false;
+  }
+  *seconds += *remainder_ms / 1000;
+  *remainder_ms %= 1000;
+  return true;
+}
+
+bool IsCharging(const PowerStatus status) {
+  return status == PowerStatus::kCharging ||
+         status == PowerStatus::kLowBatteryCutoffCharging;
+}
+
 bool Controller::Init() {
   InitPins();
 
+  // Load this first, since it's used when reading the sensors.
+  CalibrationPb calibration = CalibrationPb_init_zero;
+  ConfigStorage::TryLoadCalibration(&calibration);
+  ApplyCalibration(calibration);
+
   // For some reason, this causes the LEDs to flash (likely something to do with
   // the STM32 Arduino implementation).
   // analogWrite(kPinWhiteLed, 0);
@@ -67,21 +158,27 @@ bool Controller::Init() {
   battery_average_filter_.Run();
   battery_median_filter_.SetMinRunInterval(kBatteryFilterRunIntervalMillis);
   battery_average_filter_.SetMinRunInterval(kBatteryFilterRunIntervalMillis);
+  // The LED is off at boot, so this is close to the open-circuit voltage.
+  battery_estimator_.Reset(millis(), GetFilteredBatteryMillivolts());
 
   if (!vcnl4020_->Begin()) {
     return false;
   }
-  // TODO: set this from config
-  vcnl4020_->SetLEDCurrent(80);
+  vcnl4020_->SetLEDCurrent(GetProximityLedCurrentMilliamps());
 
   if (!temperature_sensor_->Begin()) {
     return false;
   }
+  UpdateThermalLimits();
 
   if (!power_controller_->Begin()) {
     return false;
   }
 
+  if (!led_driver_->Begin()) {
+    return false;
+  }
+
   // Note: there seems to be either an order dependence or a limited number. If
   // the interrupt for the 5V detect pin is first, it doesn't work.
   power_controller_->AttachInterruptWakeup(kPinPowerAuto, CHANGE);
@@ -92,6 +189,11 @@ bool Controller::Init() {
   ConfigStorage::TryLoadConfig(&config_);
   ConfigUpdated();
 
+  ConfigStorage::TryLoadUsageStats(&usage_stats_);
+  usage_millis_ = millis();
+  usage_checkpoint_timer_.Reset();
+  flight_recorder_sample_timer_.Reset();
+
   sleep_lockout_timer.Reset();
 
   return true;
@@ -140,6 +242,256 @@ PowerMode Controller::ReadPowerMode() {
   return PowerMode::kOff;
 }
 
+const Controller::StateActions Controller::kStateActions[] = {
+    // kCutoff: Step shuts the device down.
+    {nullptr, nullptr, nullptr},
+    // kCutoffCharging
+    {&Controller::EnterCutoffCharging, nullptr, nullptr},
+    // kUsb
+    {&Controller::EnterLedOff, nullptr, nullptr},
+    // kOff
+    {&Controller::EnterLedOff, nullptr, nullptr},
+    // kOn
+    {nullptr, nullptr, &Controller::StepOn},
+    // kAuto
+    {nullptr, &Controller::ExitAuto, &Controller::StepAuto},
+    // kToggled: the LED holds its state.
+    {nullptr, nullptr, nullptr},
+};
+static_assert(std::size(kStatePolicies) ==
+                  static_cast<size_t>(ControllerState::kToggled) + 1,
+              "A policy is needed for each state");
+
+ControllerState Controller::ResolveState() const {
+  if (power_status_ == PowerStatus::kLowBatteryCutoff) {
+    return ControllerState::kCutoff;
+  }
+  if (power_status_ == PowerStatus::kLowBatteryCutoffCharging) {
+    return ControllerState::kCutoffCharging;
+  }
+  if (usb_status_ != USBStatus::kNoConnection) {
+    return ControllerState::kUsb;
+  }
+  switch (power_mode_) {
+    case PowerMode::kOff:
+      return ControllerState::kOff;
+    case PowerMode::kOn:
+      return ControllerState::kOn;
+    case PowerMode::kAuto:
+      return ControllerState::kAuto;
+    case PowerMode::kToggled:
+      return ControllerState::kToggled;
+  }
+  return ControllerState::kOff;
+}
+
+void Controller::UpdateState() {
+  const ControllerState state = ResolveState();
+  if (state_known_ && state == state_) {
+    return;
+  }
+  if (state_known_) {
+    const StateActions& exit = kStateActions[static_cast<size_t>(state_)];
+    if (exit.exit != nullptr) {
+      (this->*exit.exit)();
+    }
+  }
+  state_ = state;
+  state_known_ = true;
+  ApplyStatePolicy();
+  const StateActions& entry = kStateActions[static_cast<size_t>(state_)];
+  if (entry.enter != nullptr) {
+    (this->*entry.enter)();
+  }
+}
+
+void Controller::ApplyStatePolicy() {
+  const StatePolicy& policy = GetStatePolicy(state_);
+  vcnl4020_->SetPeriodicAmbient(SensorEnabled(
+      policy.ambient,
+      config_.brightnessMode != BrightnessMode::BRIGHTNESS_MODE_DISABLED,
+      motion_proximity_timeout_.Active()));
+  vcnl4020_->SetPeriodicProximity(
+      CalibratingProximityCrosstalk() ||
+      SensorEnabled(
+          policy.proximity,
+          config_.proximity_mode == ProximityMode::PROXIMITY_MODE_TOGGLE,
+          motion_proximity_timeout_.Active()));
+  power_controller_->SetInterruptWakeupEnabled(kPinMotionSensor,
+                                               policy.motion_wakeup);
+}
+
+void Controller::EnterCutoffCharging() {
+  if (led_on_ || led_ramper_.GetTarget() != 0) {
+    TurnOffLedImmediately();
+  }
+}
+
+void Controller::EnterLedOff() { led_ramper_.SetTarget(0); }
+
+void Controller::ExitAuto() {
+  if (ambient_blank_timer_.Running()) {
+    EndAmbientBlank();
+  }
+  ambient_blank_interval_timer_.Stop();
+}
+
+void Controller::StepOn(const bool /*motion_detected*/,
+                        const bool /*auto_triggered*/) {
+  if (!led_on_) {
+    led_ramper_.SetTarget(GetLedTargetDutyCycle());
+  }
+}
+
+void Controller::StepAuto(const bool motion_detected,
+                          const bool auto_triggered) {
+  if (motion_detected || auto_triggered) {
+    if (!led_on_ &&
+        (config_.brightnessMode == BrightnessMode::BRIGHTNESS_MODE_DISABLED ||
+         auto_triggered ||
+         (led_on_brightness_timeout_.Active() && !led_off_for_daylight_) ||
+         ReadAmbientLight() < config_.autoBrightnessThreshold)) {
+      led_ramper_.SetTarget(GetLedOnDutyCycle());
+      led_off_for_daylight_ = false;
+      led_change_motion_timeout_.Reset();
+    }
+    motion_timer_.Reset();
+  } else if (motion_timer_.Running() &&
+             motion_timer_.Get() > GetMotionTimeoutSeconds() * 1000) {
+    if (led_on_) {
+      led_ramper_.SetTarget(0);
+      led_change_motion_timeout_.Reset();
+    }
+    led_on_ = false;
+    motion_timer_.Stop();
+  }
+}
+
+// A 5V edge resets the sleep lockout, which must outlast the wait for StepPower.
+static_assert(Controller::kSleepLockoutMs >= Controller::kPowerStepIntervalMs);
+
+void Controller::HandlePinEvents() {
+  PinEvent event;
+  while (power_controller_->PopPinEvent(&event)) {
+    const int pin = static_cast<int>(event.pin);
+    if (pin == kPinMotionSensor) {
+      if (event.rising) {
+        motion_edge_pending_ = true;
+        max_motion_latency_ms_ =
+            std::max(max_motion_latency_ms_, millis() - event.millis);
+      }
+    } else if (pin == kPinPowerAuto || pin == kPinPowerOn) {
+      // Read the switch once it has stopped bouncing.
+      switch_settling_ = true;
+      switch_edge_ms_ = event.millis;
+    } else if (pin == kPin5vDetect) {
+      // Stay awake until the USB connection has been detected.
+      sleep_lockout_timer.Reset();
+    }
+  }
+}
+
+void Controller::ResetUsageStats() {
+  usage_stats_ = UsageStatsPb_init_zero;
+  power_mode_remainder_ms_ = {};
+  led_on_remainder_ms_ = 0;
+  led_duty_remainder_ = 0;
+  usage_stats_dirty_ = true;
+  CheckpointUsage();
+}
+
+void Controller::AccumulateUsage() {
+  const uint32_t now = millis();
+  const uint32_t elapsed_ms = now - usage_millis_;
+  usage_millis_ = now;
+
+  uint32_t* mode_seconds = nullptr;
+  switch (power_mode_) {
+    case PowerMode::kOff:
+      mode_seconds = &usage_stats_.off_seconds;
+      break;
+    case PowerMode::kAuto:
+      mode_seconds = &usage_stats_.auto_seconds;
+      break;
+    case PowerMode::kOn:
+      mode_seconds = &usage_stats_.on_seconds;
+      break;
+    case PowerMode::kToggled:
+      mode_seconds = &usage_stats_.toggled_seconds;
+      break;
+  }
+  usage_stats_dirty_ |= AddSeconds(
+      elapsed_ms,
+      &power_mode_remainder_ms_[static_cast<size_t>(power_mode_)],
+      mode_seconds);
+
+  const uint32_t duty_cycle =
+      led_dimming::LevelToDutyCycle(led_ramper_.GetActual());
+  if (duty_cycle == 0) {
+    return;
+  }
+  usage_stats_dirty_ |= AddSeconds(elapsed_ms, &led_on_remainder_ms_,
+                                   &usage_stats_.led_on_seconds);
+  static constexpr uint64_t kFullBrightnessSecond =
+      led_dimming::kMaxDutyCycle * 1000;
+  led_duty_remainder_ += static_cast<uint64_t>(duty_cycle) * elapsed_ms;
+  if (led_duty_remainder_ >= kFullBrightnessSecond) {
+    usage_stats_.led_full_brightness_seconds +=
+        led_duty_remainder_ / kFullBrightnessSecond;
+    led_duty_remainder_ %= kFullBrightnessSecond;
+    usage_stats_dirty_ = true;
+  }
+}
+
+void Controller::CountWakeup() {
+  PowerMode switch_mode = ReadPowerMode();
+  if (power_mode_ == PowerMode::kToggled && switch_mode == PowerMode::kAuto) {
+    switch_mode = PowerMode::kToggled;
+  }
+
+  if (digitalRead(kPinMotionSensor)) {
+    usage_stats_.motion_wakeups++;
+  } else if (switch_mode != power_mode_) {
+    usage_stats_.switch_wakeups++;
+  } else if (digitalRead(kPin5vDetect)) {
+    usage_stats_.usb_wakeups++;
+  } else {
+    usage_stats_.timer_wakeups++;
+  }
+  usage_stats_dirty_ = true;
+}
+
+void Controller::CheckpointUsage() {
+  usage_checkpoint_timer_.Reset();
+  if (!usage_stats_dirty_) {
+    return;
+  }
+  ConfigStorage::SaveUsageStats(&usage_stats_);
+  usage_stats_dirty_ = false;
+}
+
+void Controller::RecordStateChanges() {
+  if (power_mode_ != recorded_power_mode_) {
+    recorded_power_mode_ = power_mode_;
+    flight_recorder_.Record(FlightRecorder::Event::kPowerMode,
+                            static_cast<int32_t>(power_mode_));
+  }
+  if (power_status_ != recorded_power_status_) {
+    recorded_power_status_ = power_status_;
+    flight_recorder_.Record(FlightRecorder::Event::kPowerStatus,
+                            static_cast<int32_t>(power_status_));
+  }
+  if (usb_status_ != recorded_usb_status_) {
+    recorded_usb_status_ = usb_status_;
+    flight_recorder_.Record(FlightRecorder::Event::kUsbStatus,
+                            static_cast<int32_t>(usb_status_));
+  }
+  if (led_on_ != recorded_led_on_) {
+    recorded_led_on_ = led_on_;
+    flight_recorder_.Record(FlightRecorder::Event::kLedOn, led_on_);
+  }
+}
+
 uint16_t Controller::ReadRawBatteryMillivolts() {
   // Note: while the ADC (and cal) are 12-bit values, these use uint32_t to
   // avoid overflow.
@@ -163,31 +515,372 @@ uint16_t Controller::ReadRawBatteryMillivolts() {
          vrefint_raw;
 }
 
+void Controller::UpdateLed() {
+  if (led_ramper_.GetTarget() != led_fade_target_) {
+    led_fade_target_ = led_ramper_.GetTarget();
+    // Start from wherever the previous fade got to, so that retargeting
+    // mid-fade is smooth.
+    led_ramper_.SetActual(led_driver_->Get());
+    std::array<uint16_t, LedDriver::kMaxFadeSteps> profile;
+    uint32_t step_ms;
+    const size_t length =
+        led_ramper_.BuildProfile(profile.data(), profile.size(), &step_ms);
+    if (length == 0) {
+      led_driver_->Set(led_fade_target_);
+    } else {
+      led_driver_->StartFade(profile.data(), length, step_ms);
+    }
+  }
+  led_ramper_.SetActual(led_driver_->Get());
+  led_on_ = led_ramper_.GetActual() > 0;
+}
+
+void Controller::TurnOffLedImmediately() {
+  led_ramper_.SetTarget(0);
+  led_ramper_.SetActual(0);
+  led_fade_target_ = 0;
+  led_driver_->Set(0);
+  led_on_ = false;
+}
+
+void Controller::UpdateBatteryEstimate() {
+  BatteryEstimator::ChargeState charge_state =
+      BatteryEstimator::ChargeState::kDischarging;
+  if (power_status_ == PowerStatus::kCharged) {
+    charge_state = BatteryEstimator::ChargeState::kCharged;
+  } else if (IsCharging(power_status_)) {
+    charge_state = BatteryEstimator::ChargeState::kCharging;
+  }
+  const uint8_t previous_percent = GetBatteryPercent();
+  battery_estimator_.Update(millis(), GetFilteredBatteryMillivolts(),
+                            led_dimming::LevelToDutyCycle(
+                                led_ramper_.GetActual()),
+                            charge_state);
+  if (GetBatteryPercent() != previous_percent) {
+    RetargetLed();
+  }
+}
+
+void Controller::RetargetLed() {
+  if (led_ramper_.GetTarget() != 0) {
+    led_ramper_.SetTarget(GetLedOnDutyCycle());
+  }
+}
+
+uint32_t Controller::GetLedOnDutyCycle() const {
+  const uint32_t duty_cycle = GetLedTargetDutyCycle();
+  if (config_.brightnessMode != BrightnessMode::BRIGHTNESS_MODE_ADAPTIVE ||
+      power_mode_ != PowerMode::kAuto) {
+    return duty_cycle;
+  }
+  const uint32_t level = led_dimming::DutyCycleToLevel(
+      adaptive_brightness_.GetDutyCycle(config_.autoBrightnessThreshold));
+  // Stay on, if only barely, while there's motion.
+  return std::clamp<uint32_t>(level, std::min<uint32_t>(duty_cycle, 1),
+                              duty_cycle);
+}
+
+void Controller::UpdateAdaptiveBrightness() {
+  if (config_.brightnessMode != BrightnessMode::BRIGHTNESS_MODE_ADAPTIVE ||
+      power_mode_ != PowerMode::kAuto || ambient_blank_timer_.Running() ||
+      !vcnl4020_->AmbientReady()) {
+    return;
+  }
+  const uint16_t ambient = ReadAmbientLight();
+  // Only use readings taken with the LED steady at its target.
+  const uint16_t actual = led_ramper_.GetActual();
+  if (led_driver_->Fading() || actual != led_ramper_.GetTarget()) {
+    return;
+  }
+  if (actual == 0) {
+    adaptive_brightness_.UpdateDark(ambient);
+    return;
+  }
+  adaptive_brightness_.Update(ambient, led_dimming::LevelToDutyCycle(actual));
+  const uint32_t target = led_ramper_.GetTarget();
+  const uint32_t ideal = GetLedOnDutyCycle();
+  if (std::max(ideal, target) - std::min(ideal, target) >
+      kAdaptiveHysteresisLevels) {
+    led_ramper_.SetTarget(ideal);
+  }
+}
+
+void Controller::MeasureAmbientWhileOn() {
+  if (ambient_blank_timer_.Running()) {
+    if (vcnl4020_->AmbientReady()) {
+      const uint16_t daylight = ReadAmbientLight();
+      EndAmbientBlank();
+      HandleDaylight(daylight);
+    } else if (ambient_blank_timer_.Expired()) {
+      vcnl4020_->CancelAmbientMeasurement();
+      EndAmbientBlank();
+    }
+    return;
+  }
+
+  const bool uses_ambient =
+      config_.brightnessMode == BrightnessMode::BRIGHTNESS_MODE_ON_WHEN_BELOW ||
+      config_.brightnessMode == BrightnessMode::BRIGHTNESS_MODE_ADAPTIVE;
+  const bool led_steady = led_on_ && !led_driver_->Fading() &&
+                          led_ramper_.GetActual() == led_ramper_.GetTarget();
+  if (!uses_ambient || power_mode_ != PowerMode::kAuto || !led_steady) {
+    ambient_blank_interval_timer_.Stop();
+    return;
+  }
+  if (!ambient_blank_interval_timer_.Running()) {
+    ambient_blank_interval_timer_.Reset();
+  } else if (ambient_blank_interval_timer_.Expired()) {
+    // Discard any periodic reading which was taken with the LED on.
+    if (vcnl4020_->AmbientReady()) {
+      vcnl4020_->ReadAmbient();
+    }
+    led_driver_->Blank(true);
+    vcnl4020_->StartAmbientMeasurement();
+    ambient_blank_timer_.Reset();
+  }
+}
+
+void Controller::EndAmbientBlank() {
+  ambient_blank_timer_.Stop();
+  led_driver_->Blank(false);
+  ambient_blank_interval_timer_.Reset();
+}
+
+void Controller::HandleDaylight(const uint16_t daylight) {
+  if (led_ramper_.GetTarget() == 0) {
+    return;
+  }
+  uint32_t duty_cycle = 0;
+  if (config_.brightnessMode == BrightnessMode::BRIGHTNESS_MODE_ADAPTIVE) {
+    adaptive_brightness_.UpdateDark(daylight);
+    duty_cycle =
+        adaptive_brightness_.GetDutyCycle(config_.autoBrightnessThreshold);
+  } else if (daylight < config_.autoBrightnessThreshold) {
+    duty_cycle = led_dimming::kMaxDutyCycle;
+  }
+
+  if (duty_cycle == 0) {
+    led_ramper_.SetTarget(0);
+    led_change_motion_timeout_.Reset();
+    led_off_for_daylight_ = true;
+  } else if (config_.brightnessMode ==
+             BrightnessMode::BRIGHTNESS_MODE_ADAPTIVE) {
+    const uint32_t target = led_ramper_.GetTarget();
+    const uint32_t ideal = GetLedOnDutyCycle();
+    if (std::max(ideal, target) - std::min(ideal, target) >
+        kAdaptiveHysteresisLevels) {
+      led_ramper_.SetTarget(ideal);
+    }
+  }
+}
+
+void Controller::UpdateThermalLimits() {
+  temperature_sample_timer_.Reset();
+  temperature_celsius_ = temperature_sensor_->ReadTemperature();
+  charge_throttled_ = ThermalLimitActive(
+      temperature_celsius_, kChargeThrottleCelsius, charge_throttled_);
+
+  const bool was_derated = led_derated_;
+  led_derated_ =
+      ThermalLimitActive(temperature_celsius_, kLedDerateCelsius, led_derated_);
+  if (led_derated_ != was_derated) {
+    RetargetLed();
+  }
+}
+
+uint32_t Controller::GetLedTargetDutyCycle() const {
+  const uint32_t duty_cycle =
+      DerateForBattery(GetLedDutyCycle(), GetBatteryPercent());
+  if (!led_derated_) {
+    return duty_cycle;
+  }
+  // Derate the power, rather than the perceived brightness. Don't turn the LED
+  // off entirely.
+  const uint32_t derated = led_dimming::DutyCycleToLevel(
+      led_dimming::LevelToDutyCycle(duty_cycle) * kLedDeratePercent / 100);
+  return std::max(derated, std::min<uint32_t>(duty_cycle, 1));
+}
+
+uint32_t Controller::DerateForBattery(const uint32_t duty_cycle,
+                                      const uint8_t battery_percent) const {
+  const uint32_t start_percent = config_.battery_derate_start_percent;
+  if (battery_percent >= start_percent) {
+    return duty_cycle;
+  }
+  const uint32_t reserve_duty_cycle =
+      std::min(config_.battery_reserve_led_duty_cycle, duty_cycle);
+  const uint32_t reserve_percent =
+      std::min(config_.battery_reserve_percent, start_percent);
+  if (battery_percent <= reserve_percent) {
+    return reserve_duty_cycle;
+  }
+
+  // Interpolate the power, rather than the perceived brightness, so that each
+  // percent of charge lasts a little longer than the one before.
+  const uint32_t full = led_dimming::LevelToDutyCycle(duty_cycle);
+  const uint32_t reserve = led_dimming::LevelToDutyCycle(reserve_duty_cycle);
+  const uint32_t derated = reserve + (full - reserve) *
+                                         (battery_percent - reserve_percent) /
+                                         (start_percent - reserve_percent);
+  return std::max(led_dimming::DutyCycleToLevel(derated), reserve_duty_cycle);
+}
+
+void Controller::SetCalibration(const CalibrationPb& calibration) {
+  ApplyCalibration(calibration);
+  vcnl4020_->SetLEDCurrent(GetProximityLedCurrentMilliamps());
+}
+
+void Controller::ApplyCalibration(const CalibrationPb& calibration) {
+  calibration_ = calibration;
+
+  adc_gain_q16_ = calibration.adc_gain_ppm == 0
+                      ? 1 << 16
+                      : (static_cast<uint64_t>(calibration.adc_gain_ppm) << 16) /
+                            1000000;
+  adc_offset_millivolts_ = calibration.adc_offset_millivolts;
+  proximity_crosstalk_ =
+      std::min<uint32_t>(calibration.proximity_crosstalk, UINT16_MAX);
+  ambient_gain_q16_ =
+      calibration.als_lens_transmission_permille == 0
+          ? 1 << 16
+          : (1000u << 16) / calibration.als_lens_transmission_permille;
+}
+
+void Controller::StartProximityCrosstalkCalibration() {
+  crosstalk_samples_remaining_ = kCrosstalkCalibrationSamples;
+  crosstalk_sample_sum_ = 0;
+  ApplyStatePolicy();
+}
+
+uint16_t Controller::CorrectAdcMillivolts(const uint16_t millivolts) const {
+  const int32_t corrected =
+      static_cast<int32_t>((static_cast<uint64_t>(millivolts) * adc_gain_q16_) >>
+                           16) +
+      adc_offset_millivolts_;
+  return std::clamp<int32_t>(corrected, 0, UINT16_MAX);
+}
+
+uint16_t Controller::RemoveProximityCrosstalk(const uint16_t proximity) const {
+  return proximity > proximity_crosstalk_ ? proximity - proximity_crosstalk_
+                                          : 0;
+}
+
+uint16_t Controller::CorrectAmbientLight(const uint16_t ambient) const {
+  return std::min<uint32_t>(
+      (static_cast<uint32_t>(ambient) * ambient_gain_q16_) >> 16, UINT16_MAX);
+}
+
+uint8_t Controller::GetProximityLedCurrentMilliamps() const {
+  const uint32_t milliamps = calibration_.proximity_led_current_milliamps;
+  if (milliamps == 0) {
+    return kDefaultProximityLedCurrentMilliamps;
+  }
+  // The sensor supports 10mA to 200mA, in steps of 10mA.
+  return std::clamp<uint32_t>((milliamps + 5) / 10 * 10, 10, 200);
+}
+
 void Controller::SetConfig(const ConfigPb& config) {
   config_ = config;
   ConfigUpdated();
 }
 
-void Controller::ConfigUpdated() {
-  if (config_.ramp_up_time_ms != 0) {
-    if (config_.ramp_up_time_ms < GetLedDutyCycle()) {
-      led_ramper_.SetMaxIncrease(GetLedDutyCycle() / config_.ramp_up_time_ms,
-                                 1);
-    } else {
-      led_ramper_.SetMaxIncrease(1,
-                                 config_.ramp_up_time_ms / GetLedDutyCycle());
-    }
+void Controller::UpdateConfig(const ConfigPb& update,
+                              const uint32_t field_mask) {
+  uint32_t changed = 0;
+  UpdateConfigField(field_mask, ConfigPb_version_tag, update.version,
+                    &config_.version, &changed);
+  UpdateConfigField(field_mask, ConfigPb_hardwareVersion_tag,
+                    update.has_hardwareVersion, &config_.has_hardwareVersion,
+                    &changed);
+  UpdateConfigField(field_mask, ConfigPb_hardwareVersion_tag,
+                    update.hardwareVersion, &config_.hardwareVersion, &changed);
+  UpdateConfigField(field_mask, ConfigPb_brightnessMode_tag,
+                    update.brightnessMode, &config_.brightnessMode, &changed);
+  UpdateConfigField(field_mask, ConfigPb_autoBrightnessThreshold_tag,
+                    update.autoBrightnessThreshold,
+                    &config_.autoBrightnessThreshold, &changed);
+  UpdateConfigField(field_mask, ConfigPb_proximity_mode_tag,
+                    update.proximity_mode, &config_.proximity_mode, &changed);
+  UpdateConfigField(field_mask, ConfigPb_proximity_toggle_timeout_seconds_tag,
+                    update.proximity_toggle_timeout_seconds,
+                    &config_.proximity_toggle_timeout_seconds, &changed);
+  UpdateConfigField(field_mask, ConfigPb_proximity_threshold_tag,
+                    update.proximity_threshold, &config_.proximity_threshold,
+                    &changed);
+  UpdateConfigField(field_mask, ConfigPb_motion_timeout_seconds_tag,
+                    update.motion_timeout_seconds,
+                    &config_.motion_timeout_seconds, &changed);
+  UpdateConfigField(field_mask, ConfigPb_led_duty_cycle_tag,
+                    update.led_duty_cycle, &config_.led_duty_cycle, &changed);
+  UpdateConfigField(field_mask, ConfigPb_low_battery_cutoff_millivolts_tag,
+                    update.low_battery_cutoff_millivolts,
+                    &config_.low_battery_cutoff_millivolts, &changed);
+  UpdateConfigField(field_mask,
+                    ConfigPb_low_battery_hysteresis_threshold_millivolts_tag,
+                    update.low_battery_hysteresis_threshold_millivolts,
+                    &config_.low_battery_hysteresis_threshold_millivolts,
+                    &changed);
+  UpdateConfigField(field_mask, ConfigPb_ramp_up_time_ms_tag,
+                    update.ramp_up_time_ms, &config_.ramp_up_time_ms,
+                    &changed);
+  UpdateConfigField(field_mask, ConfigPb_ramp_down_time_ms_tag,
+                    update.ramp_down_time_ms, &config_.ramp_down_time_ms,
+                    &changed);
+  UpdateConfigField(field_mask, ConfigPb_motion_sensitivity_tag,
+                    update.motion_sensitivity, &config_.motion_sensitivity,
+                    &changed);
+  UpdateConfigField(field_mask, ConfigPb_battery_derate_start_percent_tag,
+                    update.battery_derate_start_percent,
+                    &config_.battery_derate_start_percent, &changed);
+  UpdateConfigField(field_mask, ConfigPb_battery_reserve_percent_tag,
+                    update.battery_reserve_percent,
+                    &config_.battery_reserve_percent, &changed);
+  UpdateConfigField(field_mask, ConfigPb_battery_reserve_led_duty_cycle_tag,
+                    update.battery_reserve_led_duty_cycle,
+                    &config_.battery_reserve_led_duty_cycle, &changed);
+  UpdateConfigField(field_mask, ConfigPb_pwm_profile_tag, update.pwm_profile,
+                    &config_.pwm_profile, &changed);
+  UpdateConfigField(field_mask, ConfigPb_pwm_frequency_hz_tag,
+                    update.pwm_frequency_hz, &config_.pwm_frequency_hz,
+                    &changed);
+  ConfigUpdated(changed);
+}
+
+void Controller::ConfigUpdated(const uint32_t changed_fields) {
+  const uint32_t duty_cycle_changed =
+      changed_fields & ConfigFieldBit(ConfigPb_led_duty_cycle_tag);
+  if (duty_cycle_changed) {
+    // Ramping to a level past the top of the gamma table would finish the fade
+    // early.
+    config_.led_duty_cycle =
+        std::min<uint32_t>(config_.led_duty_cycle, led_dimming::kMaxLevel);
   }
-  if (config_.ramp_down_time_ms != 0) {
-    if (config_.ramp_down_time_ms < GetLedDutyCycle()) {
-      led_ramper_.SetMaxDecrease(GetLedDutyCycle() / config_.ramp_down_time_ms,
-                                 1);
-    } else {
-      led_ramper_.SetMaxDecrease(1,
-                                 config_.ramp_down_time_ms / GetLedDutyCycle());
-    }
+  if (duty_cycle_changed ||
+      (changed_fields & ConfigFieldBit(ConfigPb_ramp_up_time_ms_tag))) {
+    led_ramper_.SetMaxIncrease(GetLedDutyCycle(), config_.ramp_up_time_ms);
+  }
+  if (duty_cycle_changed ||
+      (changed_fields & ConfigFieldBit(ConfigPb_ramp_down_time_ms_tag))) {
+    led_ramper_.SetMaxDecrease(GetLedDutyCycle(), config_.ramp_down_time_ms);
+  }
+  if (changed_fields & ConfigFieldBit(ConfigPb_motion_sensitivity_tag)) {
+    SetSensitivityPins(config_);
+  }
+  if (state_known_ &&
+      (changed_fields & (ConfigFieldBit(ConfigPb_brightnessMode_tag) |
+                         ConfigFieldBit(ConfigPb_proximity_mode_tag)))) {
+    ApplyStatePolicy();
+  }
+  if (changed_fields & (ConfigFieldBit(ConfigPb_pwm_profile_tag) |
+                        ConfigFieldBit(ConfigPb_pwm_frequency_hz_tag))) {
+    led_driver_->SetPwm(GetPwmSettings(config_));
+  }
+  if (changed_fields &
+      (ConfigFieldBit(ConfigPb_battery_derate_start_percent_tag) |
+       ConfigFieldBit(ConfigPb_battery_reserve_percent_tag) |
+       ConfigFieldBit(ConfigPb_battery_reserve_led_duty_cycle_tag))) {
+    RetargetLed();
   }
-  SetSensitivityPins(config_);
 }
 
 uint16_t Controller::ReadAnalogVoltageMillivolts(
@@ -197,6 +890,13 @@ uint16_t Controller::ReadAnalogVoltageMillivolts(
 }
 
 void Controller::Step() {
+  StepBattery();
+  StepMode();
+  StepPower();
+  StepLed();
+}
+
+void Controller::StepBattery() {
 #ifndef ARDUINO
   battery_median_filter_.SetMillis(millis());
   battery_average_filter_.SetMillis(millis());
@@ -205,10 +905,19 @@ void Controller::Step() {
   battery_median_filter_.Run();
   battery_average_filter_.Run();
 
+  UpdateBatteryEstimate();
+}
+
+void Controller::StepMode() {
   const PowerMode previous_power_mode = power_mode_;
-  bool auto_triggered = false;
 
-  if (!power_mode_read_timer_.Running() || power_mode_read_timer_.Expired()) {
+  HandlePinEvents();
+  if (switch_settling_ && millis() - switch_edge_ms_ >= kSwitchDebounceMs) {
+    switch_settling_ = false;
+  }
+
+  if (!switch_settling_ && (!power_mode_read_timer_.Running() ||
+                            power_mode_read_timer_.Expired())) {
     power_mode_ = ReadPowerMode();
     if (previous_power_mode == PowerMode::kToggled &&
         power_mode_ == PowerMode::kAuto) {
@@ -216,33 +925,37 @@ void Controller::Step() {
     } else if (previous_power_mode != power_mode_) {
       power_mode_read_timer_.Reset();
       sleep_lockout_timer.Reset();
-      if (power_mode_ == PowerMode::kOff) {
-        vcnl4020_->SetPeriodicAmbient(false);
+      // The sensors follow from the state, which UpdateState handles.
+      if (power_mode_ == PowerMode::kOff || power_mode_ == PowerMode::kOn) {
         battery_level_timer_.Reset();
-      } else if (power_mode_ == PowerMode::kAuto) {
-        if (previous_power_mode == PowerMode::kToggled) {
-        } else {
-          vcnl4020_->SetPeriodicAmbient(
-              config_.brightnessMode !=
-              BrightnessMode::BRIGHTNESS_MODE_DISABLED);
-          auto_triggered = true;
-          motion_timer_.Reset();
-          battery_level_timer_.Reset();
-          motion_proximity_timeout_.Reset();
-          if (config_.proximity_mode == ProximityMode::PROXIMITY_MODE_TOGGLE) {
-            vcnl4020_->SetPeriodicProximity(true);
-          }
-        }
-      } else if (power_mode_ == PowerMode::kOn) {
-        vcnl4020_->SetPeriodicAmbient(false);
+      } else if (power_mode_ == PowerMode::kAuto &&
+                 previous_power_mode != PowerMode::kToggled) {
+        auto_triggered_ = true;
+        motion_timer_.Reset();
         battery_level_timer_.Reset();
+        motion_proximity_timeout_.Reset();
       }
     }
   }
 
+  if (CalibratingProximityCrosstalk() && vcnl4020_->ProximityReady()) {
+    crosstalk_sample_sum_ += vcnl4020_->ReadProximity();
+    crosstalk_samples_remaining_--;
+    if (crosstalk_samples_remaining_ == 0) {
+      CalibrationPb calibration = calibration_;
+      calibration.proximity_crosstalk =
+          crosstalk_sample_sum_ / kCrosstalkCalibrationSamples;
+      SetCalibration(calibration);
+      ConfigStorage::SaveCalibration(&calibration_);
+      ApplyStatePolicy();
+    }
+  }
+
   if ((power_mode_ == PowerMode::kAuto || power_mode_ == PowerMode::kToggled) &&
       config_.proximity_mode == ProximityMode::PROXIMITY_MODE_TOGGLE &&
       vcnl4020_->ProximityReady()) {
+    // This uses the raw reading: the crosstalk doesn't affect the difference,
+    // and removing it would make readings of 0 ambiguous with the reset value.
     int32_t proximity = vcnl4020_->ReadProximity();
 
     if (prev_proximity_ != 0 &&
@@ -254,19 +967,29 @@ void Controller::Step() {
         power_mode_ = PowerMode::kAuto;
         proximity = 0;
       }
+      flight_recorder_.Record(FlightRecorder::Event::kProximityToggle,
+                              static_cast<int32_t>(power_mode_));
     }
 
     prev_proximity_ = proximity;
   }
+}
+
+void Controller::StepPower() {
+  if (temperature_sample_timer_.Expired()) {
+    UpdateThermalLimits();
+  }
 
   // ADC readings are relative to the battery voltage.
   // TODO: possibly consolidate this read with the one inside the battery median
   // filter, to save power.
+  // These are derived from the raw battery voltage, so the calibration is
+  // applied once, to the result.
   const uint16_t battery_millivolts = ReadRawBatteryMillivolts();
-  const uint16_t cc1_millivolts =
-      ReadAnalogVoltageMillivolts(/*pin=*/kPinCc1, battery_millivolts);
-  const uint16_t cc2_millivolts =
-      ReadAnalogVoltageMillivolts(/*pin=*/kPinCc2, battery_millivolts);
+  const uint16_t cc1_millivolts = CorrectAdcMillivolts(
+      ReadAnalogVoltageMillivolts(/*pin=*/kPinCc1, battery_millivolts));
+  const uint16_t cc2_millivolts = CorrectAdcMillivolts(
+      ReadAnalogVoltageMillivolts(/*pin=*/kPinCc2, battery_millivolts));
   const uint16_t cc_millivolts = std::max(cc1_millivolts, cc2_millivolts);
   if (cc_millivolts < kUsbNoConnectionMillivolts) {
     usb_status_ = USBStatus::kNoConnection;
@@ -285,34 +1008,25 @@ void Controller::Step() {
 
     case USBStatus::kUSB1_5:
     case USBStatus::kUSB3_0:
-      digitalWrite(kPinChargeHighCurrentEnable, true);
+      digitalWrite(kPinChargeHighCurrentEnable, !charge_throttled_);
       break;
   }
 
-  if (prev_usb_status_ != usb_status_) {
-    if (usb_status_ == USBStatus::kNoConnection) {
-      vcnl4020_->SetPeriodicAmbient(false);
-      vcnl4020_->SetPeriodicProximity(false);
-    } else {
-      vcnl4020_->SetPeriodicAmbient(true);
-      vcnl4020_->SetPeriodicProximity(true);
-    }
-  }
-
-  prev_usb_status_ = usb_status_;
-
+  const PowerStatus previous_power_status = power_status_;
   {
     const bool power_good_value = !digitalRead(kPinBatteryNPowerGood);
     const bool stat_value = digitalRead(kPinBatteryStat);
-    // TODO: possibly adjust the threshold based on estimated current
-    // consumption when the white LEDs are on.
+    // The LED's load makes the voltage sag, so compare the estimated
+    // open-circuit voltage instead. Otherwise, the cutoff would trigger while
+    // plenty of charge remains.
+    const uint16_t open_circuit_millivolts =
+        GetOpenCircuitBatteryMillivolts();
     static bool battery_low = false;
     if (battery_low) {
-      battery_low = GetFilteredBatteryMillivolts() <
-                    GetLowBatteryHysteresisThresholdMillivolts();
-    } else {
       battery_low =
-          GetFilteredBatteryMillivolts() < GetLowBatteryCutoffMillivolts();
+          open_circuit_millivolts < GetLowBatteryHysteresisThresholdMillivolts();
+    } else {
+      battery_low = open_circuit_millivolts < GetLowBatteryCutoffMillivolts();
     }
 
     if (battery_low && power_good_value && !stat_value) {
@@ -334,109 +1048,106 @@ void Controller::Step() {
     // TODO: detect stat pin blinking at 1Hz, which indicates a fault
   }
 
-  if (power_status_ == PowerStatus::kLowBatteryCutoff) {
+  if (power_status_known_ && power_status_ != previous_power_status) {
+    if (power_status_ == PowerStatus::kLowBatteryCutoff) {
+      usage_stats_.low_battery_cutoffs++;
+      usage_stats_dirty_ = true;
+    }
+    if (IsCharging(power_status_) &&
+        (previous_power_status == PowerStatus::kBattery ||
+         previous_power_status == PowerStatus::kLowBatteryCutoff)) {
+      usage_stats_.charge_cycles++;
+      usage_stats_dirty_ = true;
+    }
+  }
+  power_status_known_ = true;
+}
+
+void Controller::StepLed() {
+  led_step_wait_ms_ = kLedStepIntervalMs;
+  AccumulateUsage();
+  // Motion edges share the queue with the switch's, and a switch edge must
+  // hold off sleep below, so the events are handled here too.
+  HandlePinEvents();
+  UpdateState();
+  const bool auto_triggered = auto_triggered_;
+  auto_triggered_ = false;
+
+  if (state_ == ControllerState::kCutoff) {
     if (led_on_) {
-      analogWrite(kPinWhiteLed, 0);
-      led_ramper_.SetActual(0);
-      led_on_ = false;
+      TurnOffLedImmediately();
     }
     analogWrite(kPinBatteryLed1, 0);
     analogWrite(kPinBatteryLed2, 0);
     analogWrite(kPinBatteryLed3, 0);
+    RecordStateChanges();
+    ConfigStorage::Flush();
+    CheckpointUsage();
     power_controller_->Stop();
     return;
   }
 
-  bool motion_detected = digitalRead(kPinMotionSensor);
+  // A pulse which ended since the last Step still counts.
+  bool motion_detected = digitalRead(kPinMotionSensor) || motion_edge_pending_;
+  motion_edge_pending_ = false;
+  if (motion_detected != prev_motion_signal_) {
+    prev_motion_signal_ = motion_detected;
+    flight_recorder_.Record(FlightRecorder::Event::kMotion, motion_detected);
+  }
   // If the LED was changed recently, then ignore the motion sensor, since the
   // LEDs shining on the lens can trigger the sensor.
   // https://marriedtotheseacomics.com/image/103884129802
   if (led_change_motion_timeout_.Active()) {
     motion_detected = false;
   }
-  static bool prev_motion_detected;
-  if (motion_detected && !prev_motion_detected) {
+  if (motion_detected && !prev_motion_detected_) {
+    usage_stats_.motion_triggers++;
+    usage_stats_dirty_ = true;
     motion_timer_.Reset();
     motion_proximity_timeout_.Reset();
-    if (config_.proximity_mode == ProximityMode::PROXIMITY_MODE_TOGGLE) {
-      vcnl4020_->SetPeriodicProximity(true);
+    if (GetStatePolicy(state_).proximity == SensorPolicy::kAfterMotion) {
+      ApplyStatePolicy();
     }
   }
-  prev_motion_detected = motion_detected;
+  prev_motion_detected_ = motion_detected;
 
   if (led_on_) {
     led_on_brightness_timeout_.Reset();
   }
 
-  if (power_status_ == PowerStatus::kLowBatteryCutoffCharging) {
-    if (led_on_) {
-      analogWrite(kPinWhiteLed, 0);
-      led_ramper_.SetActual(0);
-      led_on_ = false;
-    }
-  } else if (power_mode_ == PowerMode::kOff) {
-    if (led_on_) {
-      led_ramper_.SetTarget(0);
-    }
-  } else if (usb_status_ != USBStatus::kNoConnection) {
-    if (led_on_) {
-      led_ramper_.SetTarget(0);
-    }
-  } else if (power_mode_ == PowerMode::kOn) {
-    if (!led_on_) {
-      led_ramper_.SetTarget(GetLedDutyCycle());
-    }
-  } else if (power_mode_ == PowerMode::kAuto) {
-    if (motion_detected || auto_triggered) {
-      if (!led_on_ &&
-          (config_.brightnessMode == BrightnessMode::BRIGHTNESS_MODE_DISABLED ||
-           auto_triggered || led_on_brightness_timeout_.Active() ||
-           vcnl4020_->ReadAmbient() < config_.autoBrightnessThreshold)) {
-        led_ramper_.SetTarget(GetLedDutyCycle());
-        led_change_motion_timeout_.Reset();
-      }
-      motion_timer_.Reset();
-    } else if (motion_timer_.Running() &&
-               motion_timer_.Get() > GetMotionTimeoutSeconds() * 1000) {
-      if (led_on_) {
-        led_ramper_.SetTarget(0);
-        led_change_motion_timeout_.Reset();
-      }
-      led_on_ = false;
-      motion_timer_.Stop();
-    }
+  const StateActions& actions = kStateActions[static_cast<size_t>(state_)];
+  if (actions.step != nullptr) {
+    (this->*actions.step)(motion_detected, auto_triggered);
   }
 
-  if (motion_proximity_timeout_.Expired() &&
-      power_mode_ != PowerMode::kToggled &&
-      usb_status_ == USBStatus::kNoConnection) {
-    vcnl4020_->SetPeriodicProximity(false);
+  if (motion_proximity_timeout_.Expired()) {
     motion_proximity_timeout_.Stop();
+    if (GetStatePolicy(state_).proximity == SensorPolicy::kAfterMotion) {
+      ApplyStatePolicy();
+    }
   }
 
   if (kShowBatteryStatus) {
     if (power_status_ == PowerStatus::kCharging ||
         power_status_ == PowerStatus::kLowBatteryCutoffCharging) {
-      const uint16_t battery_millivolts =
-          battery_average_filter_.GetFilteredValue();
+      const uint8_t battery_percent = GetBatteryPercent();
       // Slow blink
       const uint8_t brightness = (millis() / 500) % 2 == 0
                                      ? kBatteryLedActiveBrightness
                                      : kBatteryLedPlaceholderBrightness;
-      analogWrite(kPinBatteryLed1, battery_millivolts > kBatteryVoltage1
+      analogWrite(kPinBatteryLed1, battery_percent > kBatteryLevel1Percent
                                        ? brightness
                                        : kBatteryLedPlaceholderBrightness);
-      analogWrite(kPinBatteryLed2, battery_millivolts > kBatteryVoltage0
+      analogWrite(kPinBatteryLed2, battery_percent > kBatteryLevel0Percent
                                        ? brightness
                                        : kBatteryLedPlaceholderBrightness);
       analogWrite(kPinBatteryLed3, brightness);
     } else if (battery_level_timer_.Active()) {
-      const uint16_t battery_millivolts =
-          battery_average_filter_.GetFilteredValue();
-      analogWrite(kPinBatteryLed1, battery_millivolts > kBatteryVoltage1
+      const uint8_t battery_percent = GetBatteryPercent();
+      analogWrite(kPinBatteryLed1, battery_percent > kBatteryLevel1Percent
                                        ? kBatteryLedActiveBrightness
                                        : kBatteryLedPlaceholderBrightness);
-      analogWrite(kPinBatteryLed2, battery_millivolts > kBatteryVoltage0
+      analogWrite(kPinBatteryLed2, battery_percent > kBatteryLevel0Percent
                                        ? kBatteryLedActiveBrightness
                                        : kBatteryLedPlaceholderBrightness);
       analogWrite(kPinBatteryLed3, kBatteryLedActiveBrightness);
@@ -460,12 +1171,9 @@ void Controller::Step() {
     }
   }
 
-  int16_t prev_actual = led_ramper_.GetActual();
-  led_ramper_.Step();
-  if (led_ramper_.GetActual() != prev_actual) {
-    analogWrite(kPinWhiteLed, led_ramper_.GetActual());
-  }
-  led_on_ = led_ramper_.GetActual() > 0;
+  MeasureAmbientWhileOn();
+  UpdateAdaptiveBrightness();
+  UpdateLed();
 
   const bool proximity_lockout =
       config_.proximity_mode != ProximityMode::PROXIMITY_MODE_DISABLED &&
@@ -478,8 +1186,35 @@ void Controller::Step() {
                          power_status_ == PowerStatus::kCharged ||
                          digitalRead(kPin5vDetect);
 
-  if (!led_on_ && !usb_power && !sleep_lockout_timer.Active() &&
-      !proximity_lockout && !battery_level_timer_.Active()) {
+  RecordStateChanges();
+  // Reading the ambient light would end a blank's measurement, so the sample
+  // waits for it.
+  if (flight_recorder_sample_timer_.Expired() &&
+      !ambient_blank_timer_.Running()) {
+    flight_recorder_sample_timer_.Reset();
+    flight_recorder_.Record(FlightRecorder::Event::kBatteryMillivolts,
+                            GetFilteredBatteryMillivolts());
+    flight_recorder_.Record(FlightRecorder::Event::kAmbientLight,
+                            ReadAmbientLight());
+    flight_recorder_.Record(FlightRecorder::Event::kProximity, ReadProximity());
+  }
+
+  if (!led_on_ && usage_checkpoint_timer_.Expired()) {
+    CheckpointUsage();
+  }
+
+  const bool can_sleep = GetStatePolicy(state_).sleep && !usb_power &&
+                         !sleep_lockout_timer.Active() && !switch_settling_ &&
+                         !proximity_lockout && !battery_level_timer_.Active() &&
+                         !CalibratingProximityCrosstalk();
+  if (can_sleep && !led_on_) {
+    ConfigStorage::Flush();
     power_controller_->Sleep(GetSleepInterval());
+    CountWakeup();
+  } else if (can_sleep && led_driver_->Fading()) {
+    // The fade runs without the CPU, and stop mode would stop it. There's
+    // nothing to do until it ends, so the main loop can idle until then.
+    led_step_wait_ms_ =
+        std::max(led_driver_->FadeRemainingMs(), kLedStepIntervalMs);
   }
 }
@@ -24,6 +24,13 @@
 #include <exponential-moving-average-filter.h>
 #include <median-filter.h>
 
+#include <array>
+
+#include "adaptive-brightness.h"
+#include "battery-estimator.h"
+#include "flight-recorder.h"
+#include "led-dimming.h"
+#include "led-driver.h"
 #include "pb.h"  // Needed to trigger inclusion of the Nanopb-generated files
 #include "power-controller.h"
 #include "ramper.h"
@@ -67,6 +74,73 @@ enum class USBStatus {
   kUSB3_0,
 };
 
+// The states of the controller. The state follows from the power status, the
+// USB connection and the power mode, in that order of precedence.
+enum class ControllerState {
+  // The battery is empty, so the device shuts down.
+  kCutoff,
+  // The battery is empty, but charging. Only the charge status is shown.
+  kCutoffCharging,
+  // Connected to USB. The LED is off, and the sensors run, so that their
+  // readings can be shown while configuring the light.
+  kUsb,
+  kOff,
+  kOn,
+  kAuto,
+  // The proximity sensor toggled the light, so it holds its current state.
+  kToggled,
+};
+
+// Whether a sensor measures periodically.
+enum class SensorPolicy {
+  kOff,
+  kOn,
+  // On if the config uses the sensor: the brightness mode for the ambient light
+  // sensor, or the proximity mode for the proximity sensor.
+  kConfigured,
+  // Like kConfigured, but only for kMotionProximityPeriodMs after motion.
+  kAfterMotion,
+};
+
+// What runs in a state.
+struct StatePolicy {
+  SensorPolicy ambient;
+  SensorPolicy proximity;
+  // Whether motion wakes the device from sleep.
+  bool motion_wakeup;
+  // Whether the device may sleep, if nothing else keeps it awake.
+  bool sleep;
+};
+
+// Indexed by ControllerState.
+static constexpr StatePolicy kStatePolicies[] = {
+    // kCutoff
+    {SensorPolicy::kOff, SensorPolicy::kOff, /*motion_wakeup=*/false,
+     /*sleep=*/true},
+    // kCutoffCharging
+    {SensorPolicy::kOff, SensorPolicy::kOff, /*motion_wakeup=*/false,
+     /*sleep=*/true},
+    // kUsb
+    {SensorPolicy::kOn, SensorPolicy::kOn, /*motion_wakeup=*/false,
+     /*sleep=*/false},
+    // kOff
+    {SensorPolicy::kOff, SensorPolicy::kOff, /*motion_wakeup=*/false,
+     /*sleep=*/true},
+    // kOn
+    {SensorPolicy::kOff, SensorPolicy::kOff, /*motion_wakeup=*/false,
+     /*sleep=*/true},
+    // kAuto
+    {SensorPolicy::kConfigured, SensorPolicy::kAfterMotion,
+     /*motion_wakeup=*/true, /*sleep=*/true},
+    // kToggled: the proximity sensor has to keep running to toggle back.
+    {SensorPolicy::kConfigured, SensorPolicy::kConfigured,
+     /*motion_wakeup=*/true, /*sleep=*/true},
+};
+
+constexpr const StatePolicy& GetStatePolicy(const ControllerState state) {
+  return kStatePolicies[static_cast<size_t>(state)];
+}
+
 // Defaults if the config hasn't been programmed. Keep in sync with the UI
 // defaults in open-motion-light-manager:src/components/DeviceConfig/index.tsx
 static constexpr ConfigPb kDefaultConfig = ConfigPb{
@@ -82,15 +156,20 @@ static constexpr ConfigPb kDefaultConfig = ConfigPb{
   low_battery_hysteresis_threshold_millivolts : 3200,
   motion_sensitivity :
       MotionSensitivity::MotionSensitivity_MOTION_SENSITIVITY_ONE,
+  battery_derate_start_percent : 30,
+  battery_reserve_percent : 10,
+  battery_reserve_led_duty_cycle : 40,
+  pwm_profile : PwmProfile::PwmProfile_PWM_PROFILE_HIGH_RESOLUTION,
 };
 
 class Controller {
  public:
   Controller(TemperatureSensor* temperature_sensor, VCNL4020* vcnl4020,
-             PowerController* power_controller)
+             PowerController* power_controller, LedDriver* led_driver)
       : temperature_sensor_(temperature_sensor),
         vcnl4020_(vcnl4020),
-        power_controller_(power_controller) {}
+        power_controller_(power_controller),
+        led_driver_(led_driver) {}
 
   // Initializes this object. Returns whether this was successful.
   bool Init();
@@ -99,8 +178,26 @@ class Controller {
   // part of Init.
   void InitPins();
 
+  // Runs each of the steps below, in order. The firmware schedules them
+  // separately instead, each at its own interval.
   void Step();
 
+  // Filters the battery voltage, and updates the state of charge estimate.
+  void StepBattery();
+  // Reads the power mode switch once it has settled, and checks for the
+  // proximity toggle gesture.
+  void StepMode();
+  // Detects the USB connection and the charger's status, and throttles
+  // charging when hot.
+  void StepPower();
+  // Moves to the state that the inputs call for, handles motion, drives the
+  // LEDs, and sleeps when nothing is going on.
+  void StepLed();
+
+  // Returns how long StepLed can wait before its next run. This is longer than
+  // kLedStepIntervalMs while a fade plays back with nothing else going on.
+  uint32_t GetLedStepWaitMs() const { return led_step_wait_ms_; }
+
   PowerMode GetPowerMode() const { return power_mode_; }
   PowerStatus GetPowerStatus() const { return power_status_; }
   USBStatus GetUSBStatus() const { return usb_status_; }
@@ -110,6 +207,28 @@ class Controller {
     return battery_average_filter_.GetFilteredValue();
   }
 
+  // Returns the battery voltage with the sag caused by the current load added
+  // back. This is what the low battery cutoff uses.
+  uint16_t GetOpenCircuitBatteryMillivolts() const {
+    return battery_estimator_.EstimateOpenCircuitMillivolts(
+        GetFilteredBatteryMillivolts());
+  }
+
+  // The estimated state of charge, from 0 to 100.
+  uint8_t GetBatteryPercent() const { return battery_estimator_.GetPercent(); }
+
+  uint32_t GetBatteryResistanceMilliohms() const {
+    return battery_estimator_.GetInternalResistanceMilliohms();
+  }
+
+  // Estimates how long the battery would last with the LED on at the configured
+  // brightness.
+  uint32_t GetRuntimeMinutes() const {
+    return battery_estimator_.GetRuntimeMinutes(
+        GetFilteredBatteryMillivolts(),
+        led_dimming::LevelToDutyCycle(GetLedTargetDutyCycle()));
+  }
+
   // Reads the raw (unfiltered) battery voltage, in millivolts. Visible for
   // testing.
   static uint16_t ReadRawBatteryMillivolts();
@@ -117,11 +236,29 @@ class Controller {
   static uint16_t ReadAnalogVoltageMillivolts(uint32_t pin,
                                               uint16_t battery_millivolts);
 
-  uint16_t ReadProximity() { return vcnl4020_->ReadProximity(); }
-  uint16_t ReadAmbientLight() { return vcnl4020_->ReadAmbient(); }
+  // Reads the battery voltage, in millivolts, corrected using the calibration.
+  uint16_t ReadBatteryMillivolts() const {
+    return CorrectAdcMillivolts(ReadRawBatteryMillivolts());
+  }
+
+  // Reads the proximity, with the crosstalk from the enclosure removed.
+  uint16_t ReadProximity() {
+    return RemoveProximityCrosstalk(vcnl4020_->ReadProximity());
+  }
+
+  // Reads the ambient light, corrected for the lens in front of the sensor.
+  uint16_t ReadAmbientLight() {
+    return CorrectAmbientLight(vcnl4020_->ReadAmbient());
+  }
+
+  // Returns the MCU temperature, in degrees Celsius, as of the last sample.
+  int16_t GetTemperature() const { return temperature_celsius_; }
 
-  // Reads the MCU temperature, in degrees Celsius.
-  int16_t ReadTemperature() { return temperature_sensor_->ReadTemperature(); }
+  // Whether the board is hot enough that high-current charging is disabled.
+  bool IsChargeThrottled() const { return charge_throttled_; }
+
+  // Whether the board is hot enough that the LED is dimmed.
+  bool IsLedDerated() const { return led_derated_; }
 
   // How long the light should be on for after motion is detected. Visible for
   // testing.
@@ -129,12 +266,29 @@ class Controller {
     return config_.motion_timeout_seconds;
   }
 
-  // The brightness of the white LEDs when they're on.
-  // Note: with a 20kHz output duty cycle, minimum value is 3.
+  // The brightness of the white LEDs when they're on, as a perceptual level
+  // out of led_dimming::kMaxLevel.
   uint32_t GetLedDutyCycle() const { return config_.led_duty_cycle; }
 
+  // The duty cycle to drive the white LEDs at when they're on. This is
+  // GetLedDutyCycle, reduced as the battery runs down and when the board is
+  // hot.
+  uint32_t GetLedTargetDutyCycle() const;
+
+  // The duty cycle to turn the white LEDs on at. In adaptive brightness mode,
+  // this is only as bright as needed to top up the daylight.
+  uint32_t GetLedOnDutyCycle() const;
+
+  // Reduces `duty_cycle` for the battery's state of charge. Between
+  // battery_derate_start_percent and battery_reserve_percent, the LED's power
+  // falls in proportion to the state of charge, down to the reserve
+  // brightness. Visible for testing.
+  uint32_t DerateForBattery(uint32_t duty_cycle, uint8_t battery_percent) const;
+
   // This is considered to be the "empty" point for the battery. Below this
   // voltage, the device goes into a lower-power mode to minimize battery drain.
+  // This is compared to the estimated open-circuit voltage, so it doesn't
+  // depend on the load.
   uint32_t GetLowBatteryCutoffMillivolts() const {
     return config_.low_battery_cutoff_millivolts;
   }
@@ -150,6 +304,51 @@ class Controller {
   ConfigPb const* GetConfig() const { return &config_; };
   void SetConfig(const ConfigPb& config);
 
+  // Applies only the fields of `update` which are set in `field_mask`, and
+  // recomputes only the state which depends on the fields that changed.
+  void UpdateConfig(const ConfigPb& update, uint32_t field_mask);
+
+  // Returns the bit for a ConfigPb field in a field mask. Bit N corresponds to
+  // field number N.
+  static constexpr uint32_t ConfigFieldBit(uint32_t field_number) {
+    return 1u << field_number;
+  }
+  static constexpr uint32_t kAllConfigFields = ~0u;
+
+  // Returns the lifetime usage counters, including usage which hasn't been
+  // saved yet.
+  const UsageStatsPb& GetUsageStats() const { return usage_stats_; }
+
+  // Resets the usage counters to zero, and saves them.
+  void ResetUsageStats();
+
+  const FlightRecorder& GetFlightRecorder() const { return flight_recorder_; }
+
+  const CalibrationPb& GetCalibration() const { return calibration_; }
+
+  // Applies a calibration. This doesn't save it.
+  void SetCalibration(const CalibrationPb& calibration);
+
+  // Starts measuring the proximity crosstalk, by averaging the next
+  // kCrosstalkCalibrationSamples proximity readings. Once done, the calibration
+  // is updated and saved. There must be nothing in front of the sensor.
+  void StartProximityCrosstalkCalibration();
+  bool CalibratingProximityCrosstalk() const {
+    return crosstalk_samples_remaining_ > 0;
+  }
+
+  static constexpr uint8_t kCrosstalkCalibrationSamples = 16;
+
+  // Used when the calibration doesn't specify the proximity LED current.
+  static constexpr uint8_t kDefaultProximityLedCurrentMilliamps = 80;
+
+  // Sensor values are recorded in the flight recorder this often.
+  static constexpr uint32_t kFlightRecorderSampleIntervalMs = 10 * 1000;
+
+  // Usage counters are saved at most this often, and only while the LED is
+  // off, since saving stalls the main loop. They're also saved before stopping.
+  static constexpr uint32_t kUsageCheckpointIntervalMs = 60 * 60 * 1000;
+
   // Tuning constants - visible for testing
   static constexpr uint8_t kBatteryFilterAlpha = 64;
   static constexpr uint8_t kBatteryMedianFilterSize = 5;
@@ -177,6 +376,20 @@ class Controller {
   // ignore 2 seconds to ensure there are no samples included with the light on.
   static constexpr uint32_t kBrightnessIgnorePeriodMs = 2000;
 
+  // In adaptive brightness mode, the LED is only retargeted once the ideal
+  // brightness differs by more than this many levels, so that sensor noise
+  // doesn't keep it fading back and forth.
+  static constexpr uint32_t kAdaptiveHysteresisLevels = 8;
+
+  // While the LED is on in a brightness mode which uses the ambient light, it
+  // is blanked this often, for an ambient light measurement without its own
+  // light. This notices daylight arriving.
+  static constexpr uint32_t kAmbientBlankIntervalMs = 5 * 1000;
+  // The longest blank. A single conversion takes a few milliseconds, which is
+  // too short to see. If the sensor hasn't finished by then, the measurement
+  // is abandoned.
+  static constexpr uint32_t kAmbientBlankTimeoutMs = 10;
+
   static constexpr uint16_t kUsbNoConnectionMillivolts = 200;
   static constexpr uint16_t kUsbStandardMillivolts = 660;
   static constexpr uint16_t kUsb1_5Millivolts = 1230;
@@ -189,23 +402,149 @@ class Controller {
   // clarity.
   static constexpr uint16_t kBatteryLedActiveBrightness = 255;
 
-  // Battery levels. This is non-linear, since LiFePO4 batteries have a ~cubic
-  // discharge curve.
-  static inline constexpr uint16_t kBatteryVoltage1 = 3350;
-  static inline constexpr uint16_t kBatteryVoltage0 = 3150;
+  // Battery levels shown on the battery LEDs, as a state of charge in percent.
+  static inline constexpr uint8_t kBatteryLevel1Percent = 60;
+  static inline constexpr uint8_t kBatteryLevel0Percent = 20;
 
   static constexpr uint16_t kSleepLockoutMs = 1000;
 
+  // The power mode switch is read this long after it last changed.
+  static constexpr uint32_t kSwitchDebounceMs = 10;
+
+  // How often the firmware runs each step. Reading the switch more often than
+  // it debounces doesn't help, and the battery filters sample at their own
+  // interval. USB and the charger change rarely, and a 5V edge holds off sleep
+  // until StepPower has seen it. StepLed runs most often, since it ends the
+  // ambient light blanks and responds to motion.
+  static constexpr uint32_t kBatteryStepIntervalMs =
+      kBatteryFilterRunIntervalMillis;
+  static constexpr uint32_t kModeStepIntervalMs = kSwitchDebounceMs;
+  static constexpr uint32_t kPowerStepIntervalMs = 1000;
+  static constexpr uint32_t kLedStepIntervalMs = 5;
+
+  // The temperature is sampled this often. It changes slowly, and each sample
+  // costs two ADC conversions.
+  static constexpr uint32_t kTemperatureSampleIntervalMs = 5 * 1000;
+
+  // Thermal governor thresholds, in degrees Celsius. Each limit is released
+  // once the temperature drops by kThermalHysteresisCelsius. The charger IC
+  // runs hotter than the MCU, so charging is throttled first.
+  static constexpr int16_t kChargeThrottleCelsius = 45;
+  static constexpr int16_t kLedDerateCelsius = 55;
+  static constexpr int16_t kThermalHysteresisCelsius = 5;
+
+  // While derated, the LED is driven at this fraction of its duty cycle.
+  static constexpr uint32_t kLedDeratePercent = 50;
+
+  ControllerState GetState() const { return state_; }
+
+  // The longest time from a motion sensor edge to Step handling it.
+  uint32_t GetMaxMotionLatencyMs() const { return max_motion_latency_ms_; }
+
  private:
-  // Handles an updated config.
-  void ConfigUpdated();
+  // Handles an updated config. Only recomputes the state which depends on the
+  // fields in `changed_fields`.
+  void ConfigUpdated(uint32_t changed_fields = kAllConfigFields);
 
   // Reads the state of the power mode switch.
   static PowerMode ReadPowerMode();
 
+  // Works out the state from the power status, USB connection and power mode.
+  ControllerState ResolveState() const;
+
+  // Moves to the resolved state, running the exit and entry actions if it
+  // changed.
+  void UpdateState();
+
+  // Handles the edges captured by the wakeup pins' interrupts.
+  void HandlePinEvents();
+
+  // Starts and stops the sensors and wakeup sources for the current state.
+  void ApplyStatePolicy();
+
+  // Entry, exit and step actions for the states. Step actions run once per
+  // Step, after the inputs have been read.
+  void EnterCutoffCharging();
+  void EnterLedOff();
+  void ExitAuto();
+  void StepOn(bool motion_detected, bool auto_triggered);
+  void StepAuto(bool motion_detected, bool auto_triggered);
+
+  // The actions for each state, indexed by ControllerState. Null actions do
+  // nothing.
+  struct StateActions {
+    void (Controller::*enter)();
+    void (Controller::*exit)();
+    void (Controller::*step)(bool motion_detected, bool auto_triggered);
+  };
+  static const StateActions kStateActions[];
+
+  // Adds the time since the last call to the usage counters, attributing it to
+  // the current power mode and LED state.
+  void AccumulateUsage();
+
+  // Counts what woke the device up from sleep, judging by the wakeup pins.
+  void CountWakeup();
+
+  // Saves the usage counters, if they've changed since they were last saved.
+  void CheckpointUsage();
+
+  // Records changes to the controller state in the flight recorder.
+  void RecordStateChanges();
+
+  // Updates the state of charge estimate, using the current LED and charger
+  // state.
+  void UpdateBatteryEstimate();
+
+  // Moves the LED to GetLedOnDutyCycle, if it's on.
+  void RetargetLed();
+
+  // In adaptive brightness mode, feeds new ambient light readings to the
+  // model, and retargets the LED if the daylight has changed.
+  void UpdateAdaptiveBrightness();
+
+  // Periodically blanks the LED while it's on, and measures the daylight.
+  void MeasureAmbientWhileOn();
+  void EndAmbientBlank();
+  // Turns the LED off or down for a measurement of the daylight.
+  void HandleDaylight(uint16_t daylight);
+
+  // Starts a fade if the LED's target changed, and reads back the LED's state.
+  // Fades are timed by the LED driver, so this doesn't need to be called while
+  // they're in progress.
+  void UpdateLed();
+
+  // Turns the LED off without fading.
+  void TurnOffLedImmediately();
+
+  // Samples the temperature, and updates the thermal limits.
+  void UpdateThermalLimits();
+
+  // Computes the calibration coefficients. Unlike SetCalibration, this doesn't
+  // touch the sensors, so it can be used before they're initialized.
+  void ApplyCalibration(const CalibrationPb& calibration);
+
+  // Apply the calibration coefficients to sensor readings.
+  uint16_t CorrectAdcMillivolts(uint16_t millivolts) const;
+  uint16_t RemoveProximityCrosstalk(uint16_t proximity) const;
+  uint16_t CorrectAmbientLight(uint16_t ambient) const;
+
+  // Returns the proximity LED current to use, rounded to the sensor's
+  // precision.
+  uint8_t GetProximityLedCurrentMilliamps() const;
+
   PowerMode power_mode_ = PowerMode::kOff;
+  // Set by each StepLed, for GetLedStepWaitMs.
+  uint32_t led_step_wait_ms_ = kLedStepIntervalMs;
+  // Set by StepMode when the switch moves to auto, for StepLed to turn the LED
+  // on.
+  bool auto_triggered_ = false;
   // Used to debounce reading the power mode switch.
-  CountDownTimer power_mode_read_timer_{10};
+  CountDownTimer power_mode_read_timer_{kSwitchDebounceMs};
+  // Set by an edge on the switch pins, until it has been kSwitchDebounceMs
+  // since the last one.
+  bool switch_settling_ = false;
+  uint32_t switch_edge_ms_ = 0;
 
   // After anything changes, wait this long before going to sleep. This prevents
   // missing mode changes if the switch bounces.
@@ -213,7 +552,10 @@ class Controller {
 
   PowerStatus power_status_ = PowerStatus::kBattery;
   USBStatus usb_status_ = USBStatus::kNoConnection;
-  USBStatus prev_usb_status_ = USBStatus::kNoConnection;
+
+  ControllerState state_ = ControllerState::kOff;
+  // The state's entry actions haven't run until the first Step.
+  bool state_known_ = false;
 
   CountUpTimer motion_timer_;
 
@@ -225,7 +567,7 @@ class Controller {
   bool led_on_ = false;
 
   MedianFilter<uint16_t, uint16_t, kBatteryMedianFilterSize>
-      battery_median_filter_{Controller::ReadRawBatteryMillivolts};
+      battery_median_filter_{[this]() { return ReadBatteryMillivolts(); }};
   ExponentialMovingAverageFilter<uint16_t> battery_average_filter_{
       [this]() { return battery_median_filter_.GetFilteredValue(); },
       kBatteryFilterAlpha};
@@ -233,10 +575,69 @@ class Controller {
   VCNL4020* const vcnl4020_;
   PowerController* const power_controller_;
   TemperatureSensor* const temperature_sensor_;
-
-  Ramper led_ramper_;
+  LedDriver* const led_driver_;
+
+  // Holds the LED's ramp rates and target. The ramp itself is played back by
+  // the LED driver.
+  Ramper<uint16_t> led_ramper_;
+  // The target of the last fade started.
+  uint16_t led_fade_target_ = 0;
+
+  AdaptiveBrightness adaptive_brightness_;
+  CountDownTimer ambient_blank_interval_timer_{kAmbientBlankIntervalMs};
+  // Running while the LED is blanked.
+  CountDownTimer ambient_blank_timer_{kAmbientBlankTimeoutMs};
+  // Set when the LED was turned off because of daylight. The ambient light is
+  // known to be accurate then, so it's used right away.
+  bool led_off_for_daylight_ = false;
 
   int32_t prev_proximity_ = 0;
 
   ConfigPb config_ = kDefaultConfig;
+
+  UsageStatsPb usage_stats_ = UsageStatsPb_init_zero;
+  bool usage_stats_dirty_ = false;
+  CountDownTimer usage_checkpoint_timer_{kUsageCheckpointIntervalMs};
+  uint32_t usage_millis_ = 0;
+  // Time which hasn't been added to the counters yet, since they only count
+  // whole seconds.
+  std::array<uint32_t, 4> power_mode_remainder_ms_ = {};
+  uint32_t led_on_remainder_ms_ = 0;
+  // In units of duty cycle * milliseconds.
+  uint64_t led_duty_remainder_ = 0;
+  // Whether power_status_ has been computed since boot, so that transitions can
+  // be counted.
+  bool power_status_known_ = false;
+
+  BatteryEstimator battery_estimator_;
+
+  int16_t temperature_celsius_ = 0;
+  CountDownTimer temperature_sample_timer_{kTemperatureSampleIntervalMs};
+  bool charge_throttled_ = false;
+  bool led_derated_ = false;
+
+  CalibrationPb calibration_ = CalibrationPb_init_zero;
+  // Coefficients derived from the calibration, so that applying it is cheap.
+  // Gains are unsigned 16.16 fixed-point.
+  uint32_t adc_gain_q16_ = 1 << 16;
+  int32_t adc_offset_millivolts_ = 0;
+  uint16_t proximity_crosstalk_ = 0;
+  uint32_t ambient_gain_q16_ = 1 << 16;
+
+  uint8_t crosstalk_samples_remaining_ = 0;
+  uint32_t crosstalk_sample_sum_ = 0;
+
+  FlightRecorder flight_recorder_;
+  CountDownTimer flight_recorder_sample_timer_{kFlightRecorderSampleIntervalMs};
+  // The state as of the last record.
+  PowerMode recorded_power_mode_ = PowerMode::kOff;
+  PowerStatus recorded_power_status_ = PowerStatus::kBattery;
+  USBStatus recorded_usb_status_ = USBStatus::kNoConnection;
+  bool recorded_led_on_ = false;
+  bool prev_motion_signal_ = false;
+  bool prev_motion_detected_ = false;
+  // Set by a rising edge captured by the motion sensor's interrupt, so that a
+  // pulse which ends before the next Step isn't missed.
+  bool motion_edge_pending_ = false;
+  uint32_t max_motion_latency_ms_ = 0;
 };
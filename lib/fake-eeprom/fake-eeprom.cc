@@ -2,6 +2,8 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+
 uint8_t EEPROMClass::read(int idx) const {
   EXPECT_GE(idx, 0);
   EXPECT_LT(idx, kSize);
@@ -11,10 +13,44 @@ uint8_t EEPROMClass::read(int idx) const {
 void EEPROMClass::write(int idx, uint8_t val) {
   EXPECT_GE(idx, 0);
   EXPECT_LT(idx, kSize);
+  if (losing_power_) {
+    if (writes_until_power_loss_ == 0) {
+      return;
+    }
+    writes_until_power_loss_--;
+  }
   data_[idx] = val;
+  write_counts_[idx]++;
+}
+
+void EEPROMClass::update(int idx, uint8_t val) {
+  if (read(idx) != val) {
+    write(idx, val);
+  }
+}
+
+void EEPROMClass::reset() {
+  data_.fill(0);
+  write_counts_.fill(0);
+  restore_power();
+}
+
+uint32_t EEPROMClass::write_count(int idx) const {
+  EXPECT_GE(idx, 0);
+  EXPECT_LT(idx, kSize);
+  return write_counts_[idx];
+}
+
+uint32_t EEPROMClass::max_write_count() const {
+  return *std::max_element(write_counts_.begin(), write_counts_.end());
+}
+
+void EEPROMClass::lose_power_after(uint32_t writes) {
+  losing_power_ = true;
+  writes_until_power_loss_ = writes;
 }
 
-void EEPROMClass::reset() { data_.fill(0); }
+void EEPROMClass::restore_power() { losing_power_ = false; }
 
 std::ostream& operator<<(std::ostream& os, const EEPROMClass eeprom) {
   uint32_t magicByte0;
@@ -10,6 +10,8 @@ class EEPROMClass {
  public:
   uint8_t read(int idx) const;
   void write(int idx, uint8_t val);
+  // Writes only if the value differs.
+  void update(int idx, uint8_t val);
 
   template <typename T>
   T& get(int idx, T& t) const;
@@ -19,15 +21,33 @@ class EEPROMClass {
   // Specific to tests, not part of the Arduino API
   void reset();
 
- private:
+  // The backing storage. This stands in for the memory-mapped data EEPROM.
+  const uint8_t* data() const { return data_.data(); }
+
+  // Returns how many times this cell has been written since the last reset.
+  uint32_t write_count(int idx) const;
+
+  // Returns the highest write count of any cell.
+  uint32_t max_write_count() const;
+
+  // Simulates a brown-out: after this many more writes, further writes are
+  // dropped until restore_power() or reset() is called.
+  void lose_power_after(uint32_t writes);
+  void restore_power();
+
   static constexpr size_t kSize = 2 * 1024;
+
+ private:
   std::array<uint8_t, kSize> data_;
+  std::array<uint32_t, kSize> write_counts_;
+  bool losing_power_ = false;
+  uint32_t writes_until_power_loss_ = 0;
 };
 
 template <typename T>
 T& EEPROMClass::get(int idx, T& t) const {
   EXPECT_GE(idx, 0);
-  EXPECT_LT(idx, kSize - sizeof(T));
+  EXPECT_LE(idx + sizeof(T), kSize);
 
   uint8_t* ptr = reinterpret_cast<uint8_t*>(&t);
   for (size_t i = 0; i < sizeof(T); ++i) {
@@ -39,11 +59,11 @@ T& EEPROMClass::get(int idx, T& t) const {
 template <typename T>
 const T& EEPROMClass::put(int idx, const T& t) {
   EXPECT_GE(idx, 0);
-  EXPECT_LT(idx, kSize - sizeof(T));
+  EXPECT_LE(idx + sizeof(T), kSize);
 
   const uint8_t* ptr = reinterpret_cast<const uint8_t*>(&t);
   for (size_t i = 0; i < sizeof(T); ++i) {
-    data_[idx + i] = ptr[i];
+    update(idx + i, ptr[i]);
   }
   return t;
 }
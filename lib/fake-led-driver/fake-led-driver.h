@@ -0,0 +1,125 @@
+#pragma once
+
+#include <gtest/gtest.h>
+#include <types.h>
+
+#include <algorithm>
+#include <array>
+
+#include "led-driver.h"
+#include "pins.h"
+
+// Native model of the LED driver. This models the DMA transfers using millis(),
+// and writes the output level to the white LED pin, so that tests can check it
+// with getAnalogWrite.
+class FakeLedDriver : public LedDriver {
+ public:
+  bool Begin() override {
+    initialized_ = true;
+    return true;
+  }
+
+  void SetPwm(const PwmSettings &settings) override { pwm_ = settings; }
+
+  const PwmSettings &GetPwm() const { return pwm_; }
+
+  void Set(uint16_t level) override {
+    ASSERT_TRUE(initialized_) << "FakeLedDriver::Begin() not yet called";
+    length_ = 0;
+    Unblank();
+    Output(level);
+  }
+
+  void StartFade(const uint16_t *profile, size_t length,
+                 uint32_t step_ms) override {
+    ASSERT_TRUE(initialized_) << "FakeLedDriver::Begin() not yet called";
+    ASSERT_GT(length, 0);
+    ASSERT_LE(length, kMaxFadeSteps);
+    ASSERT_GT(step_ms, 0);
+    Advance();
+    Unblank();
+    std::copy(profile, profile + length, profile_.begin());
+    length_ = length;
+    step_ms_ = step_ms;
+    start_ms_ = millis();
+    fades_started_++;
+  }
+
+  void Blank(bool blank) override {
+    ASSERT_TRUE(initialized_) << "FakeLedDriver::Begin() not yet called";
+    Advance();
+    if (blank == blanked_) {
+      return;
+    }
+    ASSERT_TRUE(!blank || length_ == 0) << "Can't blank during a fade";
+    blanked_ = blank;
+    analogWrite(kPinWhiteLed, blank ? 0 : value_);
+    if (blank) {
+      blanks_++;
+    }
+  }
+
+  bool GetBlanked() const { return blanked_; }
+  uint32_t GetBlanks() const { return blanks_; }
+
+  uint16_t Get() override {
+    Advance();
+    return value_;
+  }
+
+  bool Fading() override {
+    Advance();
+    return length_ > 0;
+  }
+
+  uint32_t FadeRemainingMs() override {
+    Advance();
+    if (length_ == 0) {
+      return 0;
+    }
+    return start_ms_ + length_ * step_ms_ - millis();
+  }
+
+  uint32_t GetFadesStarted() const { return fades_started_; }
+
+ private:
+  // Applies the profile entries which the DMA would have transferred by now.
+  void Advance() {
+    if (length_ == 0) {
+      return;
+    }
+    const uint32_t transfers = (millis() - start_ms_) / step_ms_;
+    if (transfers == 0) {
+      return;
+    }
+    Output(profile_[std::min<size_t>(transfers, length_) - 1]);
+    if (transfers >= length_) {
+      length_ = 0;
+    }
+  }
+
+  void Unblank() {
+    if (blanked_) {
+      blanked_ = false;
+      analogWrite(kPinWhiteLed, value_);
+    }
+  }
+
+  void Output(uint16_t level) {
+    if (level != value_) {
+      value_ = level;
+      analogWrite(kPinWhiteLed, level);
+    }
+  }
+
+  bool initialized_ = false;
+  PwmSettings pwm_ = {};
+  uint16_t value_ = 0;
+  bool blanked_ = false;
+  uint32_t blanks_ = 0;
+  std::array<uint16_t, kMaxFadeSteps> profile_;
+  size_t length_ = 0;
+  uint32_t step_ms_ = 0;
+  uint32_t start_ms_ = 0;
+  uint32_t fades_started_ = 0;
+};
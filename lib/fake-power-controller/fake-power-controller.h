@@ -19,6 +19,8 @@
 #include <gtest/gtest.h>
 #include <types.h>
 
+#include <deque>
+
 #include "power-controller.h"
 
 class FakePowerController : public PowerController {
@@ -32,6 +34,31 @@ class FakePowerController : public PowerController {
     ASSERT_TRUE(initialized_);
     ASSERT_LT(pin, kPinMax);
     interrupts_[pin] = mode;
+    interrupts_enabled_[pin] = true;
+  }
+
+  void SetInterruptWakeupEnabled(uint32_t pin, bool enabled) override {
+    ASSERT_LT(pin, kPinMax);
+    ASSERT_NE(interrupts_[pin], 0) << "Wakeup not attached";
+    interrupts_enabled_[pin] = enabled;
+  }
+
+  bool PopPinEvent(PinEvent *event) override {
+    if (pin_events_.empty()) {
+      return false;
+    }
+    *event = pin_events_.front();
+    pin_events_.pop_front();
+    return true;
+  }
+
+  // Queues an edge, as if the pin's interrupt handler had captured it.
+  void AddPinEvent(const PinEvent &event) { pin_events_.push_back(event); }
+
+  bool GetInterruptWakeupEnabled(uint32_t pin) {
+    EXPECT_LT(pin, kPinMax);
+    assert(pin < kPinMax);
+    return interrupts_enabled_[pin];
   }
 
   uint32_t GetPinInterruptMode(uint32_t pin) {
@@ -45,12 +72,21 @@ class FakePowerController : public PowerController {
     sleep_millis_ = millis;
   }
 
+  void Idle(uint32_t millis) override {
+    ASSERT_TRUE(initialized_);
+    idle_millis_ = millis;
+  }
+
   void Stop() override { ASSERT_TRUE(initialized_); }
 
   uint32_t GetSleep() { return sleep_millis_; }
+  uint32_t GetIdle() { return idle_millis_; }
 
  private:
   bool initialized_ = false;
   uint32_t sleep_millis_ = 0;
-  std::array<uint32_t, kPinMax> interrupts_;
+  uint32_t idle_millis_ = 0;
+  std::array<uint32_t, kPinMax> interrupts_ = {};
+  std::array<bool, kPinMax> interrupts_enabled_ = {};
+  std::deque<PinEvent> pin_events_;
 };
@@ -12,13 +12,9 @@ bool pb_print_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count) {
   return written == count;
 };
 
-bool pb_stream_read(pb_istream_t *stream, pb_byte_t *buf, size_t count) {
-  Stream *s = reinterpret_cast<Stream *>(stream->state);
-  size_t written = s->readBytes(buf, count);
-  return written == count;
-};
-
-int FakeSerialPort::available() { return input_buffer_.size() - read_idx_; }
+int FakeSerialPort::available() {
+  return input_buffer_bytes_written_ - read_idx_;
+}
 
 int FakeSerialPort::read() {
   if (read_idx_ >= input_buffer_bytes_written_) {
@@ -39,19 +35,22 @@ size_t FakeSerialPort::write(uint8_t c) {
   return 1;
 }
 
-pb_istream_s FakeSerialPort::BuildPbIstream() {
-  return {pb_stream_read, reinterpret_cast<void *>(this),
-          input_buffer_bytes_written_};
-}
-
 pb_ostream_s FakeSerialPort::BuildPbOstream() {
+  advanceMillis(response_millis_);
   return {pb_print_write, reinterpret_cast<void *>(this), kBufferMaxSize,
           /*bytes_written=*/0};
 }
 
+void FakeSerialPort::WriteBytes(const std::string &bytes) {
+  for (const char c : bytes) {
+    input_buffer_[input_buffer_bytes_written_++] = c;
+  }
+}
+
 void FakeSerialPort::Reset() {
   input_buffer_.fill(0);
   output_buffer_.clear();
   read_idx_ = 0;
   input_buffer_bytes_written_ = 0;
+  output_read_idx_ = 0;
 }
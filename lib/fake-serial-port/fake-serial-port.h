@@ -4,21 +4,43 @@
 
 class FakeSerialPort : public SerialPort {
  public:
+  void Begin(uint32_t baud_rate) override { baud_rate_ = baud_rate; }
+  void End() override {}
+  uint32_t GetBaudRate() override { return baud_rate_; }
+  bool CheckRxBufferFull() override {
+    const bool full = rx_buffer_full_;
+    rx_buffer_full_ = false;
+    return full;
+  }
+
   int available() override;
   int read() override;
   int peek() override;
   size_t write(uint8_t c) override;
-  pb_istream_s BuildPbIstream() override;
   pb_ostream_s BuildPbOstream() override;
 
   void Reset();
 
+  // Appends a message to the input buffer.
   template <typename T>
   void WritePb(const pb_msgdesc_t& msg, const T& t);
 
+  // Reads the next message from the output buffer.
   template <typename T>
   void ReadPb(const pb_msgdesc_t& msg, T* t);
 
+  // Appends raw bytes to the input buffer.
+  void WriteBytes(const std::string& bytes);
+
+  // Makes the next call to CheckRxBufferFull return true.
+  void SetRxBufferFull() { rx_buffer_full_ = true; }
+
+  // Makes each response take this long to send, like a slow link.
+  void SetResponseMillis(uint32_t millis) { response_millis_ = millis; }
+
+  // Returns whether the output buffer has unread data.
+  bool HasOutput() const { return output_read_idx_ < output_buffer_.size(); }
+
  private:
   static constexpr size_t kBufferMaxSize = 1024;
 
@@ -26,23 +48,29 @@ class FakeSerialPort : public SerialPort {
   std::string output_buffer_;
   size_t read_idx_ = 0;
   size_t input_buffer_bytes_written_ = 0;
+  size_t output_read_idx_ = 0;
+  uint32_t baud_rate_ = kDefaultBaudRate;
+  bool rx_buffer_full_ = false;
+  uint32_t response_millis_ = 0;
 };
 
 template <typename T>
 void FakeSerialPort::WritePb(const pb_msgdesc_s& msg, const T& t) {
-  input_buffer_.fill(0);
-
-  read_idx_ = 0;
   pb_ostream_s ostream = pb_ostream_from_buffer(
-      reinterpret_cast<uint8_t*>(input_buffer_.data()), kBufferMaxSize);
+      reinterpret_cast<uint8_t*>(input_buffer_.data()) +
+          input_buffer_bytes_written_,
+      kBufferMaxSize - input_buffer_bytes_written_);
   ASSERT_TRUE(pb_encode_ex(&ostream, &msg, &t, PB_ENCODE_DELIMITED));
-  input_buffer_bytes_written_ = ostream.bytes_written;
+  input_buffer_bytes_written_ += ostream.bytes_written;
 }
 
 template <typename T>
 void FakeSerialPort::ReadPb(const pb_msgdesc_s& msg, T* t) {
   pb_istream_s istream = pb_istream_from_buffer(
-      reinterpret_cast<const uint8_t*>(output_buffer_.data()),
-      output_buffer_.size());
+      reinterpret_cast<const uint8_t*>(output_buffer_.data()) +
+          output_read_idx_,
+      output_buffer_.size() - output_read_idx_);
+  const size_t bytes_left = istream.bytes_left;
   ASSERT_TRUE(pb_decode_ex(&istream, &msg, t, PB_DECODE_DELIMITED));
+  output_read_idx_ += bytes_left - istream.bytes_left;
 }
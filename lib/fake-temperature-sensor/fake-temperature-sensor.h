@@ -41,5 +41,5 @@ class FakeTemperatureSensor : public TemperatureSensor {
 
  private:
   bool initialized_ = false;
-  int16_t temperature_;
+  int16_t temperature_ = 25;
 };
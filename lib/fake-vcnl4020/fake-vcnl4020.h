@@ -71,6 +71,27 @@ class FakeVCNL4020 : public VCNL4020 {
     return periodic_ambient_;
   }
 
+  void StartAmbientMeasurement() override {
+    ASSERT_TRUE(initialized_) << "FakeVCNL4020::Begin() not yet called";
+    ambient_measurements_started_++;
+    ambient_measurement_pending_ = true;
+  }
+
+  void CancelAmbientMeasurement() override {
+    ASSERT_TRUE(initialized_) << "FakeVCNL4020::Begin() not yet called";
+    ambient_measurement_pending_ = false;
+  }
+
+  // Whether a measurement has been started, and not yet read or cancelled.
+  // Periodic measurements are paused until then.
+  bool GetAmbientMeasurementPending() const {
+    return ambient_measurement_pending_;
+  }
+
+  uint32_t GetAmbientMeasurementsStarted() const {
+    return ambient_measurements_started_;
+  }
+
   bool AmbientReady() override {
     EXPECT_TRUE(initialized_) << "FakeVCNL4020::Begin() not yet called";
     return ambient_ready_;
@@ -95,6 +116,7 @@ class FakeVCNL4020 : public VCNL4020 {
   uint16_t ReadAmbient() override {
     EXPECT_TRUE(initialized_) << "FakeVCNL4020::Begin() not yet called";
     ambient_ready_ = false;
+    ambient_measurement_pending_ = false;
     return ambient_;
   }
 
@@ -110,4 +132,6 @@ class FakeVCNL4020 : public VCNL4020 {
   uint8_t led_current_ma_;
   uint16_t proximity_;
   uint16_t ambient_;
+  uint32_t ambient_measurements_started_ = 0;
+  bool ambient_measurement_pending_ = false;
 };
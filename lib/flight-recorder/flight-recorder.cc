@@ -0,0 +1,110 @@
+#include "flight-recorder.h"
+
+#include <pb_encode.h>
+
+#include <algorithm>
+
+namespace {
+
+size_t WriteVarint(uint32_t value, uint8_t *out) {
+  size_t length = 0;
+  do {
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    if (value != 0) {
+      byte |= 0x80;
+    }
+    out[length++] = byte;
+  } while (value != 0);
+  return length;
+}
+
+uint32_t ZigZagEncode(const int32_t value) {
+  return (static_cast<uint32_t>(value) << 1) ^
+         static_cast<uint32_t>(value >> 31);
+}
+
+int32_t ZigZagDecode(const uint32_t value) {
+  return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+}
+
+}  // namespace
+
+void FlightRecorder::Record(const Event event, const int32_t value) {
+  const size_t index = static_cast<size_t>(event);
+  const uint32_t now = millis();
+
+  std::array<uint8_t, kMaxRecordSize> record;
+  size_t length = 0;
+  record[length++] = index;
+  length += WriteVarint(now - last_millis_, record.data() + length);
+  length += WriteVarint(ZigZagEncode(value - last_values_[index]),
+                        record.data() + length);
+  last_millis_ = now;
+  last_values_[index] = value;
+
+  while (end_position_ - start_position_ + length > kBufferSize) {
+    DropOldest();
+  }
+  for (size_t i = 0; i < length; i++) {
+    buffer_[(end_position_ + i) & kMask] = record[i];
+  }
+  end_position_ += length;
+}
+
+size_t FlightRecorder::Read(uint32_t position, uint8_t *const out,
+                            const size_t length) const {
+  if (position - start_position_ > end_position_ - start_position_) {
+    return 0;
+  }
+  const size_t count = std::min<size_t>(length, end_position_ - position);
+  for (size_t i = 0; i < count; i++) {
+    out[i] = buffer_[(position + i) & kMask];
+  }
+  return count;
+}
+
+bool FlightRecorder::EncodeChunk(pb_ostream_t *const stream,
+                                 const pb_field_t *const field,
+                                 void *const *const arg) {
+  const Chunk *const chunk = static_cast<const Chunk *>(*arg);
+  if (!pb_encode_tag_for_field(stream, field) ||
+      !pb_encode_varint(stream, chunk->length)) {
+    return false;
+  }
+
+  // Copy through a small block, so that wrapping around the end of the buffer
+  // is handled in one place.
+  std::array<uint8_t, 16> block;
+  uint32_t position = chunk->position;
+  const uint32_t end = chunk->position + chunk->length;
+  while (position != end) {
+    const size_t count = chunk->recorder->Read(
+        position, block.data(), std::min<size_t>(block.size(), end - position));
+    if (count == 0 || !pb_write(stream, block.data(), count)) {
+      return false;
+    }
+    position += count;
+  }
+  return true;
+}
+
+uint32_t FlightRecorder::ReadVarint(uint32_t *const position) const {
+  uint32_t value = 0;
+  for (uint8_t shift = 0; shift < 32; shift += 7) {
+    const uint8_t byte = buffer_[(*position)++ & kMask];
+    value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  return value;
+}
+
+void FlightRecorder::DropOldest() {
+  uint32_t position = start_position_;
+  const size_t index = buffer_[position++ & kMask];
+  start_millis_ += ReadVarint(&position);
+  start_values_[index] += ZigZagDecode(ReadVarint(&position));
+  start_position_ = position;
+}
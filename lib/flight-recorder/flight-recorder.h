@@ -0,0 +1,95 @@
+#pragma once
+
+#include <pb.h>
+#include <types.h>
+
+#include <array>
+
+// Records controller events and sensor samples in a fixed-size ring buffer, for
+// diagnosing problems in the field. Recording is cheap enough to always be on.
+//
+// Each record is the event type (1 byte), then the milliseconds since the
+// previous record (varint), then the change in value since the previous record
+// of the same type (zigzag varint). Typical records are 3-4 bytes. When the
+// buffer is full, the oldest records are dropped, and their deltas are folded
+// into the start time and values.
+//
+// Positions count the bytes recorded since boot, so that the host can download
+// the buffer in chunks while it's being written to.
+class FlightRecorder {
+ public:
+  enum class Event : uint8_t {
+    kPowerMode,
+    kPowerStatus,
+    kUsbStatus,
+    kLedOn,
+    // The raw motion sensor signal.
+    kMotion,
+    // The power mode was toggled using the proximity sensor.
+    kProximityToggle,
+    kBatteryMillivolts,
+    kAmbientLight,
+    kProximity,
+    kCount,
+  };
+  static constexpr size_t kEventCount = static_cast<size_t>(Event::kCount);
+
+  // Must be a power of two.
+  static constexpr size_t kBufferSize = 512;
+
+  // The most data sent in one serial response.
+  static constexpr size_t kChunkSize = 128;
+
+  // Records an event at the current time.
+  void Record(Event event, int32_t value);
+
+  // Positions of the oldest byte held, and of the next byte to be recorded.
+  uint32_t StartPosition() const { return start_position_; }
+  uint32_t EndPosition() const { return end_position_; }
+
+  // The oldest record's time and value deltas are relative to these.
+  uint32_t StartMillis() const { return start_millis_; }
+  int32_t StartValue(Event event) const {
+    return start_values_[static_cast<size_t>(event)];
+  }
+
+  // Copies up to `length` bytes, starting at `position`. Returns how many were
+  // copied.
+  size_t Read(uint32_t position, uint8_t *out, size_t length) const;
+
+  // Describes part of the buffer, to be streamed into a nanopb bytes field.
+  struct Chunk {
+    const FlightRecorder *recorder;
+    uint32_t position;
+    uint32_t length;
+  };
+
+  // nanopb encode callback for a bytes field. `arg` points to a Chunk. This
+  // writes straight from the ring buffer to the stream, without another copy.
+  static bool EncodeChunk(pb_ostream_t *stream, const pb_field_t *field,
+                          void *const *arg);
+
+ private:
+  static constexpr size_t kMask = kBufferSize - 1;
+  static_assert((kBufferSize & kMask) == 0, "kBufferSize is a power of two");
+
+  // Event type, and up to 5 bytes each for two varints.
+  static constexpr size_t kMaxRecordSize = 1 + 5 + 5;
+
+  // Reads a varint starting at `*position`, and advances past it.
+  uint32_t ReadVarint(uint32_t *position) const;
+
+  // Drops the oldest record.
+  void DropOldest();
+
+  std::array<uint8_t, kBufferSize> buffer_;
+  uint32_t start_position_ = 0;
+  uint32_t end_position_ = 0;
+
+  uint32_t start_millis_ = 0;
+  std::array<int32_t, kEventCount> start_values_ = {};
+
+  // Time and values of the newest records.
+  uint32_t last_millis_ = 0;
+  std::array<int32_t, kEventCount> last_values_ = {};
+};
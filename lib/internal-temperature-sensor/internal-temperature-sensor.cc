@@ -1,5 +1,31 @@
 #include "internal-temperature-sensor.h"
 
+#include "pins.h"
+
 bool InternalTemperatureSensor::Begin() { return true; }
 
-int16_t InternalTemperatureSensor::ReadTemperature() { return 1; }
+int16_t InternalTemperatureSensor::ReadTemperature() {
+  const int32_t reference_raw = analogRead(kPinAdcReference);
+  if (reference_raw == 0) {
+    return 0;
+  }
+  const int32_t sensor_raw = analogRead(kPinTemperatureSensor);
+
+  // The calibration values were read with V_DDA at 3.0V, using the full 12
+  // bits. Scale the reading to match, using the reference: its raw value is
+  // inversely proportional to V_DDA. Both are read at the same resolution, so
+  // the resolution cancels out.
+  const int32_t sensor_at_cal =
+      (sensor_raw * static_cast<int32_t>(*kAdcReferencePointer)) /
+      reference_raw;
+
+  const int32_t cal1 = *kTemperatureCal1Pointer;
+  const int32_t cal2 = *kTemperatureCal2Pointer;
+  if (cal2 == cal1) {
+    return 0;
+  }
+  return (sensor_at_cal - cal1) *
+             (kTemperatureCal2Celsius - kTemperatureCal1Celsius) /
+             (cal2 - cal1) +
+         kTemperatureCal1Celsius;
+}
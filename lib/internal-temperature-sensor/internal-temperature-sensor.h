@@ -21,7 +21,9 @@
 #include "temperature-sensor.h"
 
 // Implementation of the temperature sensor HAL using the STM32L051's internal
-// temperature sensor.
+// temperature sensor. Readings are corrected using the factory calibration,
+// and for the supply voltage. Each reading takes two ADC conversions, so callers
+// should read this at a low rate.
 class InternalTemperatureSensor : public TemperatureSensor {
  public:
   bool Begin() override;
@@ -0,0 +1,50 @@
+#include "led-dimming.h"
+
+#include <algorithm>
+
+namespace led_dimming {
+
+uint32_t DutyCycleToLevel(const uint16_t duty_cycle) {
+  return std::upper_bound(kGammaTable.begin(), kGammaTable.end(), duty_cycle) -
+         kGammaTable.begin() - 1;
+}
+
+uint16_t SigmaDelta::Next(const uint16_t duty_cycle) {
+  // Don't let the accumulated error leave the output flickering when it should
+  // be fully off or on.
+  if (duty_cycle == 0 || duty_cycle >= kMaxDutyCycle) {
+    error_ = 0;
+    return duty_cycle == 0 ? 0 : period_ticks_;
+  }
+
+  const int64_t requested =
+      (static_cast<int64_t>(duty_cycle) * period_ticks_ << kFractionalBits) /
+      kMaxDutyCycle;
+  const int64_t wanted = requested - error_;
+  const int64_t min_on = static_cast<int64_t>(min_on_ticks_) << kFractionalBits;
+  uint32_t ticks;
+  if (wanted < min_on) {
+    // Too short a pulse to turn the LED on, so round to off or the shortest
+    // pulse.
+    ticks = wanted * 2 >= min_on ? min_on_ticks_ : 0;
+  } else {
+    const int64_t half = int64_t{1} << (kFractionalBits - 1);
+    ticks = std::min<int64_t>((wanted + half) >> kFractionalBits,
+                              period_ticks_);
+  }
+  error_ += (static_cast<int64_t>(ticks) << kFractionalBits) - requested;
+  return ticks;
+}
+
+bool SigmaDelta::FillPattern(const uint16_t duty_cycle,
+                             uint16_t *const pattern, const size_t length) {
+  error_ = 0;
+  bool varies = false;
+  for (size_t i = 0; i < length; i++) {
+    pattern[i] = Next(duty_cycle);
+    varies |= pattern[i] != pattern[0];
+  }
+  return varies;
+}
+
+}  // namespace led_dimming
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <types.h>
+
+#include <array>
+#include <cstddef>
+
+// Brightness is configured and ramped as a perceptual level, so that each step
+// looks the same size. The levels follow CIE 1931 lightness (L*), and are
+// mapped to linear PWM duty cycles by a table generated at compile time.
+namespace led_dimming {
+
+// Levels run from 0 (off) to this.
+constexpr uint32_t kMaxLevel = 255;
+
+// Linear duty cycles run from 0 to this.
+constexpr uint32_t kMaxDutyCycle = UINT16_MAX;
+
+namespace internal {
+
+constexpr uint16_t LevelToDutyCycle(const uint32_t level) {
+  const double lightness = 100.0 * level / kMaxLevel;
+  const double scaled = (lightness + 16) / 116;
+  const double luminance =
+      lightness > 8 ? scaled * scaled * scaled : lightness / 903.3;
+  return static_cast<uint16_t>(luminance * kMaxDutyCycle + 0.5);
+}
+
+constexpr std::array<uint16_t, kMaxLevel + 1> MakeGammaTable() {
+  std::array<uint16_t, kMaxLevel + 1> table = {};
+  for (uint32_t level = 0; level <= kMaxLevel; level++) {
+    table[level] = LevelToDutyCycle(level);
+  }
+  return table;
+}
+
+}  // namespace internal
+
+constexpr std::array<uint16_t, kMaxLevel + 1> kGammaTable =
+    internal::MakeGammaTable();
+
+// Returns the linear duty cycle for a perceptual level.
+constexpr uint16_t LevelToDutyCycle(const uint32_t level) {
+  return kGammaTable[level > kMaxLevel ? kMaxLevel : level];
+}
+
+// Returns the highest level whose duty cycle is at most `duty_cycle`.
+uint32_t DutyCycleToLevel(uint16_t duty_cycle);
+
+// First-order sigma-delta modulator, which turns linear duty cycles into timer
+// compare values. Duty cycles between two compare values, or below the
+// shortest pulse that turns the LED on, are produced by alternating between
+// nearby values so that the average is right.
+class SigmaDelta {
+ public:
+  // `period_ticks` is the compare value for 100%. `min_on_ticks` is the
+  // smallest non-zero compare value that the output can use.
+  SigmaDelta(uint32_t period_ticks, uint32_t min_on_ticks)
+      : period_ticks_(period_ticks), min_on_ticks_(min_on_ticks) {}
+
+  // Returns the compare value for the next period.
+  uint16_t Next(uint16_t duty_cycle);
+
+  // Fills `pattern` with compare values which average to `duty_cycle`, to be
+  // output repeatedly. Returns whether the values differ, i.e. whether the
+  // pattern needs to be played back at all.
+  bool FillPattern(uint16_t duty_cycle, uint16_t *pattern, size_t length);
+
+ private:
+  // Compare values are computed with this many fractional bits.
+  static constexpr int kFractionalBits = 16;
+
+  uint32_t period_ticks_;
+  uint32_t min_on_ticks_;
+  // The output so far minus the requested output, in fractional ticks.
+  int64_t error_ = 0;
+};
+
+}  // namespace led_dimming
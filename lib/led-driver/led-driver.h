@@ -0,0 +1,59 @@
+#pragma once
+
+#include <types.h>
+
+#include <cstddef>
+
+// How the PWM signal is generated.
+struct PwmSettings {
+  uint32_t frequency_hz;
+  // Whether levels which fall between two compare values are dithered.
+  bool dither;
+
+  bool operator==(const PwmSettings &other) const {
+    return frequency_hz == other.frequency_hz && dither == other.dither;
+  }
+};
+
+// HAL for the white LED's PWM output. Brightness is given as a perceptual
+// level, out of led_dimming::kMaxLevel, which the driver maps to a duty cycle.
+// Fades are streamed to the output by hardware, so that the CPU can sleep while
+// they're in progress.
+class LedDriver {
+ public:
+  // The most steps in a fade.
+  static constexpr size_t kMaxFadeSteps = 128;
+
+  // The range of PWM frequencies which the MT9284 LED driver supports.
+  static constexpr uint32_t kMinPwmFrequencyHz = 20 * 1000;
+  static constexpr uint32_t kMaxPwmFrequencyHz = 1000 * 1000;
+
+  virtual bool Begin() = 0;
+
+  // Changes how the PWM signal is generated. A steady level is output again
+  // with the new settings, and a fade uses them once it finishes.
+  virtual void SetPwm(const PwmSettings &settings) = 0;
+
+  // Sets the level immediately, cancelling any fade in progress.
+  virtual void Set(uint16_t level) = 0;
+
+  // Starts a fade, cancelling any fade in progress. Each entry of `profile` is
+  // output in turn, one every `step_ms`, starting `step_ms` from now. The
+  // profile is copied, so it doesn't need to outlive this call.
+  virtual void StartFade(const uint16_t *profile, size_t length,
+                         uint32_t step_ms) = 0;
+
+  // Turns the output off while `blank` is set, without changing the level. This
+  // is used to measure the ambient light without the LED's own light. It
+  // shouldn't be started during a fade. Set and StartFade end the blank.
+  virtual void Blank(bool blank) = 0;
+
+  // Returns the level currently being output.
+  virtual uint16_t Get() = 0;
+
+  // Whether a fade is in progress.
+  virtual bool Fading() = 0;
+
+  // Returns roughly how long until the fade in progress completes.
+  virtual uint32_t FadeRemainingMs() = 0;
+};
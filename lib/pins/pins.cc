@@ -16,3 +16,7 @@
 
 const uint16_t *const kAdcReferencePointer =
     static_cast<const uint16_t *>(VREFINT_CAL_ADDR);
+const uint16_t *const kTemperatureCal1Pointer =
+    static_cast<const uint16_t *>(TEMPSENSOR_CAL1_ADDR);
+const uint16_t *const kTemperatureCal2Pointer =
+    static_cast<const uint16_t *>(TEMPSENSOR_CAL2_ADDR);
@@ -61,3 +61,13 @@ constexpr int kPinAdcReference = AVREF;
 // ADC. Since this points to memory, the value is not known at compile time, so
 // it can't be constexpr. The typical reference voltage is 1.224v.
 extern const uint16_t *const kAdcReferencePointer;
+
+// The MCU's internal temperature sensor.
+constexpr int kPinTemperatureSensor = ATEMP;
+
+// Pointers to the factory-calibrated temperature sensor readings, taken at
+// these temperatures with V_DDA at 3.0V.
+extern const uint16_t *const kTemperatureCal1Pointer;
+extern const uint16_t *const kTemperatureCal2Pointer;
+constexpr int32_t kTemperatureCal1Celsius = TEMPSENSOR_CAL1_TEMP;
+constexpr int32_t kTemperatureCal2Celsius = TEMPSENSOR_CAL2_TEMP;
@@ -18,10 +18,27 @@
 
 #include <types.h>
 
+// An edge on a wakeup pin, captured by its interrupt handler.
+struct PinEvent {
+  uint32_t pin;
+  bool rising;
+  // The value of millis() when the edge arrived.
+  uint32_t millis;
+};
+
 class PowerController {
  public:
   virtual bool Begin() = 0;
   virtual void AttachInterruptWakeup(uint32_t pin, uint32_t mode) = 0;
+  // Masks or unmasks a wakeup attached with AttachInterruptWakeup, without
+  // detaching it.
+  virtual void SetInterruptWakeupEnabled(uint32_t pin, bool enabled) = 0;
+  // Removes the oldest edge captured on a wakeup pin. Returns false if there
+  // are none. Edges aren't captured while the wakeup is masked.
+  virtual bool PopPinEvent(PinEvent *event) = 0;
   virtual void Sleep(uint32_t millis) = 0;
+  // Stops the CPU for up to `millis`, while peripherals keep running. Any
+  // interrupt wakes it.
+  virtual void Idle(uint32_t millis) = 0;
   virtual void Stop() = 0;
 };
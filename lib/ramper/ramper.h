@@ -16,43 +16,199 @@
 
 #include <types.h>
 
-#include <cmath>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <type_traits>
 
-// Rate-limits changes to the held value (actual).
-// TODO: template the type of actual and extract this into a library
+// Rate-limits changes to the held value (actual). The held value moves towards
+// the target in proportion to the time since the ramp started, so it keeps to
+// the configured rate however irregularly Step is called.
+template <typename T>
 class Ramper {
+  static_assert(std::is_integral<T>::value && sizeof(T) <= sizeof(int16_t),
+                "Ramper holds integers of up to 16 bits");
+
  public:
-  void SetTarget(int16_t target) { target_ = target; }
-  int16_t GetTarget() const { return target_; }
-  void SetActual(int16_t actual) { actual_ = actual; }
-  int16_t GetActual() const { return actual_; }
+  // Returned by GetMillisUntilChange when the held value is at the target.
+  static constexpr uint32_t kNoChange = UINT32_MAX;
 
-  // Allow this much increase over this period. `value` is the magnitude of
-  // change. Change will be quantized to happen every `period_ms`.
-  void SetMaxIncrease(int16_t value, uint32_t increase_period_ms) {
-    max_increase_ = std::abs(value);
-    period_increase_ms_ = increase_period_ms;
+  void SetTarget(T target) {
+    if (target == target_) {
+      return;
+    }
+    Step();
+    target_ = target;
+    Restart();
+  }
+  T GetTarget() const { return target_; }
+  void SetActual(T actual) {
+    actual_ = actual;
+    Restart();
   }
+  T GetActual() const { return actual_; }
 
-  // Allow this much decrease over this period. `value` is the magnitude of
-  // change. Change will be quantized to happen every `period_ms`.
-  void SetMaxDecrease(int16_t value, uint32_t decrease_period_ms) {
-    max_decrease_ = std::abs(value);
-    period_decrease_ms_ = decrease_period_ms;
+  // Allow this much increase over this period. A value or period of zero
+  // removes the limit. Values beyond the range of T are clamped to it.
+  void SetMaxIncrease(uint32_t value, uint32_t period_ms) {
+    Step();
+    increase_rate_ = Rate(value, period_ms);
+    Restart();
+  }
+
+  // Allow this much decrease over this period. A value or period of zero
+  // removes the limit. Values beyond the range of T are clamped to it.
+  void SetMaxDecrease(uint32_t value, uint32_t period_ms) {
+    Step();
+    decrease_rate_ = Rate(value, period_ms);
+    Restart();
   }
 
   void Step();
 
+  // Returns how long until Step would next change the held value, or
+  // kNoChange if it is already at the target.
+  uint32_t GetMillisUntilChange() const;
+
+  // Computes the values that Step would move through on the way to the target,
+  // so that the ramp can be played back by hardware. Each value takes effect
+  // `*step_ms` after the previous one. If the ramp has more than `max_length`
+  // steps, the steps are made proportionally larger and longer. Returns the
+  // number of values, or 0 if the target would be reached immediately.
+  size_t BuildProfile(T *profile, size_t max_length, uint32_t *step_ms) const;
+
  private:
-  // Config
-  int16_t max_increase_ = 0;
-  uint32_t period_increase_ms_ = 0;
+  // Rates are in units per millisecond, with this many fractional bits. This
+  // keeps the error in a ramp's duration under 1ms for ramps of up to an hour.
+  static constexpr int kRateFractionalBits = 24;
+  // Ramps which would take longer than this (about 2.3 hours) finish at this
+  // point instead, so that the distance calculation can't overflow.
+  static constexpr uint32_t kMaxRampMs = 1 << 23;
+
+  // The largest difference between two values of T. Clamping rates to this
+  // per millisecond keeps kMaxRampMs * rate within 64 bits.
+  static constexpr uint32_t kMaxValue =
+      static_cast<uint32_t>(std::numeric_limits<T>::max()) -
+      static_cast<uint32_t>(std::numeric_limits<T>::min());
+
+  // Rounds up, so that a ramp never takes longer than requested.
+  static uint64_t Rate(uint32_t value, uint32_t period_ms) {
+    if (value == 0 || period_ms == 0) {
+      return 0;
+    }
+    const uint64_t scaled = static_cast<uint64_t>(std::min(value, kMaxValue))
+                            << kRateFractionalBits;
+    return (scaled + period_ms - 1) / period_ms;
+  }
 
-  int16_t max_decrease_ = 0;
-  uint32_t period_decrease_ms_ = 0;
+  // Returns how far a ramp at `rate` moves in `elapsed_ms`.
+  static uint64_t Distance(uint32_t elapsed_ms, uint64_t rate) {
+    return (std::min(elapsed_ms, kMaxRampMs) * rate) >> kRateFractionalBits;
+  }
+
+  // Returns how long a ramp at `rate` takes to move `distance`.
+  static uint32_t Duration(uint32_t distance, uint64_t rate) {
+    const uint64_t scaled = static_cast<uint64_t>(distance)
+                            << kRateFractionalBits;
+    const uint64_t duration_ms = (scaled + rate - 1) / rate;
+    return std::min<uint64_t>(duration_ms, kMaxRampMs);
+  }
+
+  uint64_t RateTowards(int32_t difference) const {
+    return difference > 0 ? increase_rate_ : decrease_rate_;
+  }
+
+  // Starts a new ramp from the held value.
+  void Restart() {
+    start_ = actual_;
+    start_ms_ = millis();
+  }
+
+  // Config
+  uint64_t increase_rate_ = 0;
+  uint64_t decrease_rate_ = 0;
 
   // Internal state
-  int16_t target_ = 0;
-  int16_t actual_ = 0;
-  uint32_t last_update_ms_ = 0;
+  T target_ = 0;
+  T actual_ = 0;
+  T start_ = 0;
+  uint32_t start_ms_ = 0;
 };
+
+template <typename T>
+void Ramper<T>::Step() {
+  if (target_ == actual_) {
+    return;
+  }
+
+  const int32_t difference = static_cast<int32_t>(target_) - start_;
+  const uint64_t rate = RateTowards(difference);
+  const uint32_t elapsed_ms = millis() - start_ms_;
+  // If there's no limit in this direction, snap immediately. This also handles
+  // the default uninitialized state.
+  if (rate == 0 || elapsed_ms >= kMaxRampMs) {
+    actual_ = target_;
+    return;
+  }
+
+  const uint32_t magnitude = std::abs(difference);
+  const uint64_t moved = Distance(elapsed_ms, rate);
+  if (moved >= magnitude) {
+    actual_ = target_;
+  } else if (difference > 0) {
+    actual_ = start_ + static_cast<int32_t>(moved);
+  } else {
+    actual_ = start_ - static_cast<int32_t>(moved);
+  }
+}
+
+template <typename T>
+uint32_t Ramper<T>::GetMillisUntilChange() const {
+  if (target_ == actual_) {
+    return kNoChange;
+  }
+  const uint64_t rate = RateTowards(static_cast<int32_t>(target_) - start_);
+  if (rate == 0) {
+    return 0;
+  }
+
+  // The held value next changes once the ramp has moved one more unit.
+  const uint32_t moved = std::abs(static_cast<int32_t>(actual_) - start_);
+  const uint32_t due_ms = Duration(moved + 1, rate);
+  const uint32_t elapsed_ms = millis() - start_ms_;
+  return due_ms > elapsed_ms ? due_ms - elapsed_ms : 0;
+}
+
+template <typename T>
+size_t Ramper<T>::BuildProfile(T *const profile, const size_t max_length,
+                               uint32_t *const step_ms) const {
+  const int32_t difference = static_cast<int32_t>(target_) - actual_;
+  if (difference == 0 || max_length == 0) {
+    return 0;
+  }
+  const uint64_t rate = RateTowards(difference);
+  if (rate == 0) {
+    return 0;
+  }
+
+  // Aim for one step per unit of change, but no more often than every 1ms.
+  const uint32_t magnitude = std::abs(difference);
+  const uint32_t duration_ms = Duration(magnitude, rate);
+  const uint32_t max_steps =
+      std::min<size_t>({magnitude, duration_ms, max_length});
+  const uint32_t period_ms = (duration_ms + max_steps - 1) / max_steps;
+  const size_t length = (duration_ms + period_ms - 1) / period_ms;
+
+  for (size_t i = 0; i < length; i++) {
+    const uint32_t moved = std::min<uint64_t>(
+        Distance((i + 1) * period_ms, rate), magnitude);
+    profile[i] = difference > 0 ? actual_ + static_cast<int32_t>(moved)
+                                : actual_ - static_cast<int32_t>(moved);
+  }
+  // The last step lands on the target, even if the ramp was cut short.
+  profile[length - 1] = target_;
+  *step_ms = period_ms;
+  return length;
+}
@@ -0,0 +1,93 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+Scheduler::TaskId Scheduler::AddTask(const char *const name, void (*run)(),
+                                     const uint32_t period_ms,
+                                     const uint8_t priority) {
+  const TaskId id = task_count_;
+  if (id >= kMaxTasks) {
+    return kNoTask;
+  }
+  // New tasks are notified, so that they're due straight away.
+  tasks_[id] = Task{name, run, period_ms, priority, /*last_run_ms=*/0,
+                    /*wait_ms=*/period_ms, /*notified=*/true, /*stats=*/{}};
+
+  // Insert the task after those with the same priority, so that ties run in
+  // the order they were added.
+  size_t position = task_count_;
+  while (position > 0 && tasks_[order_[position - 1]].priority < priority) {
+    order_[position] = order_[position - 1];
+    position--;
+  }
+  order_[position] = id;
+  task_count_++;
+  return id;
+}
+
+void Scheduler::Notify(const TaskId id) {
+  if (id < task_count_) {
+    tasks_[id].notified = true;
+  }
+}
+
+void Scheduler::RunAfter(const TaskId id, const uint32_t ms) {
+  if (id >= task_count_) {
+    return;
+  }
+  Task &task = tasks_[id];
+  if (ms == 0) {
+    task.notified = true;
+    return;
+  }
+  task.last_run_ms = millis();
+  task.wait_ms = ms;
+}
+
+size_t Scheduler::Run() {
+  size_t tasks_run = 0;
+  for (size_t i = 0; i < task_count_; i++) {
+    Task &task = tasks_[order_[i]];
+    const uint32_t now = millis();
+    if (MillisUntilDue(task, now) != 0) {
+      continue;
+    }
+    task.notified = false;
+    task.last_run_ms = now;
+    task.wait_ms = task.period_ms;
+    const uint32_t start_us = micros();
+    task.run();
+    const uint32_t duration_us = micros() - start_us;
+    task.stats.runs++;
+    task.stats.max_duration_us =
+        std::max(task.stats.max_duration_us, duration_us);
+    tasks_run++;
+  }
+  return tasks_run;
+}
+
+uint32_t Scheduler::GetMillisUntilDue() const {
+  const uint32_t now = millis();
+  uint32_t until_due = kNoTaskDue;
+  for (size_t i = 0; i < task_count_; i++) {
+    until_due = std::min(until_due, MillisUntilDue(tasks_[i], now));
+  }
+  return until_due;
+}
+
+void Scheduler::ResetStats() {
+  for (size_t i = 0; i < task_count_; i++) {
+    tasks_[i].stats = {};
+  }
+}
+
+uint32_t Scheduler::MillisUntilDue(const Task &task, const uint32_t now) {
+  if (task.notified) {
+    return 0;
+  }
+  if (task.wait_ms == 0) {
+    return kNoTaskDue;
+  }
+  const uint32_t elapsed = now - task.last_run_ms;
+  return elapsed >= task.wait_ms ? 0 : task.wait_ms - elapsed;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <types.h>
+
+#include <array>
+#include <cstddef>
+
+// Runs tasks cooperatively, each at its own period, or as soon as it's notified
+// of an event. Tasks are added up front, into a fixed-size table, and can't be
+// removed.
+//
+// Each task's run count and longest run are recorded, to find out which work
+// keeps the CPU awake.
+class Scheduler {
+ public:
+  static constexpr size_t kMaxTasks = 8;
+
+  using TaskId = size_t;
+  // Returned by AddTask if the table is full.
+  static constexpr TaskId kNoTask = kMaxTasks;
+
+  struct TaskStats {
+    uint32_t runs;
+    uint32_t max_duration_us;
+  };
+
+  // Adds a task, which runs every `period_ms`, and when it's notified. A period
+  // of 0 means that it only runs when notified. When several tasks are due, the
+  // higher priority ones run first. New tasks are due straight away.
+  TaskId AddTask(const char *name, void (*run)(), uint32_t period_ms,
+                 uint8_t priority);
+
+  // Runs the task in the next Run, even if it isn't due.
+  void Notify(TaskId id);
+
+  // Runs the task `ms` from now, instead of after its period. A task can call
+  // this while it runs, to say when it next has work to do. Its period applies
+  // again after that.
+  void RunAfter(TaskId id, uint32_t ms);
+
+  // Runs each task which is due, in priority order. Returns how many ran.
+  size_t Run();
+
+  // Returns how long until a task is due, or 0 if one is due now. Returns
+  // kNoTaskDue if no task has a period, and none has been notified.
+  uint32_t GetMillisUntilDue() const;
+  static constexpr uint32_t kNoTaskDue = UINT32_MAX;
+
+  size_t GetTaskCount() const { return task_count_; }
+  const char *GetName(TaskId id) const { return tasks_[id].name; }
+  const TaskStats &GetStats(TaskId id) const { return tasks_[id].stats; }
+  void ResetStats();
+
+ private:
+  struct Task {
+    const char *name;
+    void (*run)();
+    uint32_t period_ms;
+    uint8_t priority;
+    uint32_t last_run_ms;
+    // How long after last_run_ms the task is due. This is the period, unless
+    // RunAfter changed it.
+    uint32_t wait_ms;
+    bool notified;
+    TaskStats stats;
+  };
+
+  // Returns how long until the task is due.
+  static uint32_t MillisUntilDue(const Task &task, uint32_t now);
+
+  std::array<Task, kMaxTasks> tasks_ = {};
+  size_t task_count_ = 0;
+  // Task IDs, highest priority first.
+  std::array<TaskId, kMaxTasks> order_ = {};
+};
@@ -1,50 +1,395 @@
 #include "serial-manager.h"
 
+#include <algorithm>
+#include <cstring>
+
 #include "config-storage.h"
 #include "serial.pb.h"
 
+// Rates supported by both the CH340X and the STM32 USART. The USART is clocked
+// at 32MHz with 16x oversampling, so 921600 baud comes out about 0.8% slow,
+// which is well within the receivers' tolerance, and the others are exact.
+// 1Mbaud is the ceiling because the Arduino core receives one byte per
+// interrupt, which leaves about 320 cycles per byte at that rate; faster rates
+// would drop bytes whenever another interrupt or a critical section got in the
+// way.
+static constexpr uint32_t kSupportedBaudRates[] = {
+    SerialPort::kDefaultBaudRate, 230400, 460800, 921600, 1000000,
+};
+
 bool SerialManager::Init() { return controller_->Init(); }
 
-void SerialManager::Step() {
-  static constexpr size_t kFirmwareVersionMaxLength =
-      sizeof(StatusPb::firmware_version) / sizeof(char);
+bool SerialManager::IsSupportedBaudRate(uint32_t baud_rate) {
+  for (const uint32_t supported : kSupportedBaudRates) {
+    if (baud_rate == supported) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void SerialManager::SetBaudRate(uint32_t baud_rate) {
+  serial_port_->End();
+  serial_port_->Begin(baud_rate);
+}
+
+LinkStatsPb SerialManager::GetLinkStats() const {
+  LinkStatsPb stats = link_stats_;
+  if (latency_samples_ > 0) {
+    stats.mean_latency_micros = total_latency_micros_ / latency_samples_;
+  }
+  return stats;
+}
+
+void SerialManager::ReadAvailable() {
+  while (rx_buffer_length_ < rx_buffer_.size() && serial_port_->available()) {
+    const int c = serial_port_->read();
+    if (c < 0) {
+      break;
+    }
+    if (rx_buffer_length_ == 0) {
+      partial_frame_timer_.Reset();
+      frame_start_micros_ = micros();
+    }
+    rx_buffer_[rx_buffer_length_++] = c;
+    link_stats_.bytes_received++;
+  }
+}
+
+void SerialManager::DropReceiveBuffer() {
+  if (rx_buffer_length_ > 0) {
+    link_stats_.decode_failures++;
+  }
+  rx_buffer_length_ = 0;
+}
+
+size_t SerialManager::CompleteFrameLength() {
+  // Decode the varint length prefix
+  uint32_t message_length = 0;
+  size_t prefix_length = 0;
+  while (true) {
+    if (prefix_length >= rx_buffer_length_) {
+      return 0;
+    }
+    const uint8_t b = rx_buffer_[prefix_length];
+    message_length |= static_cast<uint32_t>(b & 0x7F) << (7 * prefix_length);
+    prefix_length++;
+    if ((b & 0x80) == 0) {
+      break;
+    }
+    if (prefix_length >= 5) {
+      // Not a valid prefix - drop everything and resynchronize.
+      DropReceiveBuffer();
+      return 0;
+    }
+  }
 
-  if (serial_port_->available()) {
-    pb_istream_s istream = serial_port_->BuildPbIstream();
-    pb_ostream_s ostream = serial_port_->BuildPbOstream();
+  if (prefix_length + message_length > rx_buffer_.size()) {
+    // Too long to ever fit - drop everything and resynchronize.
+    DropReceiveBuffer();
+    return 0;
+  }
+  if (prefix_length + message_length > rx_buffer_length_) {
+    return 0;
+  }
+  return prefix_length + message_length;
+}
 
-    SerialRequest request;
-    bool success = pb_decode_ex(&istream, &SerialRequest_msg, &request,
-                                PB_ENCODE_DELIMITED);
+void SerialManager::ConsumeFrame(size_t length) {
+  std::memmove(rx_buffer_.data(), rx_buffer_.data() + length,
+               rx_buffer_length_ - length);
+  rx_buffer_length_ -= length;
+  if (rx_buffer_length_ > 0) {
+    partial_frame_timer_.Reset();
+  }
+}
 
-    if (success && request.has_config) {
+bool SerialManager::IsStatusOnly(const SerialRequest &request) {
+  return !request.has_config && !request.request_config &&
+         !request.has_baud_rate && !request.request_link_stats &&
+         !request.reset_link_stats && !request.commit_config &&
+         !request.revert_config && !request.request_usage_stats &&
+         !request.reset_usage_stats && !request.has_flight_record_position &&
+         !request.has_calibration && !request.request_calibration &&
+         !request.calibrate_proximity_crosstalk;
+}
+
+void SerialManager::HandleConfig(const SerialRequest &request) {
+  if (request.has_config) {
+    if (request.preview_config && !previewing_config_) {
+      committed_config_ = *controller_->GetConfig();
+      previewing_config_ = true;
+    }
+
+    if (request.has_config_field_mask) {
+      controller_->UpdateConfig(request.config, request.config_field_mask);
+    } else {
       controller_->SetConfig(request.config);
-      ConfigStorage::SaveConfig(&request.config);
     }
 
-    SerialResponse response;
-    response.status.battery_voltage_millivolts =
+    if (request.preview_config) {
+      config_preview_timer_.Reset();
+    } else {
+      previewing_config_ = false;
+      config_preview_timer_.Stop();
+      ConfigStorage::SaveConfigDeferred(controller_->GetConfig());
+    }
+  }
+
+  if (!previewing_config_) {
+    return;
+  }
+  if (request.commit_config) {
+    previewing_config_ = false;
+    config_preview_timer_.Stop();
+    ConfigStorage::SaveConfigDeferred(controller_->GetConfig());
+  } else if (request.revert_config) {
+    previewing_config_ = false;
+    config_preview_timer_.Stop();
+    controller_->SetConfig(committed_config_);
+  }
+}
+
+void SerialManager::BuildFlightRecord(uint32_t position,
+                                      FlightRecorder::Chunk *chunk,
+                                      FlightRecordPb *record) {
+  const FlightRecorder &recorder = controller_->GetFlightRecorder();
+  record->start_position = recorder.StartPosition();
+  record->end_position = recorder.EndPosition();
+  record->start_millis = recorder.StartMillis();
+  record->start_values_count = FlightRecorder::kEventCount;
+  for (size_t i = 0; i < FlightRecorder::kEventCount; i++) {
+    record->start_values[i] =
+        recorder.StartValue(static_cast<FlightRecorder::Event>(i));
+  }
+
+  // Positions wrap around, so compare distances from the start.
+  if (position - recorder.StartPosition() >
+      recorder.EndPosition() - recorder.StartPosition()) {
+    position = recorder.StartPosition();
+  }
+  record->data_position = position;
+
+  chunk->recorder = &recorder;
+  chunk->position = position;
+  chunk->length = std::min<uint32_t>(FlightRecorder::kChunkSize,
+                                     recorder.EndPosition() - position);
+  record->data.funcs.encode = &FlightRecorder::EncodeChunk;
+  record->data.arg = chunk;
+}
+
+void SerialManager::BuildStatus(StatusPb *status) {
+  static constexpr size_t kFirmwareVersionMaxLength =
+      sizeof(StatusPb::firmware_version) / sizeof(char);
+
+  if (!status_valid_) {
+    status_ = StatusPb_init_zero;
+    status_.battery_voltage_millivolts =
         controller_->GetFilteredBatteryMillivolts();
-    response.status.has_battery_voltage_millivolts = true;
-    snprintf(response.status.firmware_version, kFirmwareVersionMaxLength,
+    status_.has_battery_voltage_millivolts = true;
+    snprintf(status_.firmware_version, kFirmwareVersionMaxLength,
              FIRMWARE_VERSION);
-    response.status.has_firmware_version = true;
+    status_.has_firmware_version = true;
+
+    status_.proximity_value = controller_->ReadProximity();
+    status_.has_proximity_value = true;
+    status_.ambient_light_value = controller_->ReadAmbientLight();
+    status_.has_ambient_light_value = true;
+    status_.temperature_celsius = controller_->GetTemperature();
+    status_.has_temperature_celsius = true;
+    status_.battery_percent = controller_->GetBatteryPercent();
+    status_.has_battery_percent = true;
+    status_.runtime_minutes = controller_->GetRuntimeMinutes();
+    status_.has_runtime_minutes = true;
+    status_.battery_resistance_milliohms =
+        controller_->GetBatteryResistanceMilliohms();
+    status_.has_battery_resistance_milliohms = true;
+    status_.max_motion_latency_ms = controller_->GetMaxMotionLatencyMs();
+    status_.has_max_motion_latency_ms = true;
+    status_valid_ = true;
+  }
+  *status = status_;
+}
+
+void SerialManager::SendResponse(SerialResponse *response,
+                                 uint32_t request_start_micros) {
+  BuildStatus(&response->status);
+  response->has_status = true;
+
+  pb_ostream_s ostream = serial_port_->BuildPbOstream();
+  if (!pb_encode_ex(&ostream, &SerialResponse_msg, response,
+                    PB_ENCODE_DELIMITED)) {
+    link_stats_.encode_failures++;
+  }
+  link_stats_.bytes_sent += ostream.bytes_written;
+
+  const uint32_t latency_micros = micros() - request_start_micros;
+  link_stats_.max_latency_micros =
+      std::max(link_stats_.max_latency_micros, latency_micros);
+  total_latency_micros_ += latency_micros;
+  latency_samples_++;
+}
+
+void SerialManager::FlushStatusResponse() {
+  if (!status_response_pending_) {
+    return;
+  }
+  status_response_pending_ = false;
+
+  SerialResponse response = SerialResponse_init_zero;
+  response.request_id = pending_status_request_id_;
+  response.has_request_id = true;
+  SendResponse(&response, pending_status_start_micros_);
+}
+
+bool SerialManager::HandleRequest(const SerialRequest &request,
+                                  uint32_t request_start_micros) {
+  if (IsStatusOnly(request)) {
+    if (!status_response_pending_) {
+      pending_status_start_micros_ = request_start_micros;
+    }
+    status_response_pending_ = true;
+    pending_status_request_id_ = request.request_id;
+    return false;
+  }
+  FlushStatusResponse();
+
+  HandleConfig(request);
+
+  SerialResponse response = SerialResponse_init_zero;
+  response.request_id = request.request_id;
+  response.has_request_id = true;
+
+  if (request.request_config) {
+    response.config = *controller_->GetConfig();
+    response.has_config = true;
+  }
+
+  uint32_t next_baud_rate = serial_port_->GetBaudRate();
+  if (request.has_baud_rate) {
+    if (IsSupportedBaudRate(request.baud_rate)) {
+      next_baud_rate = request.baud_rate;
+    }
+    response.baud_rate = next_baud_rate;
+    response.has_baud_rate = true;
+  }
+
+  if (request.request_link_stats) {
+    response.link_stats = GetLinkStats();
+    response.has_link_stats = true;
+  }
+  if (request.reset_link_stats) {
+    link_stats_ = LinkStatsPb_init_zero;
+    total_latency_micros_ = 0;
+    latency_samples_ = 0;
+  }
+
+  if (request.request_usage_stats) {
+    response.usage_stats = controller_->GetUsageStats();
+    response.has_usage_stats = true;
+  }
+  if (request.reset_usage_stats) {
+    controller_->ResetUsageStats();
+  }
 
-    response.status.proximity_value = controller_->ReadProximity();
-    response.status.has_proximity_value = true;
-    response.status.ambient_light_value = controller_->ReadAmbientLight();
-    response.status.has_ambient_light_value = true;
-    response.status.temperature_celsius = controller_->ReadTemperature();
-    response.status.has_temperature_celsius = true;
+  if (request.has_calibration) {
+    controller_->SetCalibration(request.calibration);
+    ConfigStorage::SaveCalibration(&request.calibration);
+  }
+  if (request.calibrate_proximity_crosstalk) {
+    controller_->StartProximityCrosstalkCalibration();
+  }
+  if (request.request_calibration) {
+    response.calibration = controller_->GetCalibration();
+    response.has_calibration = true;
+  }
 
-    response.has_status = true;
+  // This must outlive SendResponse, which streams the chunk from the recorder.
+  FlightRecorder::Chunk flight_record_chunk;
+  if (request.has_flight_record_position) {
+    BuildFlightRecord(request.flight_record_position, &flight_record_chunk,
+                      &response.flight_record);
+    response.has_flight_record = true;
+  }
+
+  SendResponse(&response, request_start_micros);
+
+  // The response is sent at the old rate, so that the host knows what to
+  // switch to.
+  if (next_baud_rate == serial_port_->GetBaudRate()) {
+    return false;
+  }
+  SetBaudRate(next_baud_rate);
+  if (next_baud_rate != SerialPort::kDefaultBaudRate) {
+    baud_rate_confirm_timer_.Reset();
+  }
+  return true;
+}
 
-    if (success && request.request_config) {
-      response.config = *controller_->GetConfig();
-      response.has_config = true;
+void SerialManager::Step() {
+  if (baud_rate_confirm_timer_.Expired()) {
+    // The host never reached us at the new rate, so go back to the rate that it
+    // can always reach us at.
+    baud_rate_confirm_timer_.Stop();
+    SetBaudRate(SerialPort::kDefaultBaudRate);
+  }
+
+  if (previewing_config_ && config_preview_timer_.Expired()) {
+    previewing_config_ = false;
+    config_preview_timer_.Stop();
+    controller_->SetConfig(committed_config_);
+  }
+
+  status_valid_ = false;
+  const uint32_t start_ms = millis();
+  if (serial_port_->CheckRxBufferFull()) {
+    link_stats_.rx_buffer_full++;
+  }
+  ReadAvailable();
+  size_t frame_length;
+  while ((frame_length = CompleteFrameLength()) > 0) {
+    SerialRequest request = SerialRequest_init_zero;
+    pb_istream_s istream =
+        pb_istream_from_buffer(rx_buffer_.data(), frame_length);
+    const bool success = pb_decode_ex(&istream, &SerialRequest_msg, &request,
+                                      PB_DECODE_DELIMITED);
+    const uint32_t request_start_micros = frame_start_micros_;
+    ConsumeFrame(frame_length);
+    link_stats_.frames_received++;
+
+    if (success) {
+      // Any valid request confirms that the host is using the current rate.
+      baud_rate_confirm_timer_.Stop();
+      if (HandleRequest(request, request_start_micros)) {
+        // Anything else in the buffer was sent at the old rate.
+        rx_buffer_length_ = 0;
+        break;
+      }
+    } else {
+      link_stats_.decode_failures++;
+      // The host still expects an answer, so that it doesn't wait forever.
+      FlushStatusResponse();
+      status_response_pending_ = true;
+      pending_status_request_id_ = 0;
+      pending_status_start_micros_ = request_start_micros;
+    }
+
+    // The next frame only becomes the head now. The time spent handling this
+    // one isn't part of its latency.
+    frame_start_micros_ = micros();
+
+    if (millis() - start_ms >= kStepBudgetMs) {
+      break;
     }
+    ReadAvailable();
+  }
+  FlushStatusResponse();
 
-    // TODO: check return value
-    pb_encode_ex(&ostream, &SerialResponse_msg, &response, PB_DECODE_DELIMITED);
+  if (rx_buffer_length_ > 0 && partial_frame_timer_.Expired()) {
+    DropReceiveBuffer();
   }
+
+  // Saving the config blocks on slow EEPROM writes, so it's spread out over
+  // many Steps.
+  ConfigStorage::Step();
 }
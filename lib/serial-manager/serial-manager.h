@@ -1,8 +1,12 @@
 #pragma once
 
+#include <arduino-timer.h>
 #include <types.h>
 
+#include <array>
+
 #include "controller.h"
+#include "flight-recorder.h"
 #include "serial-port.h"
 #include "serial.pb.h"
 
@@ -14,10 +18,107 @@ class SerialManager {
   // Initializes this instance.
   bool Init();
 
-  // Runs one iteration.
+  // Runs one iteration. Handles every complete request that has been received,
+  // until kStepBudgetMs has elapsed.
   void Step();
 
+  // Returns the link statistics, as reported to the host.
+  LinkStatsPb GetLinkStats() const;
+
+  // Returns whether the serial link can run at this baud rate. Visible for
+  // testing.
+  static bool IsSupportedBaudRate(uint32_t baud_rate);
+
+  // After switching baud rates, the host must send a valid request within this
+  // long, or the link falls back to the default rate.
+  static constexpr uint32_t kBaudRateConfirmTimeoutMs = 2000;
+
+  // Stop handling requests after this long in one Step, so that the controller
+  // keeps running while the host sends a burst of requests.
+  static constexpr uint32_t kStepBudgetMs = 5;
+
+  // A previewed config is reverted if it isn't updated or committed within
+  // this long.
+  static constexpr uint32_t kConfigPreviewTimeoutMs = 60 * 1000;
+
+  // A partially received request is discarded if the rest of it doesn't arrive
+  // within this long. This resynchronizes the link after garbage is received.
+  static constexpr uint32_t kPartialFrameTimeoutMs = 100;
+
  private:
+  // A request is a varint length prefix (at most 5 bytes) followed by the
+  // encoded message.
+  static constexpr size_t kMaxFrameLength = SerialRequest_size + 5;
+
+  // Restarts the serial port at the given rate.
+  void SetBaudRate(uint32_t baud_rate);
+
+  // Moves available bytes from the serial port into the receive buffer.
+  void ReadAvailable();
+
+  // Returns the length of the complete frame at the start of the receive
+  // buffer, including the length prefix, or 0 if the frame is incomplete.
+  size_t CompleteFrameLength();
+
+  // Removes the first `length` bytes from the receive buffer.
+  void ConsumeFrame(size_t length);
+
+  // Discards the contents of the receive buffer.
+  void DropReceiveBuffer();
+
+  // Applies the config in the request, and saves it unless it's a preview.
+  void HandleConfig(const SerialRequest &request);
+
+  // Handles one decoded request, and sends its response. Returns whether the
+  // baud rate changed.
+  bool HandleRequest(const SerialRequest &request,
+                     uint32_t request_start_micros);
+
+  // Returns whether a request only asks for the status, so that its response
+  // can be merged with its neighbors.
+  static bool IsStatusOnly(const SerialRequest &request);
+
+  // Fills in the flight recorder chunk starting at `position`. `chunk` must
+  // outlive `record`.
+  void BuildFlightRecord(uint32_t position, FlightRecorder::Chunk *chunk,
+                         FlightRecordPb *record);
+
+  // Fills in the status, reading the sensors at most once per Step.
+  void BuildStatus(StatusPb *status);
+
+  // Sends a response to a request whose first byte arrived at
+  // `request_start_micros`.
+  void SendResponse(SerialResponse *response, uint32_t request_start_micros);
+
+  // Sends the deferred response to a run of status-only requests, if any.
+  void FlushStatusResponse();
+
   SerialPort *const serial_port_;
   Controller *const controller_;
+
+  CountDownTimer baud_rate_confirm_timer_{kBaudRateConfirmTimeoutMs};
+  CountDownTimer partial_frame_timer_{kPartialFrameTimeoutMs};
+
+  // While a config is being previewed, this is the saved config to revert to.
+  bool previewing_config_ = false;
+  ConfigPb committed_config_;
+  CountDownTimer config_preview_timer_{kConfigPreviewTimeoutMs};
+
+  std::array<uint8_t, kMaxFrameLength> rx_buffer_;
+  size_t rx_buffer_length_ = 0;
+  // When the first byte of the frame at the start of the buffer arrived.
+  uint32_t frame_start_micros_ = 0;
+
+  // Status-only requests are answered once, after the last in a run.
+  bool status_response_pending_ = false;
+  uint32_t pending_status_request_id_ = 0;
+  uint32_t pending_status_start_micros_ = 0;
+
+  LinkStatsPb link_stats_ = LinkStatsPb_init_zero;
+  uint64_t total_latency_micros_ = 0;
+  uint32_t latency_samples_ = 0;
+
+  // The status is read once per Step, and shared between its responses.
+  StatusPb status_;
+  bool status_valid_ = false;
 };
@@ -13,6 +13,23 @@
 // Class which wraps a serial port, i.e. `Serial` on Arduino.
 class SerialPort : public Stream {
  public:
+  // The rate used at boot, and the rate to fall back to if baud rate
+  // negotiation fails.
+  static constexpr uint32_t kDefaultBaudRate = 115200;
+
+  // Starts the port at the given baud rate.
+  virtual void Begin(uint32_t baud_rate) = 0;
+
+  // Stops the port, after waiting for any pending output to be sent.
+  virtual void End() = 0;
+
+  // Returns the baud rate passed to the most recent call to Begin.
+  virtual uint32_t GetBaudRate() = 0;
+
+  // Returns whether the receive buffer has filled up since the last call. Once
+  // it's full, further received data is dropped.
+  virtual bool CheckRxBufferFull() = 0;
+
   // From Stream
   virtual int available() override = 0;
   virtual int read() override = 0;
@@ -22,6 +39,5 @@ class SerialPort : public Stream {
   virtual size_t write(uint8_t c) override = 0;
 
   // nanopb-specific (not inherited)
-  virtual pb_istream_s BuildPbIstream() = 0;
   virtual pb_ostream_s BuildPbOstream() = 0;
 };
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <types.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Lock-free queue for exactly one producer and one consumer, such as an
+// interrupt handler and the main loop. Only loads and stores of the indices are
+// needed, which are atomic on a Cortex-M0+ without disabling interrupts.
+//
+// Several interrupt handlers can share the producer side only if they have the
+// same priority, so that none can preempt another in the middle of a Push.
+template <typename T, size_t Capacity>
+class SpscQueue {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+ public:
+  // Adds an item. If the queue is full, the item is dropped and counted, and
+  // this returns false. Only called by the producer.
+  bool Push(const T &item) {
+    const uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == Capacity) {
+      dropped_.store(dropped_.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+      return false;
+    }
+    items_[head % Capacity] = item;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Removes the oldest item. Returns false if the queue is empty. Only called
+  // by the consumer.
+  bool Pop(T *item) {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *item = items_[tail % Capacity];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool Empty() const {
+    return tail_.load(std::memory_order_relaxed) ==
+           head_.load(std::memory_order_acquire);
+  }
+
+  // How many items have been dropped because the queue was full.
+  uint32_t Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  std::array<T, Capacity> items_ = {};
+  // These count the items ever pushed and popped, and wrap around.
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+  std::atomic<uint32_t> dropped_{0};
+};
@@ -0,0 +1,243 @@
+#include "stm32-led-driver.h"
+
+#include <Arduino.h>
+
+#include <algorithm>
+
+#include "pins.h"
+
+namespace {
+
+// Cleared when a fade starts, and set by the DMA interrupt once the whole
+// profile has been transferred.
+volatile bool fade_complete = true;
+
+// TIM6's update event is request 9 on DMA1 channel 2 (RM0377, table 51).
+DMA_Channel_TypeDef *const kDmaChannel = DMA1_Channel2;
+constexpr uint32_t kDmaRequest = 9;
+
+// TIM2's channel 1 compare event is request 8 on DMA1 channel 5.
+DMA_Channel_TypeDef *const kDitherDmaChannel = DMA1_Channel5;
+constexpr uint32_t kDitherDmaRequest = 8;
+
+// The MT9284 doesn't respond to pulses shorter than about 3/255 of a 20kHz
+// period.
+constexpr uint32_t kMinOnNanoseconds = 600;
+
+}  // namespace
+
+extern "C" void DMA1_Channel2_3_IRQHandler() {
+  if (DMA1->ISR & DMA_ISR_TCIF2) {
+    DMA1->IFCR = DMA_IFCR_CGIF2;
+    TIM6->CR1 &= ~TIM_CR1_CEN;
+    fade_complete = true;
+  }
+}
+
+bool Stm32LedDriver::Begin() {
+  const PinName pin = digitalPinToPinName(kPinWhiteLed);
+  timer_ = static_cast<TIM_TypeDef *>(pinmap_peripheral(pin, PinMap_TIM));
+  if (timer_ == nullptr) {
+    return false;
+  }
+  const uint32_t channel = STM_PIN_CHANNEL(pinmap_function(pin, PinMap_TIM));
+  dither_available_ = timer_ == TIM2 && channel == 1;
+  switch (channel) {
+    case 1:
+      compare_register_ = &timer_->CCR1;
+      break;
+    case 2:
+      compare_register_ = &timer_->CCR2;
+      break;
+    case 3:
+      compare_register_ = &timer_->CCR3;
+      break;
+    case 4:
+      compare_register_ = &timer_->CCR4;
+      break;
+    default:
+      return false;
+  }
+
+  __HAL_RCC_TIM6_CLK_ENABLE();
+  __HAL_RCC_DMA1_CLK_ENABLE();
+  NVIC_SetPriority(DMA1_Channel2_3_IRQn, 3);
+  NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+  return true;
+}
+
+void Stm32LedDriver::SetPwm(const PwmSettings &settings) {
+  pwm_ = settings;
+  pwm_.frequency_hz =
+      std::clamp(pwm_.frequency_hz, kMinPwmFrequencyHz, kMaxPwmFrequencyHz);
+  // Writing zero here makes the LEDs flash, like in Controller::Init, so this
+  // waits until the LED is next turned on.
+  if (length_ == 0 && value_ != 0) {
+    Output(led_dimming::LevelToDutyCycle(value_));
+  }
+}
+
+led_dimming::SigmaDelta Stm32LedDriver::MakeModulator() const {
+  const uint32_t period_ticks = timer_->ARR + 1;
+  const uint32_t min_on_ticks = static_cast<uint64_t>(period_ticks) *
+                                pwm_.frequency_hz * kMinOnNanoseconds /
+                                1000000000;
+  return led_dimming::SigmaDelta(period_ticks,
+                                 std::max<uint32_t>(min_on_ticks, 1));
+}
+
+void Stm32LedDriver::Set(const uint16_t level) {
+  StopFade();
+  value_ = level;
+  Output(led_dimming::LevelToDutyCycle(level));
+}
+
+void Stm32LedDriver::Output(const uint16_t duty_cycle) {
+  StopDither();
+  // This makes sure that the pin is in PWM mode at the configured frequency,
+  // since sleeping resets it. The frequency setting is global, so the battery
+  // LEDs share it.
+  analogWriteFrequency(pwm_.frequency_hz);
+  analogWrite(kPinWhiteLed, 0);
+
+  led_dimming::SigmaDelta modulator = MakeModulator();
+  if (!dither_available_ || !pwm_.dither) {
+    // Without dithering, output the nearest compare value.
+    *compare_register_ = modulator.Next(duty_cycle);
+    return;
+  }
+  if (!modulator.FillPattern(duty_cycle, dither_pattern_.data(),
+                             dither_pattern_.size())) {
+    *compare_register_ = dither_pattern_[0];
+    return;
+  }
+
+  DMA1_CSELR->CSELR = (DMA1_CSELR->CSELR & ~DMA_CSELR_C5S) |
+                      (kDitherDmaRequest << DMA_CSELR_C5S_Pos);
+  kDitherDmaChannel->CPAR = reinterpret_cast<uint32_t>(compare_register_);
+  kDitherDmaChannel->CMAR = reinterpret_cast<uint32_t>(dither_pattern_.data());
+  kDitherDmaChannel->CNDTR = dither_pattern_.size();
+  // Memory-to-peripheral, 16 bits at a time, repeating forever.
+  kDitherDmaChannel->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_PSIZE_0 |
+                           DMA_CCR_MSIZE_0 | DMA_CCR_CIRC | DMA_CCR_EN;
+  timer_->DIER |= TIM_DIER_CC1DE;
+}
+
+void Stm32LedDriver::StopDither() {
+  if (!dither_available_) {
+    return;
+  }
+  timer_->DIER &= ~TIM_DIER_CC1DE;
+  kDitherDmaChannel->CCR &= ~DMA_CCR_EN;
+}
+
+void Stm32LedDriver::StartFade(const uint16_t *const profile,
+                               const size_t length, const uint32_t step_ms) {
+  if (length == 0 || length > kMaxFadeSteps || step_ms == 0 ||
+      step_ms > 0x10000) {
+    Set(length == 0 ? value_ : profile[length - 1]);
+    return;
+  }
+  StopFade();
+  // Hold the current level until the first step, without dithering, since
+  // that would fight with the fade for the compare register.
+  Output(led_dimming::LevelToDutyCycle(value_));
+  StopDither();
+
+  // Each step lasts many PWM periods, so carrying the rounding error from step
+  // to step smooths the low end of the fade.
+  led_dimming::SigmaDelta modulator = MakeModulator();
+  for (size_t i = 0; i < length; i++) {
+    profile_[i] = profile[i];
+    compare_values_[i] =
+        modulator.Next(led_dimming::LevelToDutyCycle(profile[i]));
+  }
+  length_ = length;
+  step_ms_ = step_ms;
+
+  // TIM6 counts milliseconds, and overflows once per step.
+  TIM6->CR1 = 0;
+  TIM6->PSC = SystemCoreClock / 1000 - 1;
+  TIM6->ARR = step_ms - 1;
+  TIM6->CNT = 0;
+  // Load the prescaler before enabling DMA requests, so that this doesn't
+  // trigger a transfer.
+  TIM6->EGR = TIM_EGR_UG;
+  TIM6->SR = 0;
+  TIM6->DIER = TIM_DIER_UDE;
+
+  DMA1_CSELR->CSELR =
+      (DMA1_CSELR->CSELR & ~DMA_CSELR_C2S) | (kDmaRequest << DMA_CSELR_C2S_Pos);
+  kDmaChannel->CPAR = reinterpret_cast<uint32_t>(compare_register_);
+  kDmaChannel->CMAR = reinterpret_cast<uint32_t>(compare_values_.data());
+  kDmaChannel->CNDTR = length;
+  // Memory-to-peripheral, 16 bits at a time, interrupt when complete.
+  kDmaChannel->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_PSIZE_0 |
+                     DMA_CCR_MSIZE_0 | DMA_CCR_TCIE | DMA_CCR_EN;
+
+  fade_complete = false;
+  TIM6->CR1 = TIM_CR1_CEN;
+}
+
+void Stm32LedDriver::Blank(const bool blank) {
+  if (blank) {
+    StopDither();
+    *compare_register_ = 0;
+  } else if (length_ == 0) {
+    // A fade ends the blank by itself.
+    Output(led_dimming::LevelToDutyCycle(value_));
+  }
+}
+
+uint16_t Stm32LedDriver::Get() {
+  Settle();
+  return CurrentLevel();
+}
+
+uint16_t Stm32LedDriver::CurrentLevel() const {
+  if (length_ == 0) {
+    return value_;
+  }
+  const size_t transferred = Transferred();
+  if (transferred == 0) {
+    return value_;
+  }
+  return profile_[transferred - 1];
+}
+
+bool Stm32LedDriver::Fading() {
+  Settle();
+  return !fade_complete;
+}
+
+uint32_t Stm32LedDriver::FadeRemainingMs() {
+  Settle();
+  if (fade_complete) {
+    return 0;
+  }
+  return (length_ - Transferred()) * step_ms_;
+}
+
+void Stm32LedDriver::Settle() {
+  if (length_ != 0 && fade_complete) {
+    // The fade's last value was rounded to a whole compare value, so replace
+    // it with the dithered level.
+    Set(profile_[length_ - 1]);
+  }
+}
+
+size_t Stm32LedDriver::Transferred() const {
+  return length_ - kDmaChannel->CNDTR;
+}
+
+void Stm32LedDriver::StopFade() {
+  if (length_ == 0) {
+    return;
+  }
+  TIM6->CR1 &= ~TIM_CR1_CEN;
+  value_ = CurrentLevel();
+  kDmaChannel->CCR &= ~DMA_CCR_EN;
+  DMA1->IFCR = DMA_IFCR_CGIF2;
+  length_ = 0;
+  fade_complete = true;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <types.h>
+
+#include <array>
+
+#include "led-dimming.h"
+#include "led-driver.h"
+
+// Drives the white LED using the PWM timer that analogWrite sets up, writing
+// the compare register directly so that the timer's full resolution is used.
+//
+// Fades are streamed into the compare register by DMA, triggered by TIM6 at the
+// fade step rate. The DMA transfer-complete interrupt wakes the CPU once the
+// fade has finished.
+//
+// Steady levels which fall between two compare values, or below the shortest
+// pulse the LED driver responds to, are dithered: a second DMA channel plays a
+// sigma-delta pattern of compare values into the compare register, one per PWM
+// period.
+class Stm32LedDriver : public LedDriver {
+ public:
+  bool Begin() override;
+  void SetPwm(const PwmSettings &settings) override;
+  void Set(uint16_t level) override;
+  void StartFade(const uint16_t *profile, size_t length,
+                 uint32_t step_ms) override;
+  void Blank(bool blank) override;
+  uint16_t Get() override;
+  bool Fading() override;
+  uint32_t FadeRemainingMs() override;
+
+  // The number of PWM periods in the dither pattern. At 20kHz or faster, this
+  // repeats every 3.2ms at most, which is far too fast to see.
+  static constexpr size_t kDitherLength = 64;
+
+ private:
+  // Stops the DMA, and records the value it had reached.
+  void StopFade();
+
+  // Applies the last level of a fade which has finished.
+  void Settle();
+
+  // Outputs a linear duty cycle, dithering it if necessary.
+  void Output(uint16_t duty_cycle);
+
+  void StopDither();
+
+  // Returns a sigma-delta modulator for the timer's current period.
+  led_dimming::SigmaDelta MakeModulator() const;
+
+  // Returns the level being output, without settling a finished fade.
+  uint16_t CurrentLevel() const;
+
+  // Returns how many entries of the profile have been transferred.
+  size_t Transferred() const;
+
+  // The timer and its compare register for the LED pin.
+  TIM_TypeDef *timer_ = nullptr;
+  volatile uint32_t *compare_register_ = nullptr;
+  // Dithering needs a DMA request on the compare event, which is only wired
+  // up for TIM2 channel 1.
+  bool dither_available_ = false;
+  PwmSettings pwm_ = {kMinPwmFrequencyHz, true};
+
+  uint16_t value_ = 0;
+  // The profile, and its values converted to timer ticks for the DMA.
+  std::array<uint16_t, kMaxFadeSteps> profile_ = {};
+  std::array<uint16_t, kMaxFadeSteps> compare_values_ = {};
+  size_t length_ = 0;
+  uint32_t step_ms_ = 0;
+
+  std::array<uint16_t, kDitherLength> dither_pattern_ = {};
+};
@@ -4,7 +4,10 @@
 #include <Wire.h>
 #include <types.h>
 
+#include <array>
+
 #include "pins.h"
+#include "spsc-queue.h"
 
 static uint32_t rtc_seconds_at_sleep = 0;
 static uint32_t rtc_subseconds_at_sleep = 0;
@@ -13,7 +16,52 @@ extern __IO uint32_t uwTick;
 
 namespace {
 
-// Called when the processor wakes up from sleep.
+// Wakeup pins whose edges are captured.
+constexpr size_t kMaxCapturedPins = 4;
+std::array<uint32_t, kMaxCapturedPins> captured_pins;
+std::array<uint32_t, kMaxCapturedPins> captured_modes;
+size_t captured_pin_count = 0;
+
+struct CapturedEvent {
+  PinEvent event;
+  // millis() doesn't advance while asleep, so these are stamped on waking.
+  bool while_asleep;
+};
+// The captured pins' callbacks all push to this, from the EXTI0_1, EXTI2_3 and
+// EXTI4_15 interrupts. That's only safe as a single producer while none of
+// those interrupts can preempt another, so AttachInterruptWakeup gives them all
+// the same priority.
+SpscQueue<CapturedEvent, 16> pin_events;
+volatile bool asleep = false;
+
+// Returns the EXTI interrupt which serves a pin.
+IRQn_Type ExtiIrq(const uint32_t pin) {
+  const uint32_t line = STM_PIN(digitalPinToPinName(pin));
+  if (line <= 1) {
+    return EXTI0_1_IRQn;
+  }
+  return line <= 3 ? EXTI2_3_IRQn : EXTI4_15_IRQn;
+}
+
+void CaptureEdge(const size_t index) {
+  const uint32_t pin = captured_pins[index];
+  const uint32_t mode = captured_modes[index];
+  const bool rising =
+      mode == RISING || (mode == CHANGE && digitalRead(pin) == HIGH);
+  pin_events.Push(CapturedEvent{PinEvent{pin, rising, millis()}, asleep});
+}
+
+// The interrupt callbacks don't get the pin, so there's one for each.
+template <size_t Index>
+void CaptureCallback() {
+  CaptureEdge(Index);
+}
+constexpr std::array<void (*)(), kMaxCapturedPins> kCaptureCallbacks = {
+    &CaptureCallback<0>, &CaptureCallback<1>, &CaptureCallback<2>,
+    &CaptureCallback<3>};
+
+// Called when the processor wakes up from sleep, for pins beyond
+// kMaxCapturedPins.
 void WakeUpCallback() {}
 
 };  // namespace
@@ -25,8 +73,57 @@ bool Stm32PowerController::Begin() {
 };
 
 void Stm32PowerController::AttachInterruptWakeup(uint32_t pin, uint32_t mode) {
-  impl_.attachInterruptWakeup(pin, &WakeUpCallback, mode,
-                              LP_Mode::SHUTDOWN_MODE);
+  void (*callback)() = &WakeUpCallback;
+  if (captured_pin_count < kMaxCapturedPins) {
+    captured_pins[captured_pin_count] = pin;
+    captured_modes[captured_pin_count] = mode;
+    callback = kCaptureCallbacks[captured_pin_count];
+    captured_pin_count++;
+  }
+  impl_.attachInterruptWakeup(pin, callback, mode, LP_Mode::SHUTDOWN_MODE);
+  if (callback != &WakeUpCallback) {
+    NVIC_SetPriority(ExtiIrq(pin),
+                     NVIC_GetPriority(ExtiIrq(captured_pins[0])));
+  }
+}
+
+bool Stm32PowerController::PopPinEvent(PinEvent *const event) {
+  CapturedEvent captured;
+  if (!pin_events.Pop(&captured)) {
+    return false;
+  }
+  *event = captured.event;
+  if (captured.while_asleep) {
+    event->millis = wake_millis_;
+  }
+  return true;
+}
+
+void Stm32PowerController::StartSleep() {
+  SaveTime();
+  asleep = true;
+}
+
+void Stm32PowerController::EndSleep() {
+  RestoreTime();
+  wake_millis_ = millis();
+  asleep = false;
+}
+
+void Stm32PowerController::SetInterruptWakeupEnabled(uint32_t pin,
+                                                    bool enabled) {
+  // Detaching and attaching again would change the order in which the wakeups
+  // were attached, which matters (see Controller::Init). So this masks the
+  // EXTI line instead.
+  const uint32_t line = 1u << STM_PIN(digitalPinToPinName(pin));
+  if (enabled) {
+    // Drop any edge which arrived while masked, so that it doesn't wake the
+    // device straight away.
+    EXTI->PR = line;
+    EXTI->IMR |= line;
+  } else {
+    EXTI->IMR &= ~line;
+  }
 }
 
 void Stm32PowerController::Sleep(uint32_t ms) {
@@ -40,26 +137,18 @@ void Stm32PowerController::Sleep(uint32_t ms) {
   pinMode(kPinWhiteLed, INPUT_ANALOG);
   pinMode(kPinChargeHighCurrentEnable, INPUT_ANALOG);
 
-  Serial1.end();
+  serial_port_->End();
 
   // When in stop mode, the SysTick interrupt doesn't fire to update Arduino's
   // `millis()` value. So, keep track of the elapsed time using the RTC, and
   // update the value manually on wakeup.
-  STM32RTC &rtc = STM32RTC::getInstance();
-  rtc_seconds_at_sleep = rtc.getEpoch(&rtc_subseconds_at_sleep);
+  StartSleep();
 
   // Puts the processor into STM32 Stop mode. Power consumption is ~15.5uA (as
   // of 2025-02-14, with hardware v1.2)
   impl_.deepSleep(ms);
 
-  uint32_t seconds;
-  uint32_t subseconds;
-  seconds = rtc.getEpoch(&subseconds);
-
-  // This reaches into STM32's Arduino implementation and modifies the value
-  // underlying millis() directly. This is not great, but it works.
-  uwTick += (seconds - rtc_seconds_at_sleep) * 1000 +
-            (subseconds - rtc_subseconds_at_sleep);
+  EndSleep();
 
   pinMode(kPinBatteryLed1, OUTPUT);
   pinMode(kPinBatteryLed2, OUTPUT);
@@ -72,10 +161,41 @@ void Stm32PowerController::Sleep(uint32_t ms) {
   Wire.begin();
   Wire.setClock(400 * 1000);
 
-  Serial1.begin(115200);
+  serial_port_->Begin(serial_port_->GetBaudRate());
   Serial1.println("Wakeup");
 }
 
+void Stm32PowerController::Idle(uint32_t ms) {
+  if (ms < kMinRtcIdleMs) {
+    // SysTick keeps running, so this wakes within a millisecond, and millis()
+    // stays exact.
+    __WFI();
+    return;
+  }
+  // Sleep mode stops only the CPU, so PWM, DMA and the serial port keep
+  // running. SysTick is suspended, so that it doesn't wake the CPU every
+  // millisecond.
+  StartSleep();
+  impl_.sleep(ms);
+  EndSleep();
+}
+
+void Stm32PowerController::SaveTime() {
+  STM32RTC &rtc = STM32RTC::getInstance();
+  rtc_seconds_at_sleep = rtc.getEpoch(&rtc_subseconds_at_sleep);
+}
+
+void Stm32PowerController::RestoreTime() {
+  uint32_t seconds;
+  uint32_t subseconds;
+  seconds = STM32RTC::getInstance().getEpoch(&subseconds);
+
+  // This reaches into STM32's Arduino implementation and modifies the value
+  // underlying millis() directly. This is not great, but it works.
+  uwTick += (seconds - rtc_seconds_at_sleep) * 1000 +
+            (subseconds - rtc_subseconds_at_sleep);
+}
+
 void Stm32PowerController::Stop() {
   Wire.end();
   pinMode(kPinScl, INPUT_ANALOG);
@@ -94,7 +214,7 @@ void Stm32PowerController::Stop() {
   pinMode(kPinBatteryNPowerGood, INPUT_ANALOG);
   pinMode(kPinBatteryStat, INPUT_ANALOG);
 
-  Serial1.end();
+  serial_port_->End();
 
   // Power consumption is 14.6uA, as of 2025-02-14, with hardware v1.2.
   impl_.shutdown();
@@ -20,14 +20,41 @@
 #include <types.h>
 
 #include "power-controller.h"
+#include "serial-port.h"
 
 class Stm32PowerController : public PowerController {
  public:
+  // The serial port is shut down before sleeping, and restarted at its current
+  // baud rate on wakeup.
+  explicit Stm32PowerController(SerialPort *serial_port)
+      : serial_port_(serial_port) {}
+
   bool Begin() override;
   void AttachInterruptWakeup(uint32_t pin, uint32_t mode) override;
+  void SetInterruptWakeupEnabled(uint32_t pin, bool enabled) override;
+  bool PopPinEvent(PinEvent *event) override;
   void Sleep(uint32_t millis) override;
+  void Idle(uint32_t millis) override;
   void Stop() override;
 
  private:
+  // Shorter idles leave SysTick running. Restoring millis() from the RTC is
+  // only accurate to its subsecond step of about 4ms, which would make short,
+  // frequent idles jitter the clock that the debounce, ramps and scheduler
+  // rely on.
+  static constexpr uint32_t kMinRtcIdleMs = 100;
+
+  // SysTick is stopped while sleeping, so millis() doesn't advance. These use
+  // the RTC to add the time spent asleep.
+  void SaveTime();
+  void RestoreTime();
+
+  // SysTick is stopped while asleep, so edges which arrive then are stamped
+  // with the time of waking up.
+  void StartSleep();
+  void EndSleep();
+
+  SerialPort *const serial_port_;
+  uint32_t wake_millis_ = 0;
   STM32LowPower impl_;
 };
@@ -17,5 +17,7 @@
 #ifndef ARDUINO
 
 const uint16_t *const VREFINT_CAL_ADDR = &kFakeVrefintCal;
+const uint16_t *const TEMPSENSOR_CAL1_ADDR = &kFakeTemperatureCal1;
+const uint16_t *const TEMPSENSOR_CAL2_ADDR = &kFakeTemperatureCal2;
 
 #endif  // ifndef ARDUINO
\ No newline at end of file
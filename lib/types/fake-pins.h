@@ -81,6 +81,15 @@ static constexpr uint16_t kFakeVrefintCal = 1600;
 extern const uint16_t *const VREFINT_CAL_ADDR;
 static constexpr int AVREF = PC15 + 1;
 
-static constexpr uint32_t kPinMax = PC15 + 2;
+// Typical values for the STM32L051.
+static constexpr uint16_t kFakeTemperatureCal1 = 670;
+static constexpr uint16_t kFakeTemperatureCal2 = 890;
+extern const uint16_t *const TEMPSENSOR_CAL1_ADDR;
+extern const uint16_t *const TEMPSENSOR_CAL2_ADDR;
+static constexpr int32_t TEMPSENSOR_CAL1_TEMP = 30;
+static constexpr int32_t TEMPSENSOR_CAL2_TEMP = 130;
+static constexpr int ATEMP = PC15 + 2;
+
+static constexpr uint32_t kPinMax = PC15 + 3;
 
 #endif  // ifndef ARDUINO
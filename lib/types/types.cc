@@ -135,6 +135,8 @@ uint32_t millis() { return millis_; }
 
 void setMillis(uint32_t millis) { millis_ = millis; }
 
+uint32_t micros() { return millis_ * 1000; }
+
 void delay(uint32_t millis) { advanceMillis(millis); }
 
 void advanceMillis(uint32_t millis) { millis_ += millis; }
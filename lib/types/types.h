@@ -63,6 +63,8 @@ void setAnalogRead(uint32_t ulPin, uint32_t value);
 
 uint32_t millis();
 void setMillis(uint32_t millis);
+// Note: this only has millisecond resolution.
+uint32_t micros();
 void delay(uint32_t millis);
 
 void advanceMillis(uint32_t millis);
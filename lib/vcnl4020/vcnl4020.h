@@ -34,6 +34,15 @@ class VCNL4020 {
   // Enables or disables periodic proximity measurements.
   virtual void SetPeriodicProximity(bool enable) = 0;
 
+  // Starts a single ambient light measurement, pausing any periodic
+  // measurements until it has been read. AmbientReady returns true once it
+  // completes.
+  virtual void StartAmbientMeasurement() = 0;
+
+  // Abandons a measurement started by StartAmbientMeasurement without reading
+  // it, and resumes any periodic measurements.
+  virtual void CancelAmbientMeasurement() = 0;
+
   // Returns true when the ambient measurement is ready. Reset by calls to
   // ReadAmbient.
   virtual bool AmbientReady() = 0;
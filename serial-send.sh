@@ -1,7 +1,9 @@
 #!/bin/bash
 
 PORT="/dev/ttyUSB0"
-BAUD=115200
+# The device boots at 115200. Override if the link has been switched to a
+# faster rate using `SerialRequest.baud_rate`.
+BAUD=${BAUD:-115200}
 
 stty -F $PORT $BAUD raw -echo -hupcl
 
@@ -14,7 +14,6 @@
 
 #include <Arduino.h>
 #include <Wire.h>
-#include <arduino-timer.h>
 #include <edge-filter.h>
 
 #include "arduino-serial-port.h"
@@ -23,21 +22,39 @@
 #include "controller.h"
 #include "internal-temperature-sensor.h"
 #include "pins.h"
+#include "scheduler.h"
 #include "serial-manager.h"
+#include "stm32-led-driver.h"
 #include "stm32-power-controller.h"
 
 // These enable printing values for the VCNL4020 to the serial console.
 // #define DEBUG_VCNL4020_BRIGHTNESS
 // #define DEBUG_VCNL4020_PROXIMITY
 
-CountDownTimer vncl4020_timer{200};
+// This enables printing the scheduler's task statistics to the serial console.
+// #define DEBUG_SCHEDULER
+
+constexpr uint32_t kVcnl4020DebugPeriodMs = 200;
+constexpr uint32_t kSchedulerDebugPeriodMs = 10 * 1000;
+
+// The serial manager runs when data arrives, and this often for its timeouts.
+constexpr uint32_t kSerialPeriodMs = 100;
+// Shorter idle periods aren't worth setting up the wakeup for.
+constexpr uint32_t kMinIdleMs = 2;
+
+Scheduler scheduler;
+Scheduler::TaskId led_task = Scheduler::kNoTask;
+Scheduler::TaskId serial_task = Scheduler::kNoTask;
+
+ArduinoSerialPort serial_port;
 
 InternalTemperatureSensor temperature_sensor;
 ArduinoVCNL4020 vcnl4020;
-Stm32PowerController power_controller;
-Controller controller{&temperature_sensor, &vcnl4020, &power_controller};
+Stm32PowerController power_controller{&serial_port};
+Stm32LedDriver led_driver;
+Controller controller{&temperature_sensor, &vcnl4020, &power_controller,
+                      &led_driver};
 
-ArduinoSerialPort serial_port;
 SerialManager serial_manager{&serial_port, &controller};
 
 #ifdef DEBUG_VCNL4020_PROXIMITY
@@ -56,7 +73,7 @@ static void ErrorFlash(uint32_t period) {
 }
 
 void setup() {
-  Serial1.begin(115200);
+  serial_port.Begin(SerialPort::kDefaultBaudRate);
   // Serial1.println("Booting...");
 
   // I2C - used for light sensor
@@ -66,52 +83,100 @@ void setup() {
   Wire.setClock(400 * 1000);
 
   // From the datasheet for the MT9284BS6 LED driver, its recommended PWM
-  // frequency is 20kHz < n < 1MHz.
-  analogWriteFrequency(20 * 1000);
+  // frequency is 20kHz < n < 1MHz. The LED driver replaces this with the
+  // frequency from the config, which the battery LEDs then share.
+  analogWriteFrequency(LedDriver::kMinPwmFrequencyHz);
+  // This only applies to the battery LEDs: the white LED's driver writes the
+  // timer's compare register directly, at its full resolution.
   analogWriteResolution(8);
 
   if (!serial_manager.Init()) {
     ErrorFlash(100);
   }
 
+  // The controller's inputs are brought up to date before the LED step acts on
+  // them, since ties run in the order added. Stop mode restores millis() on
+  // waking, so the steps catch up on the time spent asleep.
+  scheduler.AddTask(
+      "battery", []() { controller.StepBattery(); },
+      Controller::kBatteryStepIntervalMs, /*priority=*/3);
+  scheduler.AddTask(
+      "mode", []() { controller.StepMode(); }, Controller::kModeStepIntervalMs,
+      /*priority=*/3);
+  scheduler.AddTask(
+      "power", []() { controller.StepPower(); },
+      Controller::kPowerStepIntervalMs, /*priority=*/3);
+  led_task = scheduler.AddTask(
+      "led",
+      []() {
+        controller.StepLed();
+        scheduler.RunAfter(led_task, controller.GetLedStepWaitMs());
+      },
+      Controller::kLedStepIntervalMs, /*priority=*/2);
+  serial_task = scheduler.AddTask(
+      "serial", []() { serial_manager.Step(); }, kSerialPeriodMs,
+      /*priority=*/1);
+
 #ifdef DEBUG_VCNL4020_BRIGHTNESS
   vcnl4020.SetPeriodicAmbient(true);
-  vncl4020_timer.Reset();
+  scheduler.AddTask(
+      "vcnl4020-brightness",
+      []() {
+        if (vcnl4020.AmbientReady()) {
+          Serial1.printf("ambient: %5u\n", vcnl4020.ReadAmbient());
+        }
+      },
+      kVcnl4020DebugPeriodMs, /*priority=*/0);
 #endif  // DEBUG_VCNL4020_BRIGHTNESS
 
 #ifdef DEBUG_VCNL4020_PROXIMITY
   vcnl4020.SetPeriodicProximity(true);
-  vncl4020_timer.Reset();
+  scheduler.AddTask(
+      "vcnl4020-proximity",
+      []() {
+        // if (vcnl4020.ProximityReady()) {
+        //   proximity_edge_filter.Run();
+        //   Serial1.printf("rising: %u, falling: %u, value: %u, slope: %d\n",
+        //                  edge_filter.Rising(proximity_threshold),
+        //                  edge_filter.Falling(proximity_threshold),
+        //                  edge_filter.GetFilteredValue(),
+        //                  edge_filter.Slope());
+        // }
+        if (vcnl4020.ProximityReady()) {
+          Serial1.printf("proximity: %5u\n", vcnl4020.ReadProximity());
+        }
+      },
+      kVcnl4020DebugPeriodMs, /*priority=*/0);
 #endif  // DEBUG_VCNL4020_PROXIMITY
 
+#ifdef DEBUG_SCHEDULER
+  scheduler.AddTask(
+      "scheduler",
+      []() {
+        for (Scheduler::TaskId id = 0; id < scheduler.GetTaskCount(); id++) {
+          const Scheduler::TaskStats &stats = scheduler.GetStats(id);
+          Serial1.printf("%s: %lu runs, max %lu us\n", scheduler.GetName(id),
+                         stats.runs, stats.max_duration_us);
+        }
+        scheduler.ResetStats();
+      },
+      kSchedulerDebugPeriodMs, /*priority=*/0);
+#endif  // DEBUG_SCHEDULER
+
   digitalWrite(kPinBatteryLed2, true);
   delay(100);
   digitalWrite(kPinBatteryLed2, false);
 }
 
 void loop() {
-  controller.Step();
-  serial_manager.Step();
-
-#ifdef DEBUG_VCNL4020_BRIGHTNESS
-  if (vncl4020_timer.Expired()) {
-    if (vcnl4020.AmbientReady()) {
-      Serial1.printf("ambient: %5u\n", vcnl4020.ReadAmbient());
-    }
-    vncl4020_timer.Reset();
-  }
-#endif  // ifdef DEBUG_VCNL4020_BRIGHTNESS
+  scheduler.Run();
 
-#ifdef DEBUG_VCNL4020_PROXIMITY
-  // if (vcnl4020.ProximityReady()) {
-  //   proximity_edge_filter.Run();
-  //   Serial1.printf("rising: %u, falling: %u, value: %u, slope: %d\n",
-  //                  edge_filter.Rising(proximity_threshold),
-  //                  edge_filter.Falling(proximity_threshold),
-  //                  edge_filter.GetFilteredValue(), edge_filter.Slope());
-  // }
-  if (vcnl4020.ProximityReady()) {
-    Serial1.printf("proximity: %5u\n", vcnl4020.ReadProximity());
+  // Any interrupt ends the idle, including received serial data.
+  const uint32_t until_due = scheduler.GetMillisUntilDue();
+  if (until_due >= kMinIdleMs) {
+    power_controller.Idle(until_due);
   }
-#endif  // ifdef DEBUG_VCNL4020_PROXIMITY
 }
+
+// Called by the Arduino core after `loop`, when serial data has arrived.
+void serialEvent1() { scheduler.Notify(serial_task); }
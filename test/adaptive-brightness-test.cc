@@ -0,0 +1,59 @@
+#include "adaptive-brightness.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+constexpr uint32_t kFull = led_dimming::kMaxDutyCycle;
+
+TEST(AdaptiveBrightness, UsesFullPowerUntilLearned) {
+  AdaptiveBrightness adaptive;
+  EXPECT_EQ(adaptive.GetDutyCycle(400), kFull);
+
+  adaptive.UpdateDark(100);
+  EXPECT_EQ(adaptive.GetDaylight(), 100);
+  EXPECT_EQ(adaptive.GetDutyCycle(400), kFull);
+  // Enough daylight already.
+  EXPECT_EQ(adaptive.GetDutyCycle(100), 0);
+}
+
+TEST(AdaptiveBrightness, LearnsLedContribution) {
+  AdaptiveBrightness adaptive;
+  adaptive.UpdateDark(100);
+  adaptive.Update(900, kFull);
+  EXPECT_EQ(adaptive.GetLedGain(), 800);
+  EXPECT_EQ(adaptive.GetDaylight(), 100);
+
+  // 300 is missing, which is 3/8 of what the LED adds at full power.
+  EXPECT_EQ(adaptive.GetDutyCycle(400), kFull * 3 / 8);
+
+  // Once dimmed, the LED's share is still subtracted.
+  adaptive.Update(400, kFull * 3 / 8);
+  EXPECT_NEAR(adaptive.GetDaylight(), 100, 1);
+
+  // More daylight means less LED.
+  adaptive.Update(500, kFull * 3 / 8);
+  EXPECT_NEAR(adaptive.GetDaylight(), 200, 1);
+  EXPECT_NEAR(adaptive.GetDutyCycle(400), kFull / 4, kFull / 800);
+}
+
+TEST(AdaptiveBrightness, LearnsOnlyFromLargeSteps) {
+  AdaptiveBrightness adaptive;
+  adaptive.UpdateDark(100);
+  adaptive.Update(110, AdaptiveBrightness::kMinLearningDutyCycle - 1);
+  EXPECT_EQ(adaptive.GetLedGain(), 0);
+
+  adaptive.UpdateDark(100);
+  adaptive.Update(500, kFull / 2);
+  EXPECT_EQ(adaptive.GetLedGain(), 800);
+
+  // Later turn-ons refine the estimate, without jumping.
+  adaptive.UpdateDark(100);
+  adaptive.Update(500, kFull);
+  EXPECT_EQ(adaptive.GetLedGain(), 700);
+  // Readings while on don't change it.
+  adaptive.Update(1000, kFull);
+  EXPECT_EQ(adaptive.GetLedGain(), 700);
+}
+
+}  // namespace
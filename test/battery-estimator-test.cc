@@ -0,0 +1,167 @@
+#include "battery-estimator.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using ChargeState = BatteryEstimator::ChargeState;
+
+constexpr uint32_t kHourMs = 60 * 60 * 1000;
+
+TEST(BatteryEstimator, InterpolatesOpenCircuitVoltage) {
+  EXPECT_EQ(BatteryEstimator::OpenCircuitPercent(2000), 0);
+  EXPECT_EQ(BatteryEstimator::OpenCircuitPercent(2500), 0);
+  EXPECT_EQ(BatteryEstimator::OpenCircuitPercent(3255), 45);
+  EXPECT_EQ(BatteryEstimator::OpenCircuitPercent(3260), 50);
+  EXPECT_EQ(BatteryEstimator::OpenCircuitPercent(3400), 100);
+  EXPECT_EQ(BatteryEstimator::OpenCircuitPercent(3600), 100);
+}
+
+TEST(BatteryEstimator, ModelsLedCurrent) {
+  EXPECT_EQ(BatteryEstimator::EstimateCurrentMicroamps(3200, 0),
+            BatteryEstimator::kIdleMicroamps);
+
+  // About 390mA at full brightness and 3.2V.
+  const uint32_t full = BatteryEstimator::EstimateCurrentMicroamps(
+      3200, BatteryEstimator::kMaxDutyCycle);
+  EXPECT_NEAR(full, 390 * 1000, 10 * 1000);
+
+  // A boost converter draws more current at lower voltages.
+  EXPECT_GT(BatteryEstimator::EstimateCurrentMicroamps(
+                3000, BatteryEstimator::kMaxDutyCycle),
+            full);
+
+  const uint32_t half = BatteryEstimator::EstimateCurrentMicroamps(
+      3200, BatteryEstimator::kMaxDutyCycle / 2);
+  EXPECT_NEAR(half, full / 2, 2 * 1000);
+}
+
+TEST(BatteryEstimator, CountsChargeUsedByLed) {
+  BatteryEstimator estimator;
+  estimator.Reset(0, 3400);
+  ASSERT_EQ(estimator.GetPercent(), 100);
+
+  // The voltage sags under load, but that doesn't affect the estimate.
+  const uint32_t current_microamps = BatteryEstimator::EstimateCurrentMicroamps(
+      3200, BatteryEstimator::kMaxDutyCycle);
+  for (uint32_t t = 1000; t <= kHourMs; t += 1000) {
+    estimator.Update(t, 3200, BatteryEstimator::kMaxDutyCycle,
+                     ChargeState::kDischarging);
+  }
+  EXPECT_NEAR(estimator.GetRemainingMicroampHours(),
+              BatteryEstimator::kCapacityMicroampHours - current_microamps, 10);
+  EXPECT_EQ(estimator.GetPercent(), 78);
+}
+
+TEST(BatteryEstimator, AnchorsToRestedVoltage) {
+  BatteryEstimator estimator;
+  estimator.Reset(0, 3400);
+
+  // The LED was on until now, so the voltage isn't trusted yet.
+  estimator.Update(1000, 3260, BatteryEstimator::kMaxDutyCycle,
+                   ChargeState::kDischarging);
+  estimator.Update(2000, 3260, 0, ChargeState::kDischarging);
+  EXPECT_GT(estimator.GetPercent(), 90);
+
+  estimator.Update(2000 + BatteryEstimator::kRelaxationMs, 3260, 0,
+                   ChargeState::kDischarging);
+  EXPECT_EQ(estimator.GetPercent(), 50);
+}
+
+TEST(BatteryEstimator, HoldsWhileChargingAndFillsWhenCharged) {
+  BatteryEstimator estimator;
+  estimator.Reset(0, 3260);
+  ASSERT_EQ(estimator.GetPercent(), 50);
+
+  // The charging voltage isn't the open-circuit voltage.
+  estimator.Update(kHourMs, 3600, 0, ChargeState::kCharging);
+  EXPECT_EQ(estimator.GetPercent(), 50);
+
+  estimator.Update(2 * kHourMs, 3600, 0, ChargeState::kCharged);
+  EXPECT_EQ(estimator.GetPercent(), 100);
+}
+
+TEST(BatteryEstimator, MeasuresInternalResistance) {
+  BatteryEstimator estimator;
+  estimator.Reset(0, 3300);
+  EXPECT_EQ(estimator.GetInternalResistanceMilliohms(),
+            BatteryEstimator::kDefaultInternalResistanceMilliohms);
+
+  // The voltage sags by 80mV with the LED on, which is about 0.2 ohms.
+  constexpr uint16_t kOffMillivolts = 3300;
+  constexpr uint16_t kOnMillivolts = 3220;
+  const uint32_t step_microamps = BatteryEstimator::EstimateCurrentMicroamps(
+                                      kOnMillivolts,
+                                      BatteryEstimator::kMaxDutyCycle) -
+                                  BatteryEstimator::kIdleMicroamps;
+  const uint32_t expected_milliohms =
+      static_cast<uint64_t>(kOffMillivolts - kOnMillivolts) * 1000 * 1000 /
+      step_microamps;
+  ASSERT_EQ(expected_milliohms, 206);
+
+  uint32_t now = 0;
+  for (uint32_t cycle = 0; cycle < 40; cycle++) {
+    for (uint32_t t = 0; t < 1000; t += 100) {
+      now += 100;
+      estimator.Update(now, kOnMillivolts, BatteryEstimator::kMaxDutyCycle,
+                       ChargeState::kDischarging);
+    }
+    for (uint32_t t = 0; t < 1000; t += 100) {
+      now += 100;
+      estimator.Update(now, kOffMillivolts, 0, ChargeState::kDischarging);
+    }
+  }
+  EXPECT_NEAR(estimator.GetInternalResistanceMilliohms(), expected_milliohms,
+              5);
+
+  // Steps too far apart aren't used, since the battery may have discharged in
+  // between.
+  const uint32_t measured = estimator.GetInternalResistanceMilliohms();
+  now += BatteryEstimator::kMaxStepIntervalMs + 1;
+  estimator.Update(now, 3000, BatteryEstimator::kMaxDutyCycle,
+                   ChargeState::kDischarging);
+  now += BatteryEstimator::kSettleMs;
+  estimator.Update(now, 3000, BatteryEstimator::kMaxDutyCycle,
+                   ChargeState::kDischarging);
+  EXPECT_EQ(estimator.GetInternalResistanceMilliohms(), measured);
+}
+
+TEST(BatteryEstimator, CompensatesForSag) {
+  BatteryEstimator estimator;
+  estimator.Reset(0, 3300);
+  EXPECT_EQ(estimator.EstimateOpenCircuitMillivolts(3300), 3300);
+
+  estimator.Update(1000, 3000, BatteryEstimator::kMaxDutyCycle,
+                   ChargeState::kDischarging);
+  const uint32_t sag_millivolts =
+      static_cast<uint64_t>(BatteryEstimator::EstimateCurrentMicroamps(
+          3000, BatteryEstimator::kMaxDutyCycle)) *
+      BatteryEstimator::kDefaultInternalResistanceMilliohms / (1000 * 1000);
+  ASSERT_GT(sag_millivolts, 50);
+  EXPECT_EQ(estimator.EstimateOpenCircuitMillivolts(3000),
+            3000 + sag_millivolts);
+
+  // The filtered voltage takes time to recover after the LED turns off, so the
+  // compensation is held until it settles.
+  estimator.Update(2000, 3000, 0, ChargeState::kDischarging);
+  EXPECT_EQ(estimator.EstimateOpenCircuitMillivolts(3000),
+            3000 + sag_millivolts);
+  estimator.Update(2000 + BatteryEstimator::kSettleMs, 3000, 0,
+                   ChargeState::kDischarging);
+  EXPECT_LT(estimator.EstimateOpenCircuitMillivolts(3000), 3001);
+}
+
+TEST(BatteryEstimator, EstimatesRuntime) {
+  BatteryEstimator estimator;
+  estimator.Reset(0, 3260);
+
+  const uint32_t current_microamps = BatteryEstimator::EstimateCurrentMicroamps(
+      3260, BatteryEstimator::kMaxDutyCycle);
+  EXPECT_EQ(estimator.GetRuntimeMinutes(3260, BatteryEstimator::kMaxDutyCycle),
+            static_cast<uint64_t>(estimator.GetRemainingMicroampHours()) * 60 /
+                current_microamps);
+  EXPECT_GT(estimator.GetRuntimeMinutes(3260, 0),
+            estimator.GetRuntimeMinutes(3260, BatteryEstimator::kMaxDutyCycle));
+}
+
+}  // namespace
@@ -15,15 +15,44 @@
 #include "config-storage.h"
 
 #include <gtest/gtest.h>
+#include <pb_encode.h>
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
 
 #include "types.h"
 
 class ConfigStorageTest : public ::testing::Test {
  protected:
-  void SetUp() override { EEPROM.reset(); }
+  void SetUp() override {
+    EEPROM.reset();
+    ConfigStorage::DiscardPendingSave();
+  }
+  // Don't leak a stored config into other tests.
+  void TearDown() override {
+    EEPROM.reset();
+    ConfigStorage::DiscardPendingSave();
+  }
+
+  // Rewrites the header of the record at `address`, with a valid CRC.
+  void PutRecordHeader(size_t address, ConfigStorage::RecordHeader header) {
+    std::vector<uint8_t> record(sizeof(header) + header.length);
+    std::memcpy(record.data(), &header, sizeof(header));
+    for (size_t i = sizeof(header); i < record.size(); i++) {
+      record[i] = EEPROM.read(address + i);
+    }
+    constexpr size_t kCrcStart =
+        offsetof(ConfigStorage::RecordHeader, sequence);
+    header.crc = ConfigStorage::Crc32(record.data() + kCrcStart,
+                                      record.size() - kCrcStart);
+    EEPROM.put(address, header);
+  }
 
   ConfigStorage configStorage;
-  ConfigPb config;
+  ConfigPb config = ConfigPb_init_zero;
 };
 
 TEST_F(ConfigStorageTest, RoundTripSaveAndLoadSucceeds) {
@@ -36,19 +65,21 @@ TEST_F(ConfigStorageTest, RoundTripSaveAndLoadSucceeds) {
   EXPECT_EQ(182, config.proximity_threshold) << EEPROM;
 }
 
-TEST_F(ConfigStorageTest, TryLoadConfigReturnsFalseForMagicNumber0Incorrect) {
+TEST_F(ConfigStorageTest, TryLoadConfigReturnsFalseForMagicIncorrect) {
   configStorage.SaveConfig(&config);
   ASSERT_TRUE(configStorage.TryLoadConfig(&config));
 
-  EEPROM.put(0, 0);
+  EEPROM.put(ConfigStorage::kFirstRecordOffset, 0);
   EXPECT_FALSE(configStorage.TryLoadConfig(&config));
 }
 
-TEST_F(ConfigStorageTest, TryLoadConfigReturnsFalseForMagicNumber1Incorrect) {
+TEST_F(ConfigStorageTest, TryLoadConfigReturnsFalseForCorruptRecord) {
   configStorage.SaveConfig(&config);
   ASSERT_TRUE(configStorage.TryLoadConfig(&config));
 
-  EEPROM.put(sizeof(ConfigStorage::kEEPROMMagicByte1), 0);
+  const size_t address =
+      ConfigStorage::kFirstRecordOffset + sizeof(ConfigStorage::RecordHeader);
+  EEPROM.write(address, EEPROM.read(address) ^ 1);
   EXPECT_FALSE(configStorage.TryLoadConfig(&config));
 }
 
@@ -56,7 +87,211 @@ TEST_F(ConfigStorageTest, TryLoadConfigReturnsFalseForVersionIncorrect) {
   configStorage.SaveConfig(&config);
   ASSERT_TRUE(configStorage.TryLoadConfig(&config));
 
-  EEPROM.put(2 * sizeof(ConfigStorage::kEEPROMMagicByte1), 0);
+  ConfigStorage::RecordHeader header;
+  EEPROM.get(ConfigStorage::kFirstRecordOffset, header);
+  header.version = 0;
+  PutRecordHeader(ConfigStorage::kFirstRecordOffset, header);
   ASSERT_NE(0, ConfigStorage::kConfigVersion);
   EXPECT_FALSE(configStorage.TryLoadConfig(&config));
 }
+
+TEST_F(ConfigStorageTest, Crc32MatchesCheckValue) {
+  const std::string data = "123456789";
+  EXPECT_EQ(0xCBF43926,
+            ConfigStorage::Crc32(reinterpret_cast<const uint8_t *>(data.data()),
+                                 data.size()));
+}
+
+TEST_F(ConfigStorageTest, LoadsNewestRecordAfterWrapping) {
+  constexpr uint32_t kSaves = 100;
+  for (uint32_t i = 0; i < kSaves; i++) {
+    config.proximity_threshold = i;
+    ASSERT_TRUE(configStorage.SaveConfig(&config));
+  }
+
+  ConfigPb loaded = ConfigPb_init_zero;
+  ASSERT_TRUE(configStorage.TryLoadConfig(&loaded));
+  EXPECT_EQ(kSaves - 1, loaded.proximity_threshold);
+
+  // Records were written all over the journal, not just at the start.
+  uint32_t end_writes = 0;
+  for (size_t i = ConfigStorage::kJournalSize / 2;
+       i < ConfigStorage::kJournalSize; i++) {
+    end_writes += EEPROM.write_count(i);
+  }
+  EXPECT_GT(end_writes, 0);
+}
+
+TEST_F(ConfigStorageTest, SpreadsWearAcrossEeprom) {
+  constexpr uint32_t kSaves = 1000;
+  for (uint32_t i = 0; i < kSaves; i++) {
+    config.proximity_threshold = i;
+    config.led_duty_cycle = kSaves - i;
+    ASSERT_TRUE(configStorage.SaveConfig(&config));
+  }
+
+  // Each save writes to a different place, so no cell is written on more than a
+  // small fraction of saves.
+  const size_t records_per_pass =
+      ConfigStorage::kJournalSize /
+      ConfigStorage::RecordSize(ConfigPb_size);
+  EXPECT_LE(EEPROM.max_write_count(), kSaves / records_per_pass + 1);
+}
+
+TEST_F(ConfigStorageTest, FallsBackToPreviousRecordIfNewestIsCorrupt) {
+  config.proximity_threshold = 1;
+  ASSERT_TRUE(configStorage.SaveConfig(&config));
+  ConfigStorage::RecordHeader header;
+  EEPROM.get(ConfigStorage::kFirstRecordOffset, header);
+
+  config.proximity_threshold = 2;
+  ASSERT_TRUE(configStorage.SaveConfig(&config));
+
+  // Simulate losing power partway through writing the second record.
+  const size_t address = ConfigStorage::kFirstRecordOffset +
+                         ConfigStorage::RecordSize(header.length);
+  const size_t last = address + sizeof(header) + header.length - 1;
+  EEPROM.write(last, EEPROM.read(last) ^ 0xFF);
+
+  ConfigPb loaded = ConfigPb_init_zero;
+  ASSERT_TRUE(configStorage.TryLoadConfig(&loaded));
+  EXPECT_EQ(1, loaded.proximity_threshold);
+}
+
+TEST_F(ConfigStorageTest, LoadsLegacyConfig) {
+  config.proximity_threshold = 182;
+  std::array<uint8_t, ConfigPb_size + 5> buffer;
+  pb_ostream_t stream = pb_ostream_from_buffer(buffer.data(), buffer.size());
+  ASSERT_TRUE(pb_encode_ex(&stream, &ConfigPb_msg, &config,
+                           PB_ENCODE_DELIMITED));
+
+  EEPROM.put(0, ConfigStorage::kEEPROMMagicByte0);
+  EEPROM.put(sizeof(uint32_t), ConfigStorage::kEEPROMMagicByte1);
+  EEPROM.put(2 * sizeof(uint32_t), ConfigStorage::kConfigVersion);
+  for (size_t i = 0; i < stream.bytes_written; i++) {
+    EEPROM.write(3 * sizeof(uint32_t) + i, buffer[i]);
+  }
+
+  ConfigPb loaded = ConfigPb_init_zero;
+  ASSERT_TRUE(configStorage.TryLoadConfig(&loaded));
+  EXPECT_EQ(182, loaded.proximity_threshold);
+
+  // The next save replaces the legacy config.
+  config.proximity_threshold = 183;
+  ASSERT_TRUE(configStorage.SaveConfig(&config));
+  ASSERT_TRUE(configStorage.TryLoadConfig(&loaded));
+  EXPECT_EQ(183, loaded.proximity_threshold);
+}
+
+TEST_F(ConfigStorageTest, InterruptedSaveKeepsPreviousConfig) {
+  // Saves enough times to wrap around, losing power at every point of the
+  // last save.
+  for (uint32_t saves = 1; saves < 40; saves++) {
+    for (uint32_t writes = 0;; writes++) {
+      EEPROM.reset();
+      for (uint32_t i = 0; i < saves; i++) {
+        config.proximity_threshold = i;
+        ASSERT_TRUE(configStorage.SaveConfig(&config));
+      }
+
+      EEPROM.lose_power_after(writes);
+      config.proximity_threshold = saves;
+      configStorage.SaveConfig(&config);
+      EEPROM.restore_power();
+
+      ConfigPb loaded = ConfigPb_init_zero;
+      ASSERT_TRUE(configStorage.TryLoadConfig(&loaded))
+          << "saves: " << saves << ", writes: " << writes;
+      if (loaded.proximity_threshold == saves) {
+        break;
+      }
+      ASSERT_EQ(saves - 1, loaded.proximity_threshold)
+          << "saves: " << saves << ", writes: " << writes;
+    }
+  }
+}
+
+TEST_F(ConfigStorageTest, InterruptedFirstSaveKeepsLegacyConfig) {
+  config.proximity_threshold = 182;
+  std::array<uint8_t, ConfigPb_size + 5> buffer;
+  pb_ostream_t stream = pb_ostream_from_buffer(buffer.data(), buffer.size());
+  ASSERT_TRUE(pb_encode_ex(&stream, &ConfigPb_msg, &config,
+                           PB_ENCODE_DELIMITED));
+  EEPROM.put(0, ConfigStorage::kEEPROMMagicByte0);
+  EEPROM.put(sizeof(uint32_t), ConfigStorage::kEEPROMMagicByte1);
+  EEPROM.put(2 * sizeof(uint32_t), ConfigStorage::kConfigVersion);
+  for (size_t i = 0; i < stream.bytes_written; i++) {
+    EEPROM.write(3 * sizeof(uint32_t) + i, buffer[i]);
+  }
+
+  EEPROM.lose_power_after(10);
+  config.proximity_threshold = 183;
+  configStorage.SaveConfig(&config);
+  EEPROM.restore_power();
+
+  ConfigPb loaded = ConfigPb_init_zero;
+  ASSERT_TRUE(configStorage.TryLoadConfig(&loaded));
+  EXPECT_EQ(182, loaded.proximity_threshold);
+}
+
+TEST_F(ConfigStorageTest, StoresCalibrationSeparately) {
+  CalibrationPb calibration = CalibrationPb_init_zero;
+  EXPECT_FALSE(configStorage.TryLoadCalibration(&calibration));
+  calibration.adc_offset_millivolts = -12;
+  calibration.proximity_crosstalk = 2345;
+  ASSERT_TRUE(configStorage.SaveCalibration(&calibration));
+
+  // Filling the other journals doesn't affect the calibration.
+  UsageStatsPb stats = UsageStatsPb_init_zero;
+  for (uint32_t i = 1; i <= 100; i++) {
+    config.proximity_threshold = i;
+    ASSERT_TRUE(configStorage.SaveConfig(&config));
+    stats.motion_triggers = i;
+    ASSERT_TRUE(configStorage.SaveUsageStats(&stats));
+  }
+
+  CalibrationPb loaded = CalibrationPb_init_zero;
+  ASSERT_TRUE(configStorage.TryLoadCalibration(&loaded));
+  EXPECT_EQ(-12, loaded.adc_offset_millivolts);
+  EXPECT_EQ(2345, loaded.proximity_crosstalk);
+}
+
+TEST_F(ConfigStorageTest, CoalescesDeferredSaves) {
+  for (uint32_t i = 1; i <= 3; i++) {
+    config.proximity_threshold = i;
+    ASSERT_TRUE(configStorage.SaveConfigDeferred(&config));
+    configStorage.Step();
+  }
+  EXPECT_EQ(EEPROM.max_write_count(), 0);
+
+  configStorage.Flush();
+  EXPECT_FALSE(configStorage.HasPendingSave());
+  ConfigPb loaded = ConfigPb_init_zero;
+  ASSERT_TRUE(configStorage.TryLoadConfig(&loaded));
+  EXPECT_EQ(3, loaded.proximity_threshold);
+
+  // Only one record was written.
+  ConfigStorage::RecordHeader header;
+  EEPROM.get(ConfigStorage::kFirstRecordOffset, header);
+  EXPECT_EQ(0, header.sequence);
+  EXPECT_EQ(1, EEPROM.max_write_count());
+}
+
+TEST_F(ConfigStorageTest, StoresUsageStatsSeparately) {
+  config.proximity_threshold = 182;
+  ASSERT_TRUE(configStorage.SaveConfig(&config));
+
+  UsageStatsPb stats = UsageStatsPb_init_zero;
+  EXPECT_FALSE(configStorage.TryLoadUsageStats(&stats));
+  for (uint32_t i = 1; i <= 100; i++) {
+    stats.motion_triggers = i;
+    ASSERT_TRUE(configStorage.SaveUsageStats(&stats));
+  }
+
+  UsageStatsPb loaded_stats = UsageStatsPb_init_zero;
+  ASSERT_TRUE(configStorage.TryLoadUsageStats(&loaded_stats));
+  EXPECT_EQ(100, loaded_stats.motion_triggers);
+  ConfigPb loaded = ConfigPb_init_zero;
+  ASSERT_TRUE(configStorage.TryLoadConfig(&loaded));
+  EXPECT_EQ(182, loaded.proximity_threshold);
+}
@@ -18,6 +18,8 @@
 
 #include <limits>
 
+#include "config-storage.h"
+#include "fake-led-driver.h"
 #include "fake-power-controller.h"
 #include "fake-temperature-sensor.h"
 #include "fake-vcnl4020.h"
@@ -77,7 +79,9 @@ class ControllerTest : public LightTest {
   FakeTemperatureSensor temperature_sensor;
   FakeVCNL4020 vcnl4020;
   FakePowerController power_controller;
-  Controller controller{&temperature_sensor, &vcnl4020, &power_controller};
+  FakeLedDriver led_driver;
+  Controller controller{&temperature_sensor, &vcnl4020, &power_controller,
+                        &led_driver};
 };
 
 TEST_F(ControllerTest, Initializes) { EXPECT_TRUE(controller.Init()); }
@@ -455,8 +459,7 @@ TEST_F(ControllerTest, TurnsOffLedWhenBatteryLow) {
   ASSERT_EQ(controller.GetUSBStatus(), USBStatus::kNoConnection);
   ASSERT_EQ(controller.GetPowerStatus(), PowerStatus::kBattery);
   controller.Step();
-  ASSERT_GT(controller.GetFilteredBatteryMillivolts(),
-            Controller::kBatteryVoltage1);
+  ASSERT_GT(controller.GetBatteryPercent(), Controller::kBatteryLevel1Percent);
   ASSERT_EQ(controller.GetUSBStatus(), USBStatus::kNoConnection);
   ASSERT_EQ(controller.GetPowerStatus(), PowerStatus::kBattery);
 
@@ -481,7 +484,7 @@ TEST_F(ControllerTest, TurnsOffLedWhenBatteryLow) {
   }
 
   ASSERT_LT(controller.GetFilteredBatteryMillivolts(),
-            Controller::kBatteryVoltage0);
+            controller.GetLowBatteryCutoffMillivolts());
   EXPECT_EQ(controller.GetPowerStatus(), PowerStatus::kLowBatteryCutoff);
   EXPECT_EQ(controller.GetPowerMode(), PowerMode::kOn);
   EXPECT_EQ(getAnalogWrite(kPinWhiteLed), 0);
@@ -648,16 +651,20 @@ std::array<uint32_t, 3> GetBatteryLeds() {
                      getAnalogWrite(kPinBatteryLed3));
 }
 
-TEST_F(ControllerTest, DisplaysBatteryVoltage) {
+// Returns the AVREF reading for a battery voltage.
+uint32_t AdcReferenceForMillivolts(uint32_t millivolts) {
+  return (kFakeVrefintCal * Controller::kReferenceSupplyMillivolts) /
+         millivolts / 4;
+}
+
+TEST_F(ControllerTest, DisplaysStateOfCharge) {
   setDigitalRead(kPinBatteryNPowerGood, true);
   setDigitalRead(kPinBatteryStat, false);
 
-  setAnalogRead(AVREF,
-                (kFakeVrefintCal * Controller::kReferenceSupplyMillivolts) /
-                    (Controller::kBatteryVoltage1 + 100) / 4);
-  ASSERT_GT(controller.ReadRawBatteryMillivolts(),
-            Controller::kBatteryVoltage1);
+  // The estimate starts from the voltage at boot.
+  setAnalogRead(AVREF, AdcReferenceForMillivolts(3400));
   ASSERT_TRUE(controller.Init());
+  EXPECT_EQ(controller.GetBatteryPercent(), 100);
   EXPECT_EQ(GetBatteryLeds(), BatteryLeds(0, 0, 0));
 
   setDigitalRead(kPinPowerAuto, false);
@@ -668,26 +675,23 @@ TEST_F(ControllerTest, DisplaysBatteryVoltage) {
                         Controller::kBatteryLedActiveBrightness,
                         Controller::kBatteryLedActiveBrightness));
 
-  advanceMillis(Controller::kBatteryLevelDisplayTimeSeconds * 1000 + 10);
-  controller.Step();
-  EXPECT_EQ(GetBatteryLeds(), BatteryLeds(0, 0, 0));
-
-  // Medium voltage
-  setAnalogRead(AVREF,
-                (kFakeVrefintCal * Controller::kReferenceSupplyMillivolts) /
-                    (Controller::kBatteryVoltage0 + 10) / 4);
-  ASSERT_GT(controller.ReadRawBatteryMillivolts(),
-            Controller::kBatteryVoltage0);
-  ASSERT_LT(controller.ReadRawBatteryMillivolts(),
-            Controller::kBatteryVoltage1);
-  // Pump the battery voltage filters
+  // Once the LED has been off for long enough, the estimate is updated from the
+  // voltage.
+  setDigitalRead(kPinPowerAuto, true);
+  setAnalogRead(AVREF, AdcReferenceForMillivolts(3250));
   for (uint32_t n = 0; n < 100; n++) {
     advanceMillis(Controller::kBatteryFilterRunIntervalMillis + 1);
     controller.Step();
   }
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOff);
+  ASSERT_GT(controller.GetBatteryPercent(), Controller::kBatteryLevel1Percent);
+  advanceMillis(BatteryEstimator::kRelaxationMs);
+  controller.Step();
+  EXPECT_GT(controller.GetBatteryPercent(), Controller::kBatteryLevel0Percent);
+  EXPECT_LT(controller.GetBatteryPercent(), Controller::kBatteryLevel1Percent);
 
-  setDigitalRead(kPinPowerAuto, true);
   setDigitalRead(kPinPowerOn, false);
+  advanceMillis(11);
   controller.Step();
   ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOn);
   EXPECT_EQ(GetBatteryLeds(),
@@ -695,20 +699,19 @@ TEST_F(ControllerTest, DisplaysBatteryVoltage) {
                         Controller::kBatteryLedActiveBrightness,
                         Controller::kBatteryLedActiveBrightness));
 
-  // Low voltage
-  setAnalogRead(AVREF,
-                (kFakeVrefintCal * Controller::kReferenceSupplyMillivolts) /
-                    (Controller::kBatteryVoltage0 - 10) / 4);
-  ASSERT_LT(controller.ReadRawBatteryMillivolts(),
-            Controller::kBatteryVoltage0);
-  // Pump the battery voltage filters
+  // Low charge
+  setDigitalRead(kPinPowerOn, true);
+  setAnalogRead(AVREF, AdcReferenceForMillivolts(3150));
   for (uint32_t n = 0; n < 100; n++) {
     advanceMillis(Controller::kBatteryFilterRunIntervalMillis + 1);
     controller.Step();
   }
+  advanceMillis(BatteryEstimator::kRelaxationMs + 1000);
+  controller.Step();
+  EXPECT_LT(controller.GetBatteryPercent(), Controller::kBatteryLevel0Percent);
 
   setDigitalRead(kPinPowerAuto, false);
-  setDigitalRead(kPinPowerOn, true);
+  advanceMillis(11);
   controller.Step();
   ASSERT_EQ(controller.GetPowerMode(), PowerMode::kAuto);
   EXPECT_EQ(GetBatteryLeds(),
@@ -717,6 +720,55 @@ TEST_F(ControllerTest, DisplaysBatteryVoltage) {
                         Controller::kBatteryLedActiveBrightness));
 }
 
+TEST_F(ControllerTest, ReportsRuntimeEstimate) {
+  ASSERT_TRUE(controller.Init());
+  controller.Step();
+  ASSERT_EQ(controller.GetBatteryPercent(), 100);
+
+  // A full battery lasts a few hours at full brightness.
+  EXPECT_GT(controller.GetRuntimeMinutes(), 4 * 60);
+  EXPECT_LT(controller.GetRuntimeMinutes(), 6 * 60);
+
+  // Charging fills the estimate.
+  setDigitalRead(kPinBatteryNPowerGood, false);
+  setDigitalRead(kPinBatteryStat, true);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerStatus(), PowerStatus::kCharged);
+  EXPECT_EQ(controller.GetBatteryPercent(), 100);
+}
+
+TEST_F(ControllerTest, CompensatesCutoffForLedLoad) {
+  ASSERT_TRUE(controller.Init());
+  setDigitalRead(kPinPowerOn, false);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOn);
+  ASSERT_EQ(getAnalogWrite(kPinWhiteLed), controller.GetLedDutyCycle());
+
+  // Under the LED's load, the voltage is just below the cutoff, but the
+  // open-circuit voltage is above it.
+  setAnalogRead(AVREF, AdcReferenceForMillivolts(
+                           controller.GetLowBatteryCutoffMillivolts() - 20));
+  for (uint32_t n = 0; n < 100; n++) {
+    advanceMillis(Controller::kBatteryFilterRunIntervalMillis + 1);
+    controller.Step();
+  }
+  ASSERT_LT(controller.GetFilteredBatteryMillivolts(),
+            controller.GetLowBatteryCutoffMillivolts());
+  EXPECT_GT(controller.GetOpenCircuitBatteryMillivolts(),
+            controller.GetLowBatteryCutoffMillivolts());
+  EXPECT_EQ(controller.GetPowerStatus(), PowerStatus::kBattery);
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), controller.GetLedDutyCycle());
+
+  // With the LED off, there's no sag to compensate for.
+  setDigitalRead(kPinPowerOn, true);
+  for (uint32_t n = 0; n < 100; n++) {
+    advanceMillis(Controller::kBatteryFilterRunIntervalMillis + 1);
+    controller.Step();
+  }
+  EXPECT_EQ(controller.GetPowerStatus(), PowerStatus::kLowBatteryCutoff);
+}
+
 TEST_F(ControllerTest, AmbientAndProximitySensorsWork) {
   ASSERT_TRUE(controller.Init());
 
@@ -727,6 +779,145 @@ TEST_F(ControllerTest, AmbientAndProximitySensorsWork) {
   EXPECT_EQ(controller.ReadProximity(), 600);
 }
 
+TEST_F(ControllerTest, AppliesCalibration) {
+  ASSERT_TRUE(controller.Init());
+  EXPECT_EQ(vcnl4020.GetLEDCurrent(),
+            Controller::kDefaultProximityLedCurrentMilliamps);
+
+  CalibrationPb calibration = CalibrationPb_init_zero;
+  calibration.adc_gain_ppm = 1010000;
+  calibration.adc_offset_millivolts = -20;
+  calibration.proximity_crosstalk = 100;
+  calibration.als_lens_transmission_permille = 800;
+  calibration.proximity_led_current_milliamps = 42;
+  controller.SetCalibration(calibration);
+  EXPECT_EQ(vcnl4020.GetLEDCurrent(), 40);
+
+  // 3529mV * 1.01 - 20mV
+  EXPECT_EQ(controller.ReadBatteryMillivolts(), 3544);
+
+  vcnl4020.SetAmbient(400);
+  EXPECT_EQ(controller.ReadAmbientLight(), 500);
+
+  vcnl4020.SetProximity(600);
+  EXPECT_EQ(controller.ReadProximity(), 500);
+  vcnl4020.SetProximity(50);
+  EXPECT_EQ(controller.ReadProximity(), 0);
+}
+
+TEST_F(ControllerTest, LoadsCalibration) {
+  EEPROM.reset();
+  CalibrationPb calibration = CalibrationPb_init_zero;
+  calibration.proximity_crosstalk = 100;
+  calibration.proximity_led_current_milliamps = 20;
+  ASSERT_TRUE(ConfigStorage::SaveCalibration(&calibration));
+
+  ASSERT_TRUE(controller.Init());
+  EXPECT_EQ(vcnl4020.GetLEDCurrent(), 20);
+  vcnl4020.SetProximity(600);
+  EXPECT_EQ(controller.ReadProximity(), 500);
+  EEPROM.reset();
+}
+
+TEST_F(ControllerTest, CalibratesProximityCrosstalk) {
+  EEPROM.reset();
+  ASSERT_TRUE(controller.Init());
+  ASSERT_FALSE(vcnl4020.GetPeriodicProximity());
+  controller.StartProximityCrosstalkCalibration();
+  EXPECT_TRUE(vcnl4020.GetPeriodicProximity());
+
+  for (uint8_t i = 0; i < Controller::kCrosstalkCalibrationSamples; i++) {
+    ASSERT_TRUE(controller.CalibratingProximityCrosstalk());
+    vcnl4020.SetProximity(i % 2 == 0 ? 200 : 300);
+    vcnl4020.SetProximityReady();
+    advanceMillis(Controller::kSleepLockoutMs + 1);
+    controller.Step();
+    // Sleeping would stop the measurements.
+    if (controller.CalibratingProximityCrosstalk()) {
+      EXPECT_EQ(power_controller.GetSleep(), 0);
+    }
+  }
+  EXPECT_FALSE(controller.CalibratingProximityCrosstalk());
+  EXPECT_EQ(controller.GetCalibration().proximity_crosstalk, 250);
+  // Proximity mode is disabled, so the measurements stop again.
+  EXPECT_FALSE(vcnl4020.GetPeriodicProximity());
+
+  CalibrationPb stored = CalibrationPb_init_zero;
+  ASSERT_TRUE(ConfigStorage::TryLoadCalibration(&stored));
+  EXPECT_EQ(stored.proximity_crosstalk, 250);
+  EEPROM.reset();
+}
+
+TEST_F(ControllerTest, ThrottlesChargingWhenHot) {
+  setAnalogRead(AVREF, kFakeVrefintCal * 0.8 / 4);
+  temperature_sensor.SetTemperature(30);
+  ASSERT_TRUE(controller.Init());
+  EXPECT_EQ(controller.GetTemperature(), 30);
+
+  setAnalogRead(kPinCc1, ComputeAnalogValueForMillivolts(1000));
+  controller.Step();
+  ASSERT_EQ(controller.GetUSBStatus(), USBStatus::kUSB1_5);
+  EXPECT_TRUE(getDigitalWrite(kPinChargeHighCurrentEnable));
+
+  // The temperature is only sampled periodically.
+  temperature_sensor.SetTemperature(Controller::kChargeThrottleCelsius);
+  controller.Step();
+  EXPECT_TRUE(getDigitalWrite(kPinChargeHighCurrentEnable));
+
+  advanceMillis(Controller::kTemperatureSampleIntervalMs + 1);
+  controller.Step();
+  EXPECT_EQ(controller.GetTemperature(), Controller::kChargeThrottleCelsius);
+  EXPECT_TRUE(controller.IsChargeThrottled());
+  EXPECT_FALSE(getDigitalWrite(kPinChargeHighCurrentEnable));
+
+  // Hysteresis keeps the limit until the board has cooled down.
+  temperature_sensor.SetTemperature(Controller::kChargeThrottleCelsius -
+                                    Controller::kThermalHysteresisCelsius + 1);
+  advanceMillis(Controller::kTemperatureSampleIntervalMs + 1);
+  controller.Step();
+  EXPECT_FALSE(getDigitalWrite(kPinChargeHighCurrentEnable));
+
+  temperature_sensor.SetTemperature(Controller::kChargeThrottleCelsius -
+                                    Controller::kThermalHysteresisCelsius);
+  advanceMillis(Controller::kTemperatureSampleIntervalMs + 1);
+  controller.Step();
+  EXPECT_FALSE(controller.IsChargeThrottled());
+  EXPECT_TRUE(getDigitalWrite(kPinChargeHighCurrentEnable));
+}
+
+TEST_F(ControllerTest, DeratesLedWhenHot) {
+  temperature_sensor.SetTemperature(30);
+  ASSERT_TRUE(controller.Init());
+  const uint32_t duty_cycle = controller.GetLedDutyCycle();
+
+  setDigitalRead(kPinPowerOn, false);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOn);
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), duty_cycle);
+
+  temperature_sensor.SetTemperature(Controller::kLedDerateCelsius);
+  advanceMillis(Controller::kTemperatureSampleIntervalMs + 1);
+  controller.Step();
+  EXPECT_TRUE(controller.IsLedDerated());
+  // Half the power is still most of the perceived brightness.
+  const uint32_t derated = getAnalogWrite(kPinWhiteLed);
+  EXPECT_LE(led_dimming::LevelToDutyCycle(derated),
+            led_dimming::LevelToDutyCycle(duty_cycle) *
+                Controller::kLedDeratePercent / 100);
+  EXPECT_GT(led_dimming::LevelToDutyCycle(derated + 1),
+            led_dimming::LevelToDutyCycle(duty_cycle) *
+                Controller::kLedDeratePercent / 100);
+  EXPECT_GT(derated, duty_cycle * 2 / 3);
+
+  temperature_sensor.SetTemperature(Controller::kLedDerateCelsius -
+                                    Controller::kThermalHysteresisCelsius);
+  advanceMillis(Controller::kTemperatureSampleIntervalMs + 1);
+  controller.Step();
+  EXPECT_FALSE(controller.IsLedDerated());
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), duty_cycle);
+}
+
 TEST_F(ControllerTest, Sleeps) {
   ASSERT_TRUE(controller.Init());
   EXPECT_EQ(controller.GetPowerMode(), PowerMode::kOff);
@@ -740,6 +931,251 @@ TEST_F(ControllerTest, Sleeps) {
   EXPECT_EQ(power_controller.GetSleep(), sleep_interval);
 }
 
+TEST_F(ControllerTest, SavesConfigBeforeSleeping) {
+  EEPROM.reset();
+  ASSERT_TRUE(controller.Init());
+  ConfigPb config = kDefaultConfig;
+  config.proximity_threshold = 182;
+  ASSERT_TRUE(ConfigStorage::SaveConfigDeferred(&config));
+
+  advanceMillis(Controller::kSleepLockoutMs + 1);
+  controller.Step();
+  ASSERT_NE(power_controller.GetSleep(), 0);
+  EXPECT_FALSE(ConfigStorage::HasPendingSave());
+
+  ConfigPb stored_config;
+  ASSERT_TRUE(ConfigStorage::TryLoadConfig(&stored_config));
+  EXPECT_EQ(stored_config.proximity_threshold, 182);
+  EEPROM.reset();
+}
+
+TEST_F(ControllerTest, DeratesLedForBattery) {
+  ASSERT_TRUE(controller.Init());
+  const ConfigPb& config = *controller.GetConfig();
+  const uint32_t duty_cycle = controller.GetLedDutyCycle();
+  const uint32_t reserve = config.battery_reserve_led_duty_cycle;
+
+  EXPECT_EQ(controller.DerateForBattery(duty_cycle, 100), duty_cycle);
+  EXPECT_EQ(controller.DerateForBattery(
+                duty_cycle, config.battery_derate_start_percent),
+            duty_cycle);
+  EXPECT_EQ(controller.DerateForBattery(duty_cycle,
+                                        config.battery_reserve_percent),
+            reserve);
+  EXPECT_EQ(controller.DerateForBattery(duty_cycle, 0), reserve);
+  // The reserve brightness never brightens a dim setting.
+  EXPECT_EQ(controller.DerateForBattery(reserve / 2, 0), reserve / 2);
+
+  // The power falls steadily in between.
+  uint32_t previous = duty_cycle;
+  for (uint8_t percent = config.battery_derate_start_percent - 1;
+       percent > config.battery_reserve_percent; percent--) {
+    const uint32_t derated = controller.DerateForBattery(duty_cycle, percent);
+    EXPECT_LT(derated, previous) << percent;
+    EXPECT_GT(derated, reserve) << percent;
+    previous = derated;
+  }
+  // Halfway between in charge is roughly halfway between in power.
+  const uint32_t halfway = controller.DerateForBattery(
+      duty_cycle, (config.battery_derate_start_percent +
+                   config.battery_reserve_percent) /
+                      2);
+  EXPECT_NEAR(led_dimming::LevelToDutyCycle(halfway),
+              (led_dimming::LevelToDutyCycle(duty_cycle) +
+               led_dimming::LevelToDutyCycle(reserve)) /
+                  2,
+              led_dimming::kMaxDutyCycle / 100);
+
+  ConfigPb disabled = config;
+  disabled.battery_derate_start_percent = 0;
+  controller.SetConfig(disabled);
+  EXPECT_EQ(controller.DerateForBattery(duty_cycle, 0), duty_cycle);
+}
+
+TEST_F(ControllerTest, DimsLedWhenBatteryIsLow) {
+  setDigitalRead(kPinBatteryNPowerGood, true);
+  setDigitalRead(kPinBatteryStat, false);
+  // About 23% charged.
+  setAnalogRead(AVREF, AdcReferenceForMillivolts(3210));
+  ASSERT_TRUE(controller.Init());
+  const uint8_t percent = controller.GetBatteryPercent();
+  ASSERT_LT(percent, controller.GetConfig()->battery_derate_start_percent);
+  ASSERT_GT(percent, controller.GetConfig()->battery_reserve_percent);
+
+  setDigitalRead(kPinPowerOn, false);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOn);
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed),
+            controller.DerateForBattery(controller.GetLedDutyCycle(), percent));
+  EXPECT_LT(getAnalogWrite(kPinWhiteLed), controller.GetLedDutyCycle());
+}
+
+TEST_F(ControllerTest, FadesLedWithDriver) {
+  ConfigPb config = kDefaultConfig;
+  config.ramp_up_time_ms = 255;
+  config.ramp_down_time_ms = 510;
+  controller.SetConfig(config);
+  ASSERT_TRUE(controller.Init());
+  setDigitalRead(kPinPowerOn, false);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOn);
+  controller.Step();
+
+  // The whole fade is handed to the driver at once.
+  EXPECT_EQ(led_driver.GetFadesStarted(), 1);
+  EXPECT_TRUE(led_driver.Fading());
+  advanceMillis(100);
+  controller.Step();
+  EXPECT_EQ(led_driver.Get(), 100);
+
+  // Turning off mid-way through the fade up starts the fade down from
+  // wherever the LED got to.
+  setDigitalRead(kPinPowerOn, true);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOff);
+  EXPECT_EQ(led_driver.GetFadesStarted(), 2);
+  EXPECT_EQ(led_driver.Get(), 110);
+  advanceMillis(4);
+  EXPECT_EQ(led_driver.Get(), 108);
+
+  advanceMillis(220);
+  controller.Step();
+  EXPECT_FALSE(led_driver.Fading());
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), 0);
+}
+
+TEST_F(ControllerTest, WaitsForFade) {
+  ConfigPb config = kDefaultConfig;
+  // 255 steps don't fit in the driver, so this plays back as 128 steps,
+  // 469ms apart.
+  config.ramp_down_time_ms = 60 * 1000;
+  controller.SetConfig(config);
+  ASSERT_TRUE(controller.Init());
+  setDigitalRead(kPinPowerOn, false);
+  advanceMillis(11);
+  controller.Step();
+  controller.Step();
+  ASSERT_EQ(getAnalogWrite(kPinWhiteLed), 255);
+
+  setDigitalRead(kPinPowerOn, true);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOff);
+  advanceMillis(Controller::kBatteryLevelDisplayTimeSeconds * 1000 + 1);
+  controller.Step();
+  ASSERT_TRUE(led_driver.Fading());
+  EXPECT_EQ(power_controller.GetSleep(), 0);
+  // The LED step leaves the idling to the main loop.
+  EXPECT_EQ(power_controller.GetIdle(), 0);
+  const uint32_t wait_ms = controller.GetLedStepWaitMs();
+  EXPECT_EQ(wait_ms, led_driver.FadeRemainingMs());
+  EXPECT_GT(wait_ms, Controller::kLedStepIntervalMs);
+
+  // Once the fade finishes, the device can go back to deep sleep.
+  advanceMillis(wait_ms);
+  controller.Step();
+  EXPECT_EQ(controller.GetLedStepWaitMs(), Controller::kLedStepIntervalMs);
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), 0);
+  EXPECT_NE(power_controller.GetSleep(), 0);
+}
+
+TEST_F(ControllerTest, CountsUsage) {
+  EEPROM.reset();
+  ASSERT_TRUE(controller.Init());
+  setDigitalRead(kPinPowerOn, false);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOn);
+
+  // Ramp up, then stay on for a while.
+  for (uint32_t i = 0; i < 10 * 1000; i++) {
+    advanceMillis(1);
+    controller.Step();
+  }
+  ASSERT_EQ(getAnalogWrite(kPinWhiteLed), controller.GetLedDutyCycle());
+  EXPECT_GE(controller.GetUsageStats().on_seconds, 9);
+  EXPECT_GE(controller.GetUsageStats().led_on_seconds, 9);
+  EXPECT_GE(controller.GetUsageStats().led_full_brightness_seconds, 9);
+  EXPECT_EQ(controller.GetUsageStats().off_seconds, 0);
+
+  setDigitalRead(kPinPowerOn, true);
+  setDigitalRead(kPinPowerAuto, false);
+  controller.Step();
+  setDigitalRead(kPinMotionSensor, true);
+  advanceMillis(20);
+  controller.Step();
+  EXPECT_EQ(controller.GetUsageStats().motion_triggers, 1);
+
+  // Nothing is saved while the LED is on.
+  advanceMillis(Controller::kUsageCheckpointIntervalMs + 1);
+  controller.Step();
+  UsageStatsPb stored_stats = UsageStatsPb_init_zero;
+  EXPECT_FALSE(ConfigStorage::TryLoadUsageStats(&stored_stats));
+  EEPROM.reset();
+}
+
+TEST_F(ControllerTest, SavesUsageStatsPeriodically) {
+  EEPROM.reset();
+  ASSERT_TRUE(controller.Init());
+  // Keep the device awake, with the LED off.
+  setDigitalRead(kPin5vDetect, true);
+  controller.Step();
+
+  advanceMillis(Controller::kUsageCheckpointIntervalMs);
+  controller.Step();
+  UsageStatsPb stored_stats = UsageStatsPb_init_zero;
+  EXPECT_FALSE(ConfigStorage::TryLoadUsageStats(&stored_stats));
+
+  advanceMillis(1);
+  controller.Step();
+  ASSERT_TRUE(ConfigStorage::TryLoadUsageStats(&stored_stats));
+  EXPECT_EQ(stored_stats.off_seconds,
+            Controller::kUsageCheckpointIntervalMs / 1000);
+
+  // The counters carry on from the saved values after a reboot.
+  FakeLedDriver rebooted_led_driver;
+  Controller rebooted{&temperature_sensor, &vcnl4020, &power_controller,
+                      &rebooted_led_driver};
+  ASSERT_TRUE(rebooted.Init());
+  EXPECT_EQ(rebooted.GetUsageStats().off_seconds,
+            Controller::kUsageCheckpointIntervalMs / 1000);
+
+  rebooted.ResetUsageStats();
+  ASSERT_TRUE(ConfigStorage::TryLoadUsageStats(&stored_stats));
+  EXPECT_EQ(stored_stats.off_seconds, 0);
+  EEPROM.reset();
+}
+
+TEST_F(ControllerTest, CountsWakeups) {
+  EEPROM.reset();
+  ASSERT_TRUE(controller.Init());
+  advanceMillis(Controller::kSleepLockoutMs + 1);
+  controller.Step();
+  ASSERT_NE(power_controller.GetSleep(), 0);
+  EXPECT_EQ(controller.GetUsageStats().timer_wakeups, 1);
+  EXPECT_EQ(controller.GetUsageStats().motion_wakeups, 0);
+  EEPROM.reset();
+}
+
+TEST_F(ControllerTest, RecordsStateChanges) {
+  ASSERT_TRUE(controller.Init());
+  const FlightRecorder& recorder = controller.GetFlightRecorder();
+  controller.Step();
+  const uint32_t idle_end = recorder.EndPosition();
+
+  setDigitalRead(kPinPowerOn, false);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOn);
+  ASSERT_GT(recorder.EndPosition(), idle_end);
+
+  // The first byte of the new record is the event type.
+  uint8_t event;
+  ASSERT_EQ(recorder.Read(idle_end, &event, 1), 1);
+  EXPECT_EQ(event, static_cast<uint8_t>(FlightRecorder::Event::kPowerMode));
+}
+
 TEST_F(ControllerTest, NoSleepWhenCharging) {
   ASSERT_TRUE(controller.Init());
   EXPECT_EQ(controller.GetPowerMode(), PowerMode::kOff);
@@ -858,12 +1294,13 @@ TEST_F(ControllerTest,
   EXPECT_EQ(controller.GetPowerMode(), PowerMode::kAuto);
   EXPECT_EQ(vcnl4020.GetPeriodicAmbient(), true);
 
+  // The sensor follows the config, without waiting for the mode to change.
   controller.SetConfig(
       {brightnessMode : BrightnessMode::BRIGHTNESS_MODE_DISABLED});
   advanceMillis(20);
   controller.Step();
   EXPECT_EQ(controller.GetPowerMode(), PowerMode::kAuto);
-  EXPECT_EQ(vcnl4020.GetPeriodicAmbient(), true);
+  EXPECT_EQ(vcnl4020.GetPeriodicAmbient(), false);
 }
 
 TEST_F(ControllerTest, UsesAmbientLightForAutoModeBrightnessModeOnWhenBelow) {
@@ -915,6 +1352,167 @@ TEST_F(ControllerTest, UsesAmbientLightForAutoModeBrightnessModeOnWhenBelow) {
   EXPECT_EQ(getAnalogWrite(kPinWhiteLed), 0);
 }
 
+TEST_F(ControllerTest, AdaptsBrightnessToDaylight) {
+  ConfigPb config = kDefaultConfig;
+  config.brightnessMode = BrightnessMode::BRIGHTNESS_MODE_ADAPTIVE;
+  config.autoBrightnessThreshold = 400;
+  controller.SetConfig(config);
+  ASSERT_TRUE(controller.Init());
+  setDigitalRead(kPinPowerAuto, false);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kAuto);
+  advanceMillis(controller.GetMotionTimeoutSeconds() * 1000 + 10);
+  controller.Step();
+  ASSERT_EQ(getAnalogWrite(kPinWhiteLed), 0);
+
+  // A reading with the LED off is all daylight.
+  vcnl4020.SetAmbient(100);
+  vcnl4020.SetAmbientReady();
+  controller.Step();
+
+  // The first time, the LED turns on fully, and its contribution is measured.
+  setDigitalRead(kPinMotionSensor, true);
+  advanceMillis(10);
+  controller.Step();
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), controller.GetLedDutyCycle());
+  vcnl4020.SetAmbient(900);
+  vcnl4020.SetAmbientReady();
+  advanceMillis(10);
+  controller.Step();
+
+  // Then it dims to add only the 300 that's missing, 3/8 of its full output.
+  const uint32_t dimmed = getAnalogWrite(kPinWhiteLed);
+  EXPECT_EQ(led_dimming::DutyCycleToLevel(led_dimming::kMaxDutyCycle * 3 / 8),
+            dimmed);
+
+  // Small changes in the reading are ignored.
+  vcnl4020.SetAmbient(405);
+  vcnl4020.SetAmbientReady();
+  advanceMillis(10);
+  controller.Step();
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), dimmed);
+
+  // More daylight means less LED.
+  vcnl4020.SetAmbient(600);
+  vcnl4020.SetAmbientReady();
+  advanceMillis(10);
+  controller.Step();
+  // The dimmed level is rounded, so the daylight estimate is slightly off.
+  EXPECT_NEAR(led_dimming::DutyCycleToLevel(led_dimming::kMaxDutyCycle / 8),
+              getAnalogWrite(kPinWhiteLed), 3);
+}
+
+TEST_F(ControllerTest, BlanksLedToMeasureDaylight) {
+  ConfigPb config = kDefaultConfig;
+  config.brightnessMode = BrightnessMode::BRIGHTNESS_MODE_ON_WHEN_BELOW;
+  config.autoBrightnessThreshold = 100;
+  controller.SetConfig(config);
+  vcnl4020.SetAmbient(50);
+  ASSERT_TRUE(controller.Init());
+  setDigitalRead(kPinPowerAuto, false);
+  setDigitalRead(kPinMotionSensor, true);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kAuto);
+  advanceMillis(10);
+  controller.Step();
+  ASSERT_EQ(getAnalogWrite(kPinWhiteLed), controller.GetLedDutyCycle());
+
+  // The LED stays on until it's time to measure.
+  advanceMillis(Controller::kAmbientBlankIntervalMs);
+  controller.Step();
+  EXPECT_FALSE(led_driver.GetBlanked());
+  EXPECT_EQ(vcnl4020.GetAmbientMeasurementsStarted(), 0);
+  advanceMillis(10);
+  controller.Step();
+  EXPECT_TRUE(led_driver.GetBlanked());
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), 0);
+  EXPECT_EQ(vcnl4020.GetAmbientMeasurementsStarted(), 1);
+
+  // It's still dark, so the LED comes back on.
+  vcnl4020.SetAmbientReady();
+  advanceMillis(5);
+  controller.Step();
+  EXPECT_FALSE(led_driver.GetBlanked());
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), controller.GetLedDutyCycle());
+  EXPECT_FALSE(vcnl4020.GetAmbientMeasurementPending());
+
+  // If the sensor doesn't respond, the blank doesn't last, and the periodic
+  // measurements resume.
+  advanceMillis(Controller::kAmbientBlankIntervalMs + 10);
+  controller.Step();
+  ASSERT_TRUE(led_driver.GetBlanked());
+  EXPECT_TRUE(vcnl4020.GetAmbientMeasurementPending());
+  advanceMillis(Controller::kAmbientBlankTimeoutMs + 1);
+  controller.Step();
+  EXPECT_FALSE(led_driver.GetBlanked());
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), controller.GetLedDutyCycle());
+  EXPECT_FALSE(vcnl4020.GetAmbientMeasurementPending());
+
+  // Once there's daylight, the LED turns off, even though there's motion.
+  advanceMillis(Controller::kAmbientBlankIntervalMs + 10);
+  controller.Step();
+  ASSERT_TRUE(led_driver.GetBlanked());
+  vcnl4020.SetAmbient(150);
+  vcnl4020.SetAmbientReady();
+  advanceMillis(5);
+  controller.Step();
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), 0);
+  for (int i = 0; i < 10; i++) {
+    advanceMillis(Controller::kBrightnessIgnorePeriodMs / 4);
+    controller.Step();
+    EXPECT_EQ(getAnalogWrite(kPinWhiteLed), 0);
+  }
+  EXPECT_EQ(vcnl4020.GetAmbientMeasurementsStarted(), 3);
+}
+
+TEST_F(ControllerTest, CancelsAbandonedAmbientMeasurement) {
+  ConfigPb config = kDefaultConfig;
+  config.brightnessMode = BrightnessMode::BRIGHTNESS_MODE_ON_WHEN_BELOW;
+  config.autoBrightnessThreshold = 100;
+  controller.SetConfig(config);
+  vcnl4020.SetAmbient(50);
+  ASSERT_TRUE(controller.Init());
+  setDigitalRead(kPinPowerAuto, false);
+  setDigitalRead(kPinMotionSensor, true);
+  advanceMillis(11);
+  controller.Step();
+  advanceMillis(10);
+  controller.Step();
+  advanceMillis(Controller::kAmbientBlankIntervalMs);
+  controller.Step();
+  advanceMillis(10);
+  controller.Step();
+  ASSERT_TRUE(led_driver.GetBlanked());
+  ASSERT_TRUE(vcnl4020.GetAmbientMeasurementPending());
+
+  // The sensor never finishes, so the measurement is abandoned, and the
+  // periodic measurements resume.
+  advanceMillis(Controller::kAmbientBlankTimeoutMs + 1);
+  controller.Step();
+  EXPECT_FALSE(led_driver.GetBlanked());
+  EXPECT_FALSE(vcnl4020.GetAmbientMeasurementPending());
+}
+
+TEST_F(ControllerTest, DoesntBlankLedWithoutBrightnessMode) {
+  ConfigPb config = kDefaultConfig;
+  config.brightnessMode = BrightnessMode::BRIGHTNESS_MODE_DISABLED;
+  controller.SetConfig(config);
+  ASSERT_TRUE(controller.Init());
+  setDigitalRead(kPinPowerAuto, false);
+  setDigitalRead(kPinMotionSensor, true);
+  advanceMillis(11);
+  controller.Step();
+  for (int i = 0; i < 10; i++) {
+    advanceMillis(Controller::kAmbientBlankIntervalMs / 2);
+    controller.Step();
+    EXPECT_EQ(getAnalogWrite(kPinWhiteLed), controller.GetLedDutyCycle());
+  }
+  EXPECT_EQ(led_driver.GetBlanks(), 0);
+  EXPECT_EQ(vcnl4020.GetAmbientMeasurementsStarted(), 0);
+}
+
 TEST_F(ControllerTest, RetriggersCorrectlyWithBrightnessInAutoMode) {
   controller.SetConfig({
     brightnessMode : BrightnessMode::BRIGHTNESS_MODE_ON_WHEN_BELOW,
@@ -1085,6 +1683,160 @@ TEST_F(ControllerTest, TogglesLedInProximityModeToggle) {
   EXPECT_EQ(getAnalogWrite(kPinWhiteLed), 0);
 }
 
+TEST_F(ControllerTest, TogglesDespiteProximityCrosstalk) {
+  controller.SetConfig({
+    proximity_mode : ProximityMode::PROXIMITY_MODE_TOGGLE,
+    proximity_threshold : 5,
+  });
+  ASSERT_TRUE(controller.Init());
+  CalibrationPb calibration = CalibrationPb_init_zero;
+  calibration.proximity_crosstalk = 200;
+  controller.SetCalibration(calibration);
+  setDigitalRead(kPinPowerAuto, false);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kAuto);
+
+  // Both readings are within the crosstalk, which would leave nothing to
+  // compare once it was removed.
+  vcnl4020.SetProximity(100);
+  vcnl4020.SetProximityReady();
+  advanceMillis(10);
+  controller.Step();
+  EXPECT_EQ(controller.GetPowerMode(), PowerMode::kAuto);
+
+  vcnl4020.SetProximity(150);
+  vcnl4020.SetProximityReady();
+  advanceMillis(10);
+  controller.Step();
+  EXPECT_EQ(controller.GetPowerMode(), PowerMode::kToggled);
+}
+
+TEST_F(ControllerTest, RunsSensorsForEachState) {
+  ConfigPb config = kDefaultConfig;
+  config.brightnessMode = BrightnessMode::BRIGHTNESS_MODE_ON_WHEN_BELOW;
+  config.proximity_mode = ProximityMode::PROXIMITY_MODE_TOGGLE;
+  controller.SetConfig(config);
+  ASSERT_TRUE(controller.Init());
+  controller.Step();
+  ASSERT_EQ(controller.GetState(), ControllerState::kOff);
+  EXPECT_FALSE(vcnl4020.GetPeriodicAmbient());
+  EXPECT_FALSE(vcnl4020.GetPeriodicProximity());
+  EXPECT_FALSE(power_controller.GetInterruptWakeupEnabled(kPinMotionSensor));
+
+  setDigitalRead(kPinPowerAuto, false);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetState(), ControllerState::kAuto);
+  EXPECT_TRUE(vcnl4020.GetPeriodicAmbient());
+  EXPECT_TRUE(vcnl4020.GetPeriodicProximity());
+  EXPECT_TRUE(power_controller.GetInterruptWakeupEnabled(kPinMotionSensor));
+
+  setAnalogRead(kPinCc1, ComputeAnalogValueForMillivolts(1800));
+  advanceMillis(Controller::kMotionProximityPeriodMs);
+  controller.Step();
+  ASSERT_EQ(controller.GetState(), ControllerState::kUsb);
+  EXPECT_TRUE(vcnl4020.GetPeriodicAmbient());
+  EXPECT_TRUE(vcnl4020.GetPeriodicProximity());
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), 0);
+
+  // Back on battery, the ambient light is still needed, but proximity is only
+  // measured after motion.
+  setAnalogRead(kPinCc1, 0);
+  advanceMillis(10);
+  controller.Step();
+  ASSERT_EQ(controller.GetState(), ControllerState::kAuto);
+  EXPECT_TRUE(vcnl4020.GetPeriodicAmbient());
+  EXPECT_FALSE(vcnl4020.GetPeriodicProximity());
+
+  setDigitalRead(kPinMotionSensor, true);
+  advanceMillis(10);
+  controller.Step();
+  EXPECT_TRUE(vcnl4020.GetPeriodicProximity());
+
+  setDigitalRead(kPinPowerAuto, true);
+  setDigitalRead(kPinPowerOn, false);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetState(), ControllerState::kOn);
+  EXPECT_FALSE(vcnl4020.GetPeriodicAmbient());
+  EXPECT_FALSE(vcnl4020.GetPeriodicProximity());
+  EXPECT_FALSE(power_controller.GetInterruptWakeupEnabled(kPinMotionSensor));
+}
+
+TEST_F(ControllerTest, RunsStepsSeparately) {
+  ASSERT_TRUE(controller.Init());
+  controller.Step();
+  ASSERT_EQ(controller.GetState(), ControllerState::kOff);
+
+  // Only StepMode reads the switch.
+  setDigitalRead(kPinPowerAuto, false);
+  advanceMillis(Controller::kModeStepIntervalMs);
+  controller.StepLed();
+  EXPECT_EQ(controller.GetPowerMode(), PowerMode::kOff);
+  controller.StepMode();
+  EXPECT_EQ(controller.GetPowerMode(), PowerMode::kAuto);
+  EXPECT_EQ(controller.GetState(), ControllerState::kOff);
+  controller.StepLed();
+  EXPECT_EQ(controller.GetState(), ControllerState::kAuto);
+  // Switching to auto turns the LED on straight away.
+  EXPECT_GT(led_driver.Get(), 0);
+
+  // Only StepPower detects USB.
+  setAnalogRead(kPinCc1, ComputeAnalogValueForMillivolts(1800));
+  advanceMillis(Controller::kLedStepIntervalMs);
+  controller.StepLed();
+  controller.StepMode();
+  EXPECT_EQ(controller.GetUSBStatus(), USBStatus::kNoConnection);
+  controller.StepPower();
+  EXPECT_EQ(controller.GetUSBStatus(), USBStatus::kUSB3_0);
+  controller.StepLed();
+  EXPECT_EQ(controller.GetState(), ControllerState::kUsb);
+}
+
+TEST_F(ControllerTest, CatchesShortMotionPulses) {
+  ASSERT_TRUE(controller.Init());
+  setDigitalRead(kPinPowerAuto, false);
+  advanceMillis(11);
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kAuto);
+  advanceMillis(controller.GetMotionTimeoutSeconds() * 1000 + 10);
+  controller.Step();
+  advanceMillis(Controller::kMotionPulseLengthMs + 10);
+  controller.Step();
+  ASSERT_EQ(getAnalogWrite(kPinWhiteLed), 0);
+
+  // The pulse was over before Step ran.
+  power_controller.AddPinEvent({kPinMotionSensor, /*rising=*/true, millis()});
+  advanceMillis(4);
+  controller.Step();
+  EXPECT_EQ(getAnalogWrite(kPinWhiteLed), controller.GetLedDutyCycle());
+  EXPECT_EQ(controller.GetMaxMotionLatencyMs(), 4);
+}
+
+TEST_F(ControllerTest, WaitsForSwitchToSettle) {
+  ASSERT_TRUE(controller.Init());
+  controller.Step();
+  ASSERT_EQ(controller.GetPowerMode(), PowerMode::kOff);
+
+  setDigitalRead(kPinPowerAuto, false);
+  power_controller.AddPinEvent({kPinPowerAuto, /*rising=*/false, millis()});
+  controller.Step();
+  EXPECT_EQ(controller.GetPowerMode(), PowerMode::kOff);
+
+  // Bouncing restarts the wait.
+  advanceMillis(Controller::kSwitchDebounceMs - 1);
+  power_controller.AddPinEvent({kPinPowerAuto, /*rising=*/false, millis()});
+  controller.Step();
+  EXPECT_EQ(controller.GetPowerMode(), PowerMode::kOff);
+  advanceMillis(Controller::kSwitchDebounceMs - 1);
+  controller.Step();
+  EXPECT_EQ(controller.GetPowerMode(), PowerMode::kOff);
+
+  advanceMillis(1);
+  controller.Step();
+  EXPECT_EQ(controller.GetPowerMode(), PowerMode::kAuto);
+}
+
 TEST_F(ControllerTest, HandlesMillisRollover) {
   pinMode(kPinPowerOn, OUTPUT);
   pinMode(kPinPowerAuto, OUTPUT);
@@ -1162,3 +1914,74 @@ TEST_F(ControllerTest, SetsSensitivityPins) {
   EXPECT_EQ(getPinMode(kPinSensitivityHigh2), OUTPUT);
   EXPECT_TRUE(getDigitalWrite(kPinSensitivityHigh2));
 }
+
+TEST_F(ControllerTest, AppliesPwmProfile) {
+  ASSERT_TRUE(controller.Init());
+  EXPECT_EQ(led_driver.GetPwm(),
+            (PwmSettings{LedDriver::kMinPwmFrequencyHz, /*dither=*/true}));
+
+  ConfigPb config = *controller.GetConfig();
+  config.pwm_profile = PwmProfile::PwmProfile_PWM_PROFILE_LOW_LOSS;
+  controller.SetConfig(config);
+  EXPECT_EQ(led_driver.GetPwm(),
+            (PwmSettings{LedDriver::kMinPwmFrequencyHz, /*dither=*/false}));
+
+  // UNSPECIFIED should be the same as HIGH_RESOLUTION.
+  config.pwm_profile = PwmProfile::PwmProfile_PWM_PROFILE_UNSPECIFIED;
+  config.pwm_frequency_hz = 100 * 1000;
+  controller.SetConfig(config);
+  EXPECT_EQ(led_driver.GetPwm(), (PwmSettings{100 * 1000, /*dither=*/true}));
+
+  // The frequency is limited to what the LED driver supports.
+  config.pwm_frequency_hz = 1000;
+  controller.SetConfig(config);
+  EXPECT_EQ(led_driver.GetPwm().frequency_hz, LedDriver::kMinPwmFrequencyHz);
+  config.pwm_frequency_hz = 10 * 1000 * 1000;
+  controller.SetConfig(config);
+  EXPECT_EQ(led_driver.GetPwm().frequency_hz, LedDriver::kMaxPwmFrequencyHz);
+}
+
+TEST_F(ControllerTest, UpdatesOnlyMaskedConfigFields) {
+  ASSERT_TRUE(controller.Init());
+
+  ConfigPb config = *controller.GetConfig();
+  config.motion_sensitivity =
+      MotionSensitivity::MotionSensitivity_MOTION_SENSITIVITY_TWO;
+  controller.SetConfig(config);
+  ASSERT_EQ(getPinMode(kPinSensitivityHigh1), OUTPUT);
+  // Detects if the sensitivity pins are reconfigured
+  pinMode(kPinSensitivityHigh1, INPUT);
+
+  ConfigPb update = ConfigPb_init_zero;
+  update.led_duty_cycle = 100;
+  update.motion_timeout_seconds = 1234;
+  controller.UpdateConfig(
+      update, Controller::ConfigFieldBit(ConfigPb_led_duty_cycle_tag));
+  EXPECT_EQ(controller.GetLedDutyCycle(), 100);
+  EXPECT_EQ(controller.GetMotionTimeoutSeconds(),
+            config.motion_timeout_seconds);
+  EXPECT_EQ(controller.GetConfig()->motion_sensitivity,
+            MotionSensitivity::MotionSensitivity_MOTION_SENSITIVITY_TWO);
+  EXPECT_EQ(getPinMode(kPinSensitivityHigh1), INPUT);
+
+  update.has_hardwareVersion = true;
+  update.hardwareVersion.major = 2;
+  controller.UpdateConfig(
+      update, Controller::ConfigFieldBit(ConfigPb_hardwareVersion_tag));
+  EXPECT_TRUE(controller.GetConfig()->has_hardwareVersion);
+  EXPECT_EQ(controller.GetConfig()->hardwareVersion.major, 2);
+  EXPECT_EQ(controller.GetLedDutyCycle(), 100);
+
+  update.led_duty_cycle = 1000;
+  controller.UpdateConfig(
+      update, Controller::ConfigFieldBit(ConfigPb_led_duty_cycle_tag));
+  EXPECT_EQ(controller.GetLedDutyCycle(), led_dimming::kMaxLevel);
+
+  update.motion_sensitivity =
+      MotionSensitivity::MotionSensitivity_MOTION_SENSITIVITY_THREE;
+  controller.UpdateConfig(
+      update, Controller::ConfigFieldBit(ConfigPb_motion_sensitivity_tag));
+  EXPECT_EQ(getPinMode(kPinSensitivityLow), OUTPUT);
+  EXPECT_EQ(getPinMode(kPinSensitivityHigh1), OUTPUT);
+  EXPECT_EQ(getPinMode(kPinSensitivityHigh2), OUTPUT);
+}
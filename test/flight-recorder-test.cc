@@ -0,0 +1,144 @@
+#include "flight-recorder.h"
+
+#include <gtest/gtest.h>
+#include <pb_encode.h>
+
+#include <array>
+#include <vector>
+
+#include "serial.pb.h"
+#include "types.h"
+
+namespace {
+
+using Event = FlightRecorder::Event;
+
+struct DecodedRecord {
+  Event event;
+  uint32_t millis;
+  int32_t value;
+};
+
+uint32_t ReadVarint(const std::vector<uint8_t> &data, size_t *index) {
+  uint32_t value = 0;
+  for (uint8_t shift = 0;; shift += 7) {
+    const uint8_t byte = data.at((*index)++);
+    value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+}
+
+// Reads and decodes everything in the recorder.
+std::vector<DecodedRecord> Decode(const FlightRecorder &recorder) {
+  std::vector<uint8_t> data(recorder.EndPosition() -
+                            recorder.StartPosition());
+  EXPECT_EQ(recorder.Read(recorder.StartPosition(), data.data(), data.size()),
+            data.size());
+
+  uint32_t millis = recorder.StartMillis();
+  std::array<int32_t, FlightRecorder::kEventCount> values;
+  for (size_t i = 0; i < values.size(); i++) {
+    values[i] = recorder.StartValue(static_cast<Event>(i));
+  }
+
+  std::vector<DecodedRecord> records;
+  size_t index = 0;
+  while (index < data.size()) {
+    const uint8_t event = data[index++];
+    millis += ReadVarint(data, &index);
+    const uint32_t zigzag = ReadVarint(data, &index);
+    values.at(event) += static_cast<int32_t>(zigzag >> 1) ^
+                        -static_cast<int32_t>(zigzag & 1);
+    records.push_back({static_cast<Event>(event), millis, values[event]});
+  }
+  return records;
+}
+
+class FlightRecorderTest : public ::testing::Test {
+ protected:
+  void SetUp() override { setMillis(0); }
+
+  FlightRecorder recorder;
+};
+
+TEST_F(FlightRecorderTest, RecordsEvents) {
+  advanceMillis(100);
+  recorder.Record(Event::kBatteryMillivolts, 3300);
+  advanceMillis(10);
+  recorder.Record(Event::kLedOn, 1);
+  advanceMillis(1000);
+  recorder.Record(Event::kBatteryMillivolts, 3290);
+
+  const std::vector<DecodedRecord> records = Decode(recorder);
+  ASSERT_EQ(records.size(), 3);
+  EXPECT_EQ(records[0].event, Event::kBatteryMillivolts);
+  EXPECT_EQ(records[0].millis, 100);
+  EXPECT_EQ(records[0].value, 3300);
+  EXPECT_EQ(records[1].event, Event::kLedOn);
+  EXPECT_EQ(records[1].millis, 110);
+  EXPECT_EQ(records[1].value, 1);
+  EXPECT_EQ(records[2].millis, 1110);
+  EXPECT_EQ(records[2].value, 3290);
+
+  // Small changes take few bytes.
+  EXPECT_EQ(recorder.EndPosition(), 4 + 3 + 4);
+}
+
+TEST_F(FlightRecorderTest, DropsOldestRecordsWhenFull) {
+  for (int32_t i = 0; i < 1000; i++) {
+    advanceMillis(i);
+    recorder.Record(Event::kProximity, i * 3);
+    recorder.Record(Event::kMotion, i % 2);
+  }
+  EXPECT_GT(recorder.StartPosition(), 0);
+  EXPECT_LE(recorder.EndPosition() - recorder.StartPosition(),
+            FlightRecorder::kBufferSize);
+
+  // Deltas from dropped records are kept, so the newest records decode to the
+  // right values.
+  const std::vector<DecodedRecord> records = Decode(recorder);
+  ASSERT_GE(records.size(), 2);
+  EXPECT_EQ(records[records.size() - 2].event, Event::kProximity);
+  EXPECT_EQ(records[records.size() - 2].value, 999 * 3);
+  EXPECT_EQ(records.back().event, Event::kMotion);
+  EXPECT_EQ(records.back().value, 1);
+  EXPECT_EQ(records.back().millis, millis());
+}
+
+TEST_F(FlightRecorderTest, DoesntReadOverwrittenData) {
+  for (int32_t i = 0; i < 1000; i++) {
+    recorder.Record(Event::kProximity, i);
+  }
+  uint8_t byte;
+  EXPECT_EQ(recorder.Read(0, &byte, 1), 0);
+  EXPECT_EQ(recorder.Read(recorder.EndPosition(), &byte, 1), 0);
+  EXPECT_EQ(recorder.Read(recorder.StartPosition(), &byte, 1), 1);
+}
+
+TEST_F(FlightRecorderTest, StreamsChunk) {
+  for (int32_t i = 0; i < 200; i++) {
+    recorder.Record(Event::kAmbientLight, i);
+  }
+  FlightRecorder::Chunk chunk = {&recorder, recorder.StartPosition() + 5, 20};
+  void *arg = &chunk;
+
+  std::array<uint8_t, 32> buffer;
+  pb_ostream_t stream = pb_ostream_from_buffer(buffer.data(), buffer.size());
+  pb_field_t field = {};
+  field.tag = FlightRecordPb_data_tag;
+  ASSERT_TRUE(FlightRecorder::EncodeChunk(&stream, &field, &arg));
+
+  std::array<uint8_t, 20> expected;
+  ASSERT_EQ(recorder.Read(chunk.position, expected.data(), expected.size()),
+            expected.size());
+  ASSERT_EQ(stream.bytes_written, 2 + expected.size());
+  EXPECT_EQ(buffer[0], (FlightRecordPb_data_tag << 3) | PB_WT_STRING);
+  EXPECT_EQ(buffer[1], expected.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(buffer[2 + i], expected[i]);
+  }
+}
+
+}  // namespace
@@ -0,0 +1,54 @@
+#include "internal-temperature-sensor.h"
+
+#include <gtest/gtest.h>
+
+#include "pins.h"
+#include "types.h"
+
+namespace {
+
+TEST(InternalTemperatureSensor, UsesFactoryCalibration) {
+  InternalTemperatureSensor sensor;
+  ASSERT_TRUE(sensor.Begin());
+
+  // V_DDA matches the calibration, at 3.0V.
+  setAnalogRead(kPinAdcReference, kFakeVrefintCal);
+
+  setAnalogRead(kPinTemperatureSensor, kFakeTemperatureCal1);
+  EXPECT_EQ(sensor.ReadTemperature(), 30);
+
+  setAnalogRead(kPinTemperatureSensor, kFakeTemperatureCal2);
+  EXPECT_EQ(sensor.ReadTemperature(), 130);
+
+  setAnalogRead(kPinTemperatureSensor,
+                (kFakeTemperatureCal1 + kFakeTemperatureCal2) / 2);
+  EXPECT_EQ(sensor.ReadTemperature(), 80);
+
+  setAnalogRead(kPinTemperatureSensor, kFakeTemperatureCal1 - 22);
+  EXPECT_EQ(sensor.ReadTemperature(), 20);
+}
+
+TEST(InternalTemperatureSensor, CorrectsForSupplyVoltage) {
+  InternalTemperatureSensor sensor;
+  ASSERT_TRUE(sensor.Begin());
+
+  // V_DDA is 3.75V, so readings are 80% of what they'd be at 3.0V.
+  setAnalogRead(kPinAdcReference, kFakeVrefintCal * 4 / 5);
+
+  setAnalogRead(kPinTemperatureSensor, kFakeTemperatureCal1 * 4 / 5);
+  EXPECT_EQ(sensor.ReadTemperature(), 30);
+
+  setAnalogRead(kPinTemperatureSensor, kFakeTemperatureCal2 * 4 / 5);
+  EXPECT_EQ(sensor.ReadTemperature(), 130);
+}
+
+TEST(InternalTemperatureSensor, HandlesMissingReference) {
+  InternalTemperatureSensor sensor;
+  ASSERT_TRUE(sensor.Begin());
+
+  setAnalogRead(kPinAdcReference, 0);
+  setAnalogRead(kPinTemperatureSensor, kFakeTemperatureCal1);
+  EXPECT_EQ(sensor.ReadTemperature(), 0);
+}
+
+}  // namespace
@@ -0,0 +1,104 @@
+#include "led-dimming.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using led_dimming::DutyCycleToLevel;
+using led_dimming::kGammaTable;
+using led_dimming::kMaxDutyCycle;
+using led_dimming::kMaxLevel;
+using led_dimming::LevelToDutyCycle;
+using led_dimming::SigmaDelta;
+
+// The table is generated at compile time.
+static_assert(kGammaTable[0] == 0);
+static_assert(kGammaTable[kMaxLevel] == kMaxDutyCycle);
+
+TEST(LedDimming, GammaTableIsMonotonic) {
+  for (uint32_t level = 1; level <= kMaxLevel; level++) {
+    EXPECT_GT(kGammaTable[level], kGammaTable[level - 1]) << level;
+  }
+}
+
+TEST(LedDimming, FollowsCieLightness) {
+  // Half the perceived lightness is about 18% of the luminance.
+  EXPECT_NEAR(LevelToDutyCycle(128), kMaxDutyCycle * 0.184, 200);
+  // The lowest level is far below the old 8-bit minimum of 3/255.
+  EXPECT_LT(LevelToDutyCycle(1), kMaxDutyCycle / 1000);
+  EXPECT_GT(LevelToDutyCycle(1), 0);
+  EXPECT_EQ(LevelToDutyCycle(kMaxLevel + 1), kMaxDutyCycle);
+}
+
+TEST(LedDimming, InvertsGammaTable) {
+  for (uint32_t level = 0; level <= kMaxLevel; level++) {
+    EXPECT_EQ(DutyCycleToLevel(LevelToDutyCycle(level)), level);
+  }
+  EXPECT_EQ(DutyCycleToLevel(LevelToDutyCycle(100) - 1), 99);
+  EXPECT_EQ(DutyCycleToLevel(LevelToDutyCycle(100) + 1), 100);
+}
+
+// Returns the average compare value of a pattern.
+double Average(const uint16_t *pattern, size_t length) {
+  double sum = 0;
+  for (size_t i = 0; i < length; i++) {
+    sum += pattern[i];
+  }
+  return sum / length;
+}
+
+TEST(LedDimming, DithersBetweenCompareValues) {
+  SigmaDelta modulator(1600, 19);
+  uint16_t pattern[64];
+
+  // 1600 * 0.25 = 400 ticks exactly, so there's nothing to dither.
+  EXPECT_FALSE(modulator.FillPattern(kMaxDutyCycle / 4 + 1, pattern, 64));
+  EXPECT_EQ(pattern[0], 400);
+
+  // 100.5 ticks alternates between 100 and 101.
+  const uint16_t duty_cycle = 100.5 / 1600 * kMaxDutyCycle + 0.5;
+  EXPECT_TRUE(modulator.FillPattern(duty_cycle, pattern, 64));
+  for (const uint16_t value : pattern) {
+    EXPECT_TRUE(value == 100 || value == 101) << value;
+  }
+  EXPECT_NEAR(Average(pattern, 64), 100.5, 1.0 / 64);
+}
+
+TEST(LedDimming, DithersBelowMinimumPulse) {
+  SigmaDelta modulator(1600, 19);
+  uint16_t pattern[64];
+
+  // The lowest level averages well under one tick, using only pulses that are
+  // long enough to turn the LED on.
+  const uint16_t duty_cycle = LevelToDutyCycle(1);
+  EXPECT_TRUE(modulator.FillPattern(duty_cycle, pattern, 64));
+  size_t on_count = 0;
+  for (const uint16_t value : pattern) {
+    EXPECT_TRUE(value == 0 || value >= 19) << value;
+    on_count += value != 0;
+  }
+  EXPECT_GT(on_count, 0);
+  EXPECT_NEAR(Average(pattern, 64), 1600.0 * duty_cycle / kMaxDutyCycle,
+              19.0 / 64);
+}
+
+TEST(LedDimming, RoundsToNearestCompareValue) {
+  // Without dithering, the LED driver outputs a fresh modulator's first value.
+  // 100.4 ticks rounds down, and 100.6 rounds up.
+  EXPECT_EQ(SigmaDelta(1600, 19).Next(100.4 / 1600 * kMaxDutyCycle + 0.5), 100);
+  EXPECT_EQ(SigmaDelta(1600, 19).Next(100.6 / 1600 * kMaxDutyCycle + 0.5), 101);
+  EXPECT_EQ(SigmaDelta(1600, 19).Next(kMaxDutyCycle / 4 + 1), 400);
+  // Below the minimum pulse, it rounds to off or the shortest pulse.
+  EXPECT_EQ(SigmaDelta(1600, 19).Next(9 / 1600.0 * kMaxDutyCycle), 0);
+  EXPECT_EQ(SigmaDelta(1600, 19).Next(10 / 1600.0 * kMaxDutyCycle), 19);
+}
+
+TEST(LedDimming, DoesNotDitherFullyOffOrOn) {
+  SigmaDelta modulator(1600, 19);
+  EXPECT_EQ(modulator.Next(LevelToDutyCycle(1)), 0);
+  EXPECT_EQ(modulator.Next(0), 0);
+  EXPECT_EQ(modulator.Next(0), 0);
+  EXPECT_EQ(modulator.Next(kMaxDutyCycle), 1600);
+}
+
+}  // namespace
@@ -20,7 +20,7 @@ namespace {
 
 TEST(Ramper, AllowsUnlimitedChangeByDefault) {
   setMillis(0);
-  Ramper ramper;
+  Ramper<int16_t> ramper;
 
   EXPECT_EQ(ramper.GetTarget(), 0);
   EXPECT_EQ(ramper.GetActual(), 0);
@@ -47,7 +47,7 @@ TEST(Ramper, AllowsUnlimitedChangeByDefault) {
 
 TEST(Ramper, LimitsChange) {
   setMillis(0);
-  Ramper ramper;
+  Ramper<int16_t> ramper;
   ramper.SetMaxIncrease(1, 1);  // Max increase of 1 per 1ms
   ramper.SetMaxDecrease(1, 1);  // Max decrease of 1 per 1ms
 
@@ -95,7 +95,7 @@ TEST(Ramper, LimitsChange) {
 
 TEST(Ramper, LimitsChangeAsymmetrically) {
   setMillis(0);
-  Ramper ramper;
+  Ramper<int16_t> ramper;
   ramper.SetMaxIncrease(2, 1);  // Increase by 2 per 1ms, decrease by 1 per 1ms.
   ramper.SetMaxDecrease(1, 1);  // This sets period_ms_ to 1
 
@@ -147,7 +147,7 @@ TEST(Ramper, LimitsChangeAsymmetrically) {
 
 TEST(Ramper, HandlesZeroStepLimit) {
   setMillis(0);
-  Ramper ramper;
+  Ramper<int16_t> ramper;
   ramper.SetMaxIncrease(0, 100);  // Increase is immediate
   ramper.SetMaxDecrease(5, 100);  // Decrease is limited
 
@@ -174,7 +174,7 @@ TEST(Ramper, HandlesZeroStepLimit) {
 
 TEST(Ramper, IncreaseMultipleChangesBelowThreshold) {
   setMillis(0);
-  Ramper ramper;
+  Ramper<int16_t> ramper;
 
   ramper.SetMaxIncrease(10, 10);
   ramper.SetMaxDecrease(10, 10);
@@ -184,13 +184,14 @@ TEST(Ramper, IncreaseMultipleChangesBelowThreshold) {
   ramper.Step();
   EXPECT_EQ(ramper.GetActual(), 5);
 
+  // The new ramp starts from where the last one finished.
   ramper.SetTarget(10);
   ramper.Step();
   EXPECT_EQ(ramper.GetActual(), 5);
 
-  advanceMillis(9);
+  advanceMillis(4);
   ramper.Step();
-  EXPECT_EQ(ramper.GetActual(), 5);
+  EXPECT_EQ(ramper.GetActual(), 9);
 
   advanceMillis(1);
   ramper.Step();
@@ -199,7 +200,7 @@ TEST(Ramper, IncreaseMultipleChangesBelowThreshold) {
 
 TEST(Ramper, DecreaseMultipleChangesBelowThreshold) {
   setMillis(0);
-  Ramper ramper;
+  Ramper<int16_t> ramper;
 
   ramper.SetMaxIncrease(10, 10);
   ramper.SetMaxDecrease(10, 10);
@@ -213,13 +214,147 @@ TEST(Ramper, DecreaseMultipleChangesBelowThreshold) {
   ramper.Step();
   EXPECT_EQ(ramper.GetActual(), -5);
 
-  advanceMillis(9);
+  advanceMillis(4);
   ramper.Step();
-  EXPECT_EQ(ramper.GetActual(), -5);
+  EXPECT_EQ(ramper.GetActual(), -9);
 
   advanceMillis(1);
   ramper.Step();
   EXPECT_EQ(ramper.GetActual(), -10);
 }
 
+TEST(Ramper, CatchesUpAfterGap) {
+  setMillis(0);
+  Ramper<int16_t> ramper;
+  ramper.SetMaxIncrease(100, 1000);
+
+  ramper.SetTarget(100);
+  advanceMillis(10);
+  ramper.Step();
+  EXPECT_EQ(ramper.GetActual(), 1);
+
+  // A long stall doesn't slow the ramp down.
+  advanceMillis(490);
+  ramper.Step();
+  EXPECT_EQ(ramper.GetActual(), 50);
+
+  advanceMillis(500);
+  ramper.Step();
+  EXPECT_EQ(ramper.GetActual(), 100);
+}
+
+TEST(Ramper, TakesExactlyTheRampTime) {
+  for (const uint16_t duty_cycle : {1, 7, 100, 255, 4095}) {
+    for (const uint32_t ramp_ms : {1, 3, 250, 1000, 1500, 60 * 1000}) {
+      setMillis(0);
+      Ramper<uint16_t> ramper;
+      ramper.SetMaxIncrease(duty_cycle, ramp_ms);
+      ramper.SetTarget(duty_cycle);
+
+      advanceMillis(ramp_ms - 1);
+      ramper.Step();
+      if (ramp_ms < duty_cycle) {
+        // Several units per millisecond, so the last step is still to come.
+        EXPECT_LT(ramper.GetActual(), duty_cycle)
+            << duty_cycle << " " << ramp_ms;
+      }
+      advanceMillis(1);
+      ramper.Step();
+      EXPECT_EQ(ramper.GetActual(), duty_cycle) << duty_cycle << " " << ramp_ms;
+    }
+  }
+}
+
+TEST(Ramper, ClampsHugeRates) {
+  setMillis(0);
+  Ramper<uint16_t> ramper;
+  // Unclamped, 512ms at this rate would overflow the distance to zero.
+  ramper.SetMaxIncrease(1u << 31, 1);
+  ramper.SetTarget(1000);
+  advanceMillis(512);
+  ramper.Step();
+  EXPECT_EQ(ramper.GetActual(), 1000);
+}
+
+TEST(Ramper, ReportsTimeUntilChange) {
+  setMillis(0);
+  Ramper<int16_t> ramper;
+  ramper.SetMaxIncrease(1, 10);
+  EXPECT_EQ(ramper.GetMillisUntilChange(), Ramper<int16_t>::kNoChange);
+
+  ramper.SetTarget(2);
+  EXPECT_EQ(ramper.GetMillisUntilChange(), 10);
+  advanceMillis(4);
+  EXPECT_EQ(ramper.GetMillisUntilChange(), 6);
+
+  advanceMillis(6);
+  EXPECT_EQ(ramper.GetMillisUntilChange(), 0);
+  ramper.Step();
+  EXPECT_EQ(ramper.GetActual(), 1);
+  EXPECT_EQ(ramper.GetMillisUntilChange(), 10);
+
+  advanceMillis(10);
+  ramper.Step();
+  EXPECT_EQ(ramper.GetMillisUntilChange(), Ramper<int16_t>::kNoChange);
+
+  // Without a limit, the change is due immediately.
+  ramper.SetMaxDecrease(0, 0);
+  ramper.SetTarget(0);
+  EXPECT_EQ(ramper.GetMillisUntilChange(), 0);
+}
+
+TEST(Ramper, BuildsProfileAsymmetrically) {
+  Ramper<int16_t> ramper;
+  ramper.SetMaxIncrease(10, 5);
+  ramper.SetMaxDecrease(20, 7);
+
+  int16_t profile[8];
+  uint32_t step_ms = 0;
+  ramper.SetTarget(25);
+  // 13ms at 2 per ms doesn't fit in 8 steps of 1ms, so use 2ms steps.
+  ASSERT_EQ(ramper.BuildProfile(profile, 8, &step_ms), 7);
+  EXPECT_EQ(step_ms, 2);
+  EXPECT_EQ(profile[0], 4);
+  EXPECT_EQ(profile[1], 8);
+  EXPECT_EQ(profile[5], 24);
+  EXPECT_EQ(profile[6], 25);
+
+  ramper.SetActual(50);
+  ramper.SetTarget(0);
+  // 50 at 20 per 7ms takes 17.5ms.
+  ASSERT_EQ(ramper.BuildProfile(profile, 8, &step_ms), 6);
+  EXPECT_EQ(step_ms, 3);
+  EXPECT_EQ(profile[0], 42);
+  EXPECT_EQ(profile[1], 33);
+  EXPECT_EQ(profile[4], 8);
+  EXPECT_EQ(profile[5], 0);
+}
+
+TEST(Ramper, CoarsensLongProfiles) {
+  Ramper<uint8_t> ramper;
+  ramper.SetMaxIncrease(255, 510);
+  ramper.SetTarget(255);
+
+  uint8_t profile[100];
+  uint32_t step_ms = 0;
+  // 255 steps don't fit, so each step covers more than one of the original
+  // ones.
+  ASSERT_EQ(ramper.BuildProfile(profile, 100, &step_ms), 85);
+  EXPECT_EQ(step_ms, 6);
+  EXPECT_EQ(profile[0], 3);
+  EXPECT_EQ(profile[83], 252);
+  EXPECT_EQ(profile[84], 255);
+}
+
+TEST(Ramper, BuildsEmptyProfileWithoutLimit) {
+  Ramper<int16_t> ramper;
+  int16_t profile[8];
+  uint32_t step_ms = 0;
+
+  EXPECT_EQ(ramper.BuildProfile(profile, 8, &step_ms), 0);
+
+  ramper.SetTarget(100);
+  EXPECT_EQ(ramper.BuildProfile(profile, 8, &step_ms), 0);
+}
+
 };  // namespace
@@ -0,0 +1,135 @@
+#include "scheduler.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace {
+
+// Records the order in which tasks ran.
+std::string runs;
+
+void RunA() { runs += "a"; }
+void RunB() { runs += "b"; }
+void RunC() { runs += "c"; }
+
+// Takes 3ms.
+void RunSlow() {
+  runs += "s";
+  advanceMillis(3);
+}
+
+class SchedulerTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    setMillis(1000);
+    runs.clear();
+  }
+
+  Scheduler scheduler;
+};
+
+TEST_F(SchedulerTest, RunsTasksAtTheirPeriods) {
+  const Scheduler::TaskId a = scheduler.AddTask("a", RunA, 10, 0);
+  const Scheduler::TaskId b = scheduler.AddTask("b", RunB, 25, 0);
+
+  // New tasks run straight away.
+  EXPECT_EQ(scheduler.Run(), 2);
+  EXPECT_EQ(runs, "ab");
+  EXPECT_EQ(scheduler.Run(), 0);
+  EXPECT_EQ(scheduler.GetMillisUntilDue(), 10);
+
+  for (int i = 0; i < 50; i++) {
+    advanceMillis(1);
+    scheduler.Run();
+  }
+  EXPECT_EQ(scheduler.GetStats(a).runs, 6);
+  EXPECT_EQ(scheduler.GetStats(b).runs, 3);
+  EXPECT_EQ(scheduler.GetMillisUntilDue(), 10);
+}
+
+TEST_F(SchedulerTest, RunsHigherPriorityFirst) {
+  scheduler.AddTask("a", RunA, 10, 1);
+  scheduler.AddTask("b", RunB, 10, 2);
+  scheduler.AddTask("c", RunC, 10, 1);
+  scheduler.Run();
+  EXPECT_EQ(runs, "bac");
+}
+
+TEST_F(SchedulerTest, RunsNotifiedTasks) {
+  const Scheduler::TaskId a = scheduler.AddTask("a", RunA, 0, 0);
+  scheduler.AddTask("b", RunB, 100, 0);
+  scheduler.Run();
+  runs.clear();
+
+  // A task without a period only runs when notified.
+  advanceMillis(50);
+  EXPECT_EQ(scheduler.Run(), 0);
+  scheduler.Notify(a);
+  EXPECT_EQ(scheduler.GetMillisUntilDue(), 0);
+  EXPECT_EQ(scheduler.Run(), 1);
+  EXPECT_EQ(runs, "a");
+  EXPECT_EQ(scheduler.GetMillisUntilDue(), 50);
+}
+
+// Puts off its next run by 30ms, the first time it runs.
+Scheduler *deferring_scheduler = nullptr;
+Scheduler::TaskId deferring_task = Scheduler::kNoTask;
+void RunDeferring() {
+  if (runs.empty()) {
+    deferring_scheduler->RunAfter(deferring_task, 30);
+  }
+  runs += "d";
+}
+
+TEST_F(SchedulerTest, RunsTaskAfterRequestedDelay) {
+  deferring_scheduler = &scheduler;
+  deferring_task = scheduler.AddTask("d", RunDeferring, 10, 0);
+  EXPECT_EQ(scheduler.Run(), 1);
+  EXPECT_EQ(scheduler.GetMillisUntilDue(), 30);
+
+  advanceMillis(29);
+  EXPECT_EQ(scheduler.Run(), 0);
+  advanceMillis(1);
+  EXPECT_EQ(scheduler.Run(), 1);
+
+  // The period applies again after that.
+  EXPECT_EQ(scheduler.GetMillisUntilDue(), 10);
+  EXPECT_EQ(runs, "dd");
+
+  // A delay of 0 makes the task due straight away.
+  scheduler.RunAfter(deferring_task, 0);
+  EXPECT_EQ(scheduler.GetMillisUntilDue(), 0);
+}
+
+TEST_F(SchedulerTest, DoesntWaitWithoutPeriodicTasks) {
+  scheduler.AddTask("a", RunA, 0, 0);
+  scheduler.Run();
+  EXPECT_EQ(scheduler.GetMillisUntilDue(), Scheduler::kNoTaskDue);
+}
+
+TEST_F(SchedulerTest, RecordsLongestRun) {
+  const Scheduler::TaskId slow = scheduler.AddTask("slow", RunSlow, 10, 0);
+  const Scheduler::TaskId a = scheduler.AddTask("a", RunA, 10, 0);
+  scheduler.Run();
+  EXPECT_EQ(scheduler.GetName(slow), std::string("slow"));
+  EXPECT_EQ(scheduler.GetStats(slow).runs, 1);
+  EXPECT_EQ(scheduler.GetStats(slow).max_duration_us, 3000);
+  EXPECT_EQ(scheduler.GetStats(a).max_duration_us, 0);
+
+  scheduler.ResetStats();
+  EXPECT_EQ(scheduler.GetStats(slow).runs, 0);
+  EXPECT_EQ(scheduler.GetStats(slow).max_duration_us, 0);
+}
+
+TEST_F(SchedulerTest, RejectsTooManyTasks) {
+  for (size_t i = 0; i < Scheduler::kMaxTasks; i++) {
+    EXPECT_EQ(scheduler.AddTask("a", RunA, 10, 0), i);
+  }
+  EXPECT_EQ(scheduler.AddTask("b", RunB, 10, 0), Scheduler::kNoTask);
+  scheduler.Notify(Scheduler::kNoTask);
+  scheduler.Run();
+  EXPECT_EQ(runs, std::string(Scheduler::kMaxTasks, 'a'));
+}
+
+}  // namespace
@@ -18,10 +18,13 @@
 
 #include "config-storage.h"
 #include "controller.h"
+#include "fake-led-driver.h"
 #include "fake-power-controller.h"
 #include "fake-serial-port.h"
 #include "fake-temperature-sensor.h"
 #include "fake-vcnl4020.h"
+#include "flight-recorder.h"
+#include "pins.h"
 #include "types.h"
 
 namespace {
@@ -29,6 +32,7 @@ namespace {
 class SerialManagerTest : public ::testing::Test {
  protected:
   void SetUp() override {
+    ConfigStorage::DiscardPendingSave();
     serial_port.Reset();
     controller.SetConfig({
       version : 1,
@@ -46,8 +50,10 @@ class SerialManagerTest : public ::testing::Test {
   FakeSerialPort serial_port;
   FakeTemperatureSensor temperature_sensor;
   FakeVCNL4020 vcnl4020;
+  FakeLedDriver led_driver;
 
-  Controller controller{&temperature_sensor, &vcnl4020, &power_controller};
+  Controller controller{&temperature_sensor, &vcnl4020, &power_controller,
+                        &led_driver};
   SerialManager serial_manager{&serial_port, &controller};
 };
 
@@ -74,6 +80,7 @@ TEST_F(SerialManagerTest, RoundTripConfig) {
   EXPECT_TRUE(response.has_status);
 
   ConfigPb storedConfig;
+  ConfigStorage::Flush();
   ASSERT_TRUE(ConfigStorage::TryLoadConfig(&storedConfig));
   EXPECT_EQ(storedConfig.version, 1);
   EXPECT_EQ(storedConfig.proximity_threshold, 182);
@@ -135,4 +142,412 @@ TEST_F(SerialManagerTest, ReturnsStatus) {
   EXPECT_STREQ(response.status.firmware_version, FIRMWARE_VERSION);
 }
 
+TEST_F(SerialManagerTest, HandlesPipelinedRequests) {
+  SerialRequest request = SerialRequest_init_zero;
+  request.has_config = true;
+  request.config = kDefaultConfig;
+  request.config.proximity_threshold = 42;
+  request.request_id = 1;
+  request.has_request_id = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+
+  request = SerialRequest_init_zero;
+  request.request_config = true;
+  request.has_request_config = true;
+  request.request_id = 2;
+  request.has_request_id = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+
+  // Trailing status-only requests are coalesced
+  for (uint32_t id = 3; id <= 5; id++) {
+    request = SerialRequest_init_zero;
+    request.request_id = id;
+    request.has_request_id = true;
+    serial_port.WritePb(SerialRequest_msg, request);
+  }
+
+  serial_manager.Step();
+
+  SerialResponse response;
+  serial_port.ReadPb(SerialResponse_msg, &response);
+  EXPECT_EQ(response.request_id, 1);
+  EXPECT_FALSE(response.has_config);
+  EXPECT_TRUE(response.has_status);
+
+  serial_port.ReadPb(SerialResponse_msg, &response);
+  EXPECT_EQ(response.request_id, 2);
+  ASSERT_TRUE(response.has_config);
+  EXPECT_EQ(response.config.proximity_threshold, 42);
+
+  serial_port.ReadPb(SerialResponse_msg, &response);
+  EXPECT_EQ(response.request_id, 5);
+  EXPECT_FALSE(response.has_config);
+  EXPECT_TRUE(response.has_status);
+
+  EXPECT_FALSE(serial_port.HasOutput());
+}
+
+TEST_F(SerialManagerTest, MeasuresLatencyOfEachPipelinedRequest) {
+  SerialRequest request = SerialRequest_init_zero;
+  request.request_config = true;
+  request.has_request_config = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_port.SetResponseMillis(2);
+  serial_manager.Step();
+
+  // The second request waited while the first was answered, but that isn't
+  // part of its own latency.
+  const LinkStatsPb stats = serial_manager.GetLinkStats();
+  EXPECT_EQ(stats.frames_received, 2);
+  EXPECT_EQ(stats.max_latency_micros, 2000);
+  EXPECT_EQ(stats.mean_latency_micros, 2000);
+}
+
+TEST_F(SerialManagerTest, DoesNothingWithoutInput) {
+  serial_manager.Step();
+  EXPECT_FALSE(serial_port.HasOutput());
+}
+
+TEST_F(SerialManagerTest, CountsLinkStats) {
+  SerialRequest request = SerialRequest_init_zero;
+  serial_port.WritePb(SerialRequest_msg, request);
+  // Claims to be 2 bytes long, but isn't a valid message
+  serial_port.WriteBytes("\x02\xFF\xFF");
+  serial_port.SetRxBufferFull();
+  serial_manager.Step();
+
+  LinkStatsPb stats = serial_manager.GetLinkStats();
+  EXPECT_EQ(stats.frames_received, 2);
+  EXPECT_EQ(stats.decode_failures, 1);
+  EXPECT_EQ(stats.encode_failures, 0);
+  EXPECT_EQ(stats.rx_buffer_full, 1);
+  EXPECT_GT(stats.bytes_received, 3);
+  EXPECT_GT(stats.bytes_sent, 0);
+
+  serial_port.Reset();
+  request.request_link_stats = true;
+  request.has_request_link_stats = true;
+  request.reset_link_stats = true;
+  request.has_reset_link_stats = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+
+  SerialResponse response;
+  serial_port.ReadPb(SerialResponse_msg, &response);
+  ASSERT_TRUE(response.has_link_stats);
+  EXPECT_EQ(response.link_stats.frames_received, 3);
+  EXPECT_EQ(response.link_stats.decode_failures, 1);
+  EXPECT_EQ(response.link_stats.rx_buffer_full, 1);
+
+  stats = serial_manager.GetLinkStats();
+  EXPECT_EQ(stats.frames_received, 0);
+  EXPECT_EQ(stats.decode_failures, 0);
+  EXPECT_EQ(stats.rx_buffer_full, 0);
+  EXPECT_EQ(stats.bytes_received, 0);
+}
+
+TEST_F(SerialManagerTest, DiscardsStalePartialFrame) {
+  // Length prefix, but no message
+  serial_port.WriteBytes("\x05\x08");
+  serial_manager.Step();
+  EXPECT_FALSE(serial_port.HasOutput());
+
+  advanceMillis(SerialManager::kPartialFrameTimeoutMs + 1);
+  serial_manager.Step();
+  EXPECT_EQ(serial_manager.GetLinkStats().decode_failures, 1);
+
+  serial_port.Reset();
+  SerialRequest request = SerialRequest_init_zero;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+  EXPECT_TRUE(serial_port.HasOutput());
+}
+
+TEST_F(SerialManagerTest, PreviewsConfigWithoutSaving) {
+  EEPROM.reset();
+  const uint32_t original_duty_cycle = controller.GetLedDutyCycle();
+
+  SerialRequest request = SerialRequest_init_zero;
+  request.has_config = true;
+  request.config = *controller.GetConfig();
+  request.config.led_duty_cycle = 100;
+  request.preview_config = true;
+  request.has_preview_config = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+
+  ConfigPb stored_config;
+  EXPECT_EQ(controller.GetLedDutyCycle(), 100);
+  EXPECT_FALSE(ConfigStorage::TryLoadConfig(&stored_config));
+
+  request.config.led_duty_cycle = 120;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+  EXPECT_EQ(controller.GetLedDutyCycle(), 120);
+  EXPECT_FALSE(ConfigStorage::TryLoadConfig(&stored_config));
+
+  request = SerialRequest_init_zero;
+  request.revert_config = true;
+  request.has_revert_config = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+  EXPECT_EQ(controller.GetLedDutyCycle(), original_duty_cycle);
+  EXPECT_FALSE(ConfigStorage::TryLoadConfig(&stored_config));
+}
+
+TEST_F(SerialManagerTest, CommitsPreviewedConfig) {
+  EEPROM.reset();
+
+  SerialRequest request = SerialRequest_init_zero;
+  request.has_config = true;
+  request.config = *controller.GetConfig();
+  request.config.led_duty_cycle = 100;
+  request.preview_config = true;
+  request.has_preview_config = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+
+  request = SerialRequest_init_zero;
+  request.commit_config = true;
+  request.has_commit_config = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+
+  ConfigPb stored_config;
+  ConfigStorage::Flush();
+  ASSERT_TRUE(ConfigStorage::TryLoadConfig(&stored_config));
+  EXPECT_EQ(stored_config.led_duty_cycle, 100);
+  EXPECT_EQ(controller.GetLedDutyCycle(), 100);
+
+  // Committed configs aren't reverted
+  advanceMillis(SerialManager::kConfigPreviewTimeoutMs + 1);
+  serial_manager.Step();
+  EXPECT_EQ(controller.GetLedDutyCycle(), 100);
+}
+
+TEST_F(SerialManagerTest, RevertsPreviewedConfigAfterTimeout) {
+  const uint32_t original_duty_cycle = controller.GetLedDutyCycle();
+
+  SerialRequest request = SerialRequest_init_zero;
+  request.has_config = true;
+  request.config = *controller.GetConfig();
+  request.config.led_duty_cycle = 100;
+  request.preview_config = true;
+  request.has_preview_config = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+  EXPECT_EQ(controller.GetLedDutyCycle(), 100);
+
+  advanceMillis(SerialManager::kConfigPreviewTimeoutMs);
+  serial_manager.Step();
+  EXPECT_EQ(controller.GetLedDutyCycle(), 100);
+
+  advanceMillis(1);
+  serial_manager.Step();
+  EXPECT_EQ(controller.GetLedDutyCycle(), original_duty_cycle);
+}
+
+TEST_F(SerialManagerTest, AppliesPartialConfigUpdate) {
+  ConfigPb config = kDefaultConfig;
+  config.proximity_threshold = 182;
+  controller.SetConfig(config);
+
+  SerialRequest request = SerialRequest_init_zero;
+  request.has_config = true;
+  request.config.led_duty_cycle = 0;
+  request.config.proximity_threshold = 99;
+  request.has_config_field_mask = true;
+  request.config_field_mask =
+      Controller::ConfigFieldBit(ConfigPb_led_duty_cycle_tag);
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+
+  EXPECT_EQ(controller.GetLedDutyCycle(), 0);
+  EXPECT_EQ(controller.GetConfig()->proximity_threshold, 182);
+  EXPECT_EQ(controller.GetMotionTimeoutSeconds(),
+            kDefaultConfig.motion_timeout_seconds);
+
+  ConfigPb stored_config;
+  ConfigStorage::Flush();
+  ASSERT_TRUE(ConfigStorage::TryLoadConfig(&stored_config));
+  EXPECT_EQ(stored_config.led_duty_cycle, 0);
+  EXPECT_EQ(stored_config.proximity_threshold, 182);
+}
+
+TEST_F(SerialManagerTest, NegotiatesBaudRate) {
+  ASSERT_EQ(serial_port.GetBaudRate(), SerialPort::kDefaultBaudRate);
+
+  SerialRequest request = SerialRequest_init_zero;
+  request.has_baud_rate = true;
+  request.baud_rate = 921600;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+
+  SerialResponse response;
+  serial_port.ReadPb(SerialResponse_msg, &response);
+  EXPECT_TRUE(response.has_baud_rate);
+  EXPECT_EQ(response.baud_rate, 921600);
+  EXPECT_EQ(serial_port.GetBaudRate(), 921600);
+
+  // A valid request at the new rate confirms it
+  serial_port.Reset();
+  advanceMillis(SerialManager::kBaudRateConfirmTimeoutMs / 2);
+  request = SerialRequest_init_zero;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+  serial_port.ReadPb(SerialResponse_msg, &response);
+  EXPECT_FALSE(response.has_baud_rate);
+
+  advanceMillis(SerialManager::kBaudRateConfirmTimeoutMs * 2);
+  serial_manager.Step();
+  EXPECT_EQ(serial_port.GetBaudRate(), 921600);
+}
+
+TEST_F(SerialManagerTest, FallsBackToDefaultBaudRate) {
+  SerialRequest request = SerialRequest_init_zero;
+  request.has_baud_rate = true;
+  request.baud_rate = 460800;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+  EXPECT_EQ(serial_port.GetBaudRate(), 460800);
+
+  serial_port.Reset();
+  advanceMillis(SerialManager::kBaudRateConfirmTimeoutMs);
+  serial_manager.Step();
+  EXPECT_EQ(serial_port.GetBaudRate(), 460800);
+
+  advanceMillis(1);
+  serial_manager.Step();
+  EXPECT_EQ(serial_port.GetBaudRate(), SerialPort::kDefaultBaudRate);
+}
+
+TEST_F(SerialManagerTest, RejectsUnsupportedBaudRate) {
+  SerialRequest request = SerialRequest_init_zero;
+  request.has_baud_rate = true;
+  request.baud_rate = 12345;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+
+  SerialResponse response;
+  serial_port.ReadPb(SerialResponse_msg, &response);
+  EXPECT_TRUE(response.has_baud_rate);
+  EXPECT_EQ(response.baud_rate, SerialPort::kDefaultBaudRate);
+  EXPECT_EQ(serial_port.GetBaudRate(), SerialPort::kDefaultBaudRate);
+}
+
+TEST_F(SerialManagerTest, SavesConfigInBackground) {
+  EEPROM.reset();
+
+  SerialRequest request = SerialRequest_init_zero;
+  request.has_config = true;
+  request.config = *controller.GetConfig();
+  request.config.led_duty_cycle = 100;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+  request.config.led_duty_cycle = 120;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+  EXPECT_EQ(controller.GetLedDutyCycle(), 120);
+
+  // Nothing is written until the config stops changing.
+  ConfigPb stored_config;
+  EXPECT_TRUE(ConfigStorage::HasPendingSave());
+  EXPECT_EQ(EEPROM.max_write_count(), 0);
+  advanceMillis(ConfigStorage::kSaveQuietPeriodMs);
+  serial_manager.Step();
+  EXPECT_EQ(EEPROM.max_write_count(), 0);
+  advanceMillis(1);
+
+  // Then the config is written a little at a time.
+  uint32_t steps = 0;
+  while (ConfigStorage::HasPendingSave()) {
+    uint32_t writes_before = 0;
+    for (size_t i = 0; i < EEPROMClass::kSize; i++) {
+      writes_before += EEPROM.write_count(i);
+    }
+    serial_manager.Step();
+    uint32_t writes_after = 0;
+    for (size_t i = 0; i < EEPROMClass::kSize; i++) {
+      writes_after += EEPROM.write_count(i);
+    }
+    EXPECT_LE(writes_after - writes_before,
+              ConfigStorage::kFlushBytesPerStep);
+    ASSERT_LT(++steps, EEPROMClass::kSize);
+  }
+  EXPECT_GT(steps, 1);
+
+  ASSERT_TRUE(ConfigStorage::TryLoadConfig(&stored_config));
+  EXPECT_EQ(stored_config.led_duty_cycle, 120);
+}
+
+TEST_F(SerialManagerTest, ReadsAndResetsUsageStats) {
+  EEPROM.reset();
+  controller.ResetUsageStats();
+  advanceMillis(2000);
+  controller.Step();
+  ASSERT_GT(controller.GetUsageStats().off_seconds, 0);
+
+  SerialRequest request = SerialRequest_init_zero;
+  request.request_usage_stats = true;
+  request.has_request_usage_stats = true;
+  request.reset_usage_stats = true;
+  request.has_reset_usage_stats = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+
+  SerialResponse response = SerialResponse_init_zero;
+  serial_port.ReadPb(SerialResponse_msg, &response);
+  ASSERT_TRUE(response.has_usage_stats);
+  EXPECT_GT(response.usage_stats.off_seconds, 0);
+  EXPECT_EQ(controller.GetUsageStats().off_seconds, 0);
+  EEPROM.reset();
+}
+
+TEST_F(SerialManagerTest, SetsAndReadsCalibration) {
+  EEPROM.reset();
+  SerialRequest request = SerialRequest_init_zero;
+  request.calibration = CalibrationPb_init_zero;
+  request.calibration.proximity_crosstalk = 123;
+  request.has_calibration = true;
+  request.request_calibration = true;
+  request.has_request_calibration = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+
+  SerialResponse response = SerialResponse_init_zero;
+  serial_port.ReadPb(SerialResponse_msg, &response);
+  ASSERT_TRUE(response.has_calibration);
+  EXPECT_EQ(response.calibration.proximity_crosstalk, 123);
+  EXPECT_EQ(controller.GetCalibration().proximity_crosstalk, 123);
+
+  CalibrationPb stored = CalibrationPb_init_zero;
+  ASSERT_TRUE(ConfigStorage::TryLoadCalibration(&stored));
+  EXPECT_EQ(stored.proximity_crosstalk, 123);
+  EEPROM.reset();
+}
+
+TEST_F(SerialManagerTest, DownloadsFlightRecord) {
+  // Turning the light on records the power mode change.
+  setDigitalRead(kPinPowerOn, false);
+  setDigitalRead(kPinPowerAuto, true);
+  controller.Step();
+  const FlightRecorder &recorder = controller.GetFlightRecorder();
+  ASSERT_GT(recorder.EndPosition(), recorder.StartPosition());
+
+  SerialRequest request = SerialRequest_init_zero;
+  request.flight_record_position = 0;
+  request.has_flight_record_position = true;
+  serial_port.WritePb(SerialRequest_msg, request);
+  serial_manager.Step();
+
+  SerialResponse response = SerialResponse_init_zero;
+  serial_port.ReadPb(SerialResponse_msg, &response);
+  ASSERT_TRUE(response.has_flight_record);
+  EXPECT_EQ(response.flight_record.start_position, recorder.StartPosition());
+  EXPECT_EQ(response.flight_record.end_position, recorder.EndPosition());
+  EXPECT_EQ(response.flight_record.data_position, recorder.StartPosition());
+  EXPECT_EQ(response.flight_record.start_values_count,
+            FlightRecorder::kEventCount);
+}
+
 }  // namespace
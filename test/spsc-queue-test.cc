@@ -0,0 +1,55 @@
+#include "spsc-queue.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+TEST(SpscQueue, ReturnsItemsInOrder) {
+  SpscQueue<int, 4> queue;
+  int item = 0;
+  EXPECT_TRUE(queue.Empty());
+  EXPECT_FALSE(queue.Pop(&item));
+
+  EXPECT_TRUE(queue.Push(1));
+  EXPECT_TRUE(queue.Push(2));
+  EXPECT_FALSE(queue.Empty());
+  ASSERT_TRUE(queue.Pop(&item));
+  EXPECT_EQ(item, 1);
+  ASSERT_TRUE(queue.Pop(&item));
+  EXPECT_EQ(item, 2);
+  EXPECT_FALSE(queue.Pop(&item));
+  EXPECT_TRUE(queue.Empty());
+}
+
+TEST(SpscQueue, DropsItemsWhenFull) {
+  SpscQueue<int, 4> queue;
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(queue.Push(i));
+  }
+  EXPECT_FALSE(queue.Push(4));
+  EXPECT_EQ(queue.Dropped(), 1);
+
+  // The oldest items are kept.
+  int item = 0;
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(queue.Pop(&item));
+    EXPECT_EQ(item, i);
+  }
+  EXPECT_FALSE(queue.Pop(&item));
+}
+
+TEST(SpscQueue, WrapsAround) {
+  SpscQueue<int, 4> queue;
+  int item = 0;
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(queue.Push(i));
+    ASSERT_TRUE(queue.Push(-i));
+    ASSERT_TRUE(queue.Pop(&item));
+    EXPECT_EQ(item, i);
+    ASSERT_TRUE(queue.Pop(&item));
+    EXPECT_EQ(item, -i);
+  }
+  EXPECT_EQ(queue.Dropped(), 0);
+}
+
+}  // namespace